@@ -1,4 +1,6 @@
 #include <iostream>
+#include <fstream>
+#include <iterator>
 #include <vector>
 #include <cstdint>
 #include <chrono>
@@ -9,19 +11,57 @@
 #include <atomic>
 #include <thread>
 #include <random>
+#include <memory>
+#include <type_traits>
+#include <tuple>
+#include <stdexcept>
+#include <cassert>
+#include <bit>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 // --- 1. DATA STRUCTURES ---
-enum class Side
+enum class Side : uint8_t
 {
 	Buy,
 	Sell
 };
-enum class OrderType
+enum class OrderType : uint8_t
 {
 	Market,
 	Limit,
 	Stop,
-	StopLimit
+	StopLimit,
+	Pegged
+};
+
+// Reference a pegged order tracks: the same side's best (Primary), the
+// opposite side's best (Market) or the midpoint of the two (Mid).
+enum class PegType : uint8_t
+{
+	Primary,
+	Market,
+	Mid
 };
 
 struct TradeReport
@@ -33,27 +73,303 @@ struct TradeReport
 	uint64_t timestamp;
 };
 
+enum class EventType
+{
+	Reduced,
+	Requeued,
+	Repriced,
+	Replaced,
+	Rejected,
+	Halted, // continuous trading stopped, book moved to auction
+	Resumed // auction uncrossed, continuous trading restarted
+};
+
+enum class RejectReason : uint8_t
+{
+	None,
+	PriceBand,
+	MaxQuantity,
+	MaxNotional,
+	Halted,
+	RiskLimit,
+	Throttled,
+	DuplicateId,  // the new id of a replace is already live
+	JournalFailed, // the gateway's journal writer has failed
+	Unauthorized,  // auction control from a session other than the gateway's admin session
+	InvalidQuote   // crossed quote, or a quote leg whose id rests on the other side
+};
+
+struct OrderEvent
+{
+	EventType type;
+	Side side;
+	RejectReason reason; // set for Rejected only
+	uint64_t orderId;
+	uint64_t refId; // previous id for Replaced, 0 otherwise
+	uint32_t qty;
+	int64_t price;
+	uint64_t timestamp;
+};
+
+// Market-by-price feed message. A Level message carries a displayed price
+// level's new aggregate; qty 0 means the level is gone. A top-N snapshot is
+// SnapshotBegin, then each side's best levels best first as Snapshot
+// messages, then SnapshotEnd. seq numbers every message of one book, so a
+// consumer sees a gap when the ring overflowed and resyncs from the next
+// snapshot. book tells apart books that share one ring. timestamp is the
+// engine clock when the change happened.
+enum class DepthMsgType : uint8_t
+{
+	Level,
+	SnapshotBegin,
+	Snapshot,
+	SnapshotEnd
+};
+
+struct DepthUpdate
+{
+	DepthMsgType type;
+	Side side;
+	uint16_t book;
+	uint32_t orders;
+	int64_t price;
+	uint64_t qty;
+	uint64_t timestamp;
+	uint64_t seq;
+};
+
+// Market-by-order feed event, one per change to a displayed order. ref is
+// the order id. other is the id a Renumber or a moving Delete continues as,
+// or the match number of an execution (the trade's timestamp). HiddenTrade
+// reports a fill against a hidden or pegged order without naming it.
+enum class OrderFeedType : uint8_t
+{
+	Add,	  // rests at the back of its level's displayed queue
+	Execute,  // shares traded; the order leaves the book at zero
+	Cancel,	  // shares removed, priority kept
+	Delete,	  // removed with shares left
+	Replace,  // removed and re-added at the back with new shares/price
+	Renumber, // id changes, priority kept
+	HiddenTrade
+};
+
+struct OrderFeedEvent
+{
+	OrderFeedType type;
+	Side side;
+	uint32_t shares;
+	uint64_t ref;
+	uint64_t other;
+	int64_t price;
+	uint64_t timestamp;
+};
+
+// Pre-trade protection. bandBps is the half-width of the accepted price
+// band around the reference price; zero fields disable that check.
+struct PriceBandConfig
+{
+	int64_t bandBps = 0;
+	bool followLastTrade = true; // re-centre the band on every trade
+	uint32_t maxQty = 0;
+	int64_t maxNotional = 0;
+};
+
+// Halts continuous trading when trade prices span more than moveBps of the
+// window low within `window` ticks of the engine clock. Zero disables it.
+struct CircuitBreakerConfig
+{
+	int64_t moveBps = 0;
+	uint64_t window = 0;
+};
+
+enum class TradingState : uint8_t
+{
+	Continuous,
+	Auction
+};
+
+struct QuoteLeg
+{
+	uint64_t orderId;
+	uint32_t qty;
+	int64_t price;
+};
+
+enum class CommandType : uint8_t
+{
+	NewOrder,
+	NewPegged,
+	Cancel,
+	Modify,
+	Replace,
+	MassQuote,
+	StartAuction,
+	EndAuction,
+	MassCancel
+};
+
+// One inbound command in fixed binary form: the unit the gateway sequences,
+// journals and applies. A MassQuote carries its bid in id/qty/price and its
+// ask in newId/askQty/askPrice; a MassCancel its account in account and its
+// sides in qty (bit 0 buys, bit 1 sells).
+struct Command
+{
+	CommandType type;
+	Side side;
+	OrderType orderType;
+	PegType pegType;
+	bool hidden;
+	uint32_t qty;
+	uint32_t minQty;
+	uint32_t account;
+	uint32_t askQty;
+	uint64_t id;
+	uint64_t newId;
+	int64_t price; // peg offset for NewPegged
+	int64_t stopPrice;
+	int64_t askPrice;
+};
+
+// Per-order attributes beyond the basic limit/market/stop fields.
+struct OrderOptions
+{
+	uint32_t minQty = 0; // minimum quantity per execution against this order once resting
+	bool hidden = false; // rests non-displayed, behind displayed orders at its price
+	uint32_t account = 0; // index into the RiskManager, if one is attached
+};
+
+// Self-relative pointer: holds the distance from its own address to the
+// target, so structures linked with it stay valid wherever their memory is
+// mapped. Zero is null (nothing points at itself).
+template <typename T>
+class OffsetPtr
+{
+	int64_t off = 0;
+
+	void set(const T *p)
+	{
+		off = p ? reinterpret_cast<intptr_t>(p) - reinterpret_cast<intptr_t>(this) : 0;
+	}
+
+public:
+	OffsetPtr() = default;
+	OffsetPtr(std::nullptr_t) {}
+	OffsetPtr(T *p) { set(p); }
+	OffsetPtr(const OffsetPtr &o) { set(o.get()); }
+	OffsetPtr &operator=(const OffsetPtr &o)
+	{
+		set(o.get());
+		return *this;
+	}
+	OffsetPtr &operator=(T *p)
+	{
+		set(p);
+		return *this;
+	}
+
+	T *get() const { return off ? reinterpret_cast<T *>(reinterpret_cast<intptr_t>(this) + off) : nullptr; }
+	operator T *() const { return get(); }
+	T *operator->() const { return get(); }
+};
+
+// Pool objects link to each other through OffsetPtr only, so the pools can
+// live in a file mapping that is reattached at a different address.
 struct Order
 {
 	uint64_t id;
 	Side side;
 	OrderType type;
+	PegType pegType; // only meaningful for OrderType::Pegged
+	bool hidden;
 	uint32_t shares;
-	int64_t price;
+	uint32_t minQty;
+	uint32_t account;
+	int64_t price; // peg offset for OrderType::Pegged
 	int64_t stopPrice;
-	Order *next = nullptr, *prev = nullptr, *nextFree = nullptr;
-	struct Limit *parentLimit = nullptr;
+	OffsetPtr<Order> next, prev, nextFree;
+	OffsetPtr<struct Limit> parentLimit;
 };
 
+// Displayed orders queue at head/tail and are what totalShares/orderCount
+// aggregate. Hidden orders queue separately behind them at the same price.
 struct Limit
 {
 	int64_t price;
-	Order *head = nullptr, *tail = nullptr;
-	Limit *left = nullptr, *right = nullptr, *nextFree = nullptr;
+	OffsetPtr<Order> head, tail;
+	uint64_t totalShares = 0;
+	uint32_t orderCount = 0;
+	uint32_t minQtyCount = 0; // orders with a minimum quantity, either queue
+	OffsetPtr<Order> hiddenHead, hiddenTail;
+	uint64_t hiddenShares = 0;
+	OffsetPtr<Limit> left, right, nextFree;
 	int height = 1;
 
 	Limit() = default;
 	explicit Limit(int64_t p) : price(p) {}
+
+	bool empty() const { return !head && !hiddenHead; }
+};
+
+// Pegged orders sharing a peg type and offset rest in one FIFO level that
+// lives outside the price trees. The level's price holds the offset; the
+// effective price is derived from the BBO only when matching reaches it.
+struct PegGroup
+{
+	PegType type;
+	int64_t offset;
+	Limit *level;
+};
+
+// Displayed best bid/ask used as the peg reference for one match.
+struct BookTop
+{
+	bool hasBid = false, hasAsk = false;
+	int64_t bid = 0, ask = 0;
+};
+
+// Published best bid/offer and last trade. A quantity of zero means that
+// side is empty. seq counts published changes. The depth fields aggregate
+// the best few displayed levels of each side (shares, and price * shares)
+// so the signals below need nothing beyond one snapshot.
+struct BboSnapshot
+{
+	int64_t bidPrice = 0, askPrice = 0;
+	uint64_t bidQty = 0, askQty = 0;
+	int64_t lastPrice = 0;
+	uint32_t lastQty = 0;
+	uint64_t timestamp = 0;
+	uint64_t seq = 0;
+	uint64_t bidDepth = 0, askDepth = 0;
+	int64_t bidNotional = 0, askNotional = 0;
+
+	bool twoSided() const { return bidQty && askQty; }
+
+	// (bid - ask) / (bid + ask) at the touch, in [-1, 1]
+	double imbalance() const
+	{
+		return twoSided() ? (static_cast<double>(bidQty) - static_cast<double>(askQty)) / (bidQty + askQty) : 0.0;
+	}
+
+	// Mid weighted towards the side with less size at the touch
+	double microprice() const
+	{
+		return twoSided() ? (static_cast<double>(bidPrice) * askQty + static_cast<double>(askPrice) * bidQty) / (bidQty + askQty)
+						  : 0.0;
+	}
+
+	// The same over the depth fields, each side at its average price
+	double depthImbalance() const
+	{
+		return twoSided() ? (static_cast<double>(bidDepth) - static_cast<double>(askDepth)) / (bidDepth + askDepth) : 0.0;
+	}
+
+	double depthWeightedMid() const
+	{
+		if (!twoSided())
+			return 0.0;
+		double bid = static_cast<double>(bidNotional) / bidDepth, ask = static_cast<double>(askNotional) / askDepth;
+		return (bid * askDepth + ask * bidDepth) / (bidDepth + askDepth);
+	}
 };
 
 struct TriggeredStop
@@ -63,19 +379,20 @@ struct TriggeredStop
 	OrderType convertToType;
 	uint32_t shares;
 	int64_t limitPrice;
+	uint32_t account;
 };
 
 // --- 2. LOCK-FREE RING BUFFER ---
-template <size_t SIZE>
+template <size_t SIZE, typename T = TradeReport>
 class RingBuffer
 {
 	static_assert((SIZE & (SIZE - 1)) == 0, "SIZE must be power of 2");
-	std::array<TradeReport, SIZE> buffer;
+	std::array<T, SIZE> buffer;
 	alignas(64) std::atomic<uint64_t> writePos{0};
 	alignas(64) std::atomic<uint64_t> readPos{0};
 
 public:
-	bool push(const TradeReport &t)
+	bool push(const T &t)
 	{
 		uint64_t wp = writePos.load(std::memory_order_relaxed);
 		if (wp - readPos.load(std::memory_order_acquire) >= SIZE)
@@ -85,7 +402,7 @@ public:
 		return true;
 	}
 
-	bool pop(TradeReport &t)
+	bool pop(T &t)
 	{
 		uint64_t rp = readPos.load(std::memory_order_relaxed);
 		if (rp >= writePos.load(std::memory_order_acquire))
@@ -99,6 +416,223 @@ public:
 	{
 		return writePos.load(std::memory_order_acquire) - readPos.load(std::memory_order_acquire);
 	}
+
+	// Monotonic counts of items ever pushed / popped
+	uint64_t writePosition() const { return writePos.load(std::memory_order_acquire); }
+	uint64_t readPosition() const { return readPos.load(std::memory_order_acquire); }
+};
+
+// Seqlock slot for one book's BBO and depth aggregates, two cache lines
+// with the touch in the first. The single writer makes the version odd,
+// stores the fields and makes it even again; a reader retries if the
+// version was odd or moved while it copied. Fields are relaxed atomics,
+// plain moves on x86, so the race is defined.
+struct alignas(64) BboSlot
+{
+	std::atomic<uint64_t> version{0};
+	std::atomic<int64_t> bidPrice{0}, askPrice{0};
+	std::atomic<uint64_t> bidQty{0}, askQty{0};
+	std::atomic<int64_t> lastPrice{0};
+	std::atomic<uint64_t> timestamp{0};
+	std::atomic<uint32_t> lastQty{0};
+	std::atomic<uint64_t> bidDepth{0}, askDepth{0};
+	std::atomic<int64_t> bidNotional{0}, askNotional{0};
+
+	void publish(const BboSnapshot &b)
+	{
+		uint64_t v = version.load(std::memory_order_relaxed);
+		version.store(v + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		bidPrice.store(b.bidPrice, std::memory_order_relaxed);
+		askPrice.store(b.askPrice, std::memory_order_relaxed);
+		bidQty.store(b.bidQty, std::memory_order_relaxed);
+		askQty.store(b.askQty, std::memory_order_relaxed);
+		lastPrice.store(b.lastPrice, std::memory_order_relaxed);
+		timestamp.store(b.timestamp, std::memory_order_relaxed);
+		lastQty.store(b.lastQty, std::memory_order_relaxed);
+		bidDepth.store(b.bidDepth, std::memory_order_relaxed);
+		askDepth.store(b.askDepth, std::memory_order_relaxed);
+		bidNotional.store(b.bidNotional, std::memory_order_relaxed);
+		askNotional.store(b.askNotional, std::memory_order_relaxed);
+		version.store(v + 2, std::memory_order_release);
+	}
+
+	// Lock-free from any thread; spins only while a write is in progress
+	BboSnapshot read() const
+	{
+		BboSnapshot b;
+		uint64_t v;
+		do
+		{
+			while ((v = version.load(std::memory_order_acquire)) & 1)
+				;
+			b.bidPrice = bidPrice.load(std::memory_order_relaxed);
+			b.askPrice = askPrice.load(std::memory_order_relaxed);
+			b.bidQty = bidQty.load(std::memory_order_relaxed);
+			b.askQty = askQty.load(std::memory_order_relaxed);
+			b.lastPrice = lastPrice.load(std::memory_order_relaxed);
+			b.timestamp = timestamp.load(std::memory_order_relaxed);
+			b.lastQty = lastQty.load(std::memory_order_relaxed);
+			b.bidDepth = bidDepth.load(std::memory_order_relaxed);
+			b.askDepth = askDepth.load(std::memory_order_relaxed);
+			b.bidNotional = bidNotional.load(std::memory_order_relaxed);
+			b.askNotional = askNotional.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+		} while (version.load(std::memory_order_relaxed) != v);
+		b.seq = v / 2;
+		return b;
+	}
+};
+static_assert(sizeof(BboSlot) == 128);
+
+// Immutable depth images for query threads. Three buffers hold full-depth
+// images of one book, best level first. The writer patches the oldest
+// buffer no reader holds with the level changes logged since that buffer
+// was last current, then swaps it in, so publishing costs the number of
+// changes, not the number of levels. A reader announces the buffer it
+// holds in its own slot and re-checks that it is still current, hazard
+// pointer style; the writer never reuses an announced buffer. If every
+// spare buffer is held, publish() skips and the changes wait in the log.
+struct DepthLevel
+{
+	int64_t price;
+	uint64_t qty;
+	uint32_t orders;
+};
+
+struct DepthImage
+{
+	std::vector<DepthLevel> bids, asks;
+	uint64_t version = 0; // publishes so far
+	uint64_t timestamp = 0;
+};
+
+class DepthImages
+{
+	static constexpr int BUFFERS = 3;
+	static constexpr int MAX_READERS = 16;
+
+	struct Change
+	{
+		Side side;
+		uint32_t orders;
+		int64_t price;
+		uint64_t qty;
+	};
+
+	struct alignas(64) ReaderSlot
+	{
+		std::atomic<int> held{-1};
+		std::atomic<bool> taken{false};
+	};
+
+	DepthImage images[BUFFERS];
+	alignas(64) std::atomic<int> current{0};
+	ReaderSlot readers[MAX_READERS];
+	// Changes since version logStart; version logStart + k + 1 ends at
+	// log[ends[k]]
+	std::vector<Change> log;
+	std::vector<size_t> ends;
+	uint64_t logStart = 0;
+
+	static void apply(DepthImage &img, const Change &c)
+	{
+		bool buy = c.side == Side::Buy;
+		auto &levels = buy ? img.bids : img.asks;
+		auto it = std::lower_bound(levels.begin(), levels.end(), c.price, [buy](const DepthLevel &l, int64_t p)
+								   { return buy ? l.price > p : l.price < p; });
+		if (it != levels.end() && it->price == c.price)
+		{
+			if (c.qty)
+				*it = {c.price, c.qty, c.orders};
+			else
+				levels.erase(it);
+		}
+		else if (c.qty)
+			levels.insert(it, {c.price, c.qty, c.orders});
+	}
+
+	bool held(int image) const
+	{
+		for (const ReaderSlot &r : readers)
+			if (r.held.load(std::memory_order_seq_cst) == image)
+				return true;
+		return false;
+	}
+
+public:
+	// Writer side, on the book's thread
+	void record(Side side, int64_t price, uint64_t qty, uint32_t orders) { log.push_back({side, orders, price, qty}); }
+
+	// Starts every buffer from the same image, e.g. a book just loaded
+	void reset(const DepthImage &img)
+	{
+		for (DepthImage &b : images)
+			b = img;
+		log.clear();
+		ends.clear();
+		logStart = img.version;
+	}
+
+	bool publish(uint64_t timestamp)
+	{
+		int cur = current.load(std::memory_order_relaxed);
+		int target = -1;
+		for (int i = 0; i < BUFFERS; ++i)
+			if (i != cur && !held(i) && (target < 0 || images[i].version < images[target].version))
+				target = i;
+		if (target < 0)
+			return false;
+
+		DepthImage &img = images[target];
+		size_t from = img.version == logStart ? 0 : ends[img.version - logStart - 1];
+		for (size_t i = from; i < log.size(); ++i)
+			apply(img, log[i]);
+		ends.push_back(log.size());
+		img.version = logStart + ends.size();
+		img.timestamp = timestamp;
+		current.store(target, std::memory_order_seq_cst);
+
+		// Drop what every buffer has already applied
+		uint64_t oldest = img.version;
+		for (const DepthImage &b : images)
+			oldest = std::min(oldest, b.version);
+		if (oldest > logStart)
+		{
+			size_t k = oldest - logStart, cut = ends[k - 1];
+			log.erase(log.begin(), log.begin() + cut);
+			ends.erase(ends.begin(), ends.begin() + k);
+			for (size_t &e : ends)
+				e -= cut;
+			logStart = oldest;
+		}
+		return true;
+	}
+
+	// Reader side, any thread. A reader takes a slot once and then pins
+	// the current image with acquire() until release().
+	int attachReader()
+	{
+		for (int i = 0; i < MAX_READERS; ++i)
+			if (!readers[i].taken.exchange(true, std::memory_order_acq_rel))
+				return i;
+		return -1;
+	}
+
+	void detachReader(int slot) { readers[slot].taken.store(false, std::memory_order_release); }
+
+	const DepthImage &acquire(int slot)
+	{
+		int i;
+		do
+		{
+			i = current.load(std::memory_order_seq_cst);
+			readers[slot].held.store(i, std::memory_order_seq_cst);
+		} while (current.load(std::memory_order_seq_cst) != i);
+		return images[i];
+	}
+
+	void release(int slot) { readers[slot].held.store(-1, std::memory_order_release); }
 };
 
 // --- 3. STATISTICAL ORDER GENERATOR ---
@@ -201,22 +735,283 @@ public:
 };
 
 // --- 4. MEMORY ARENA ---
+// Order id index: open addressing with linear probing and backward-shift
+// deletion, so a lookup touches one contiguous run of slots. Slots are
+// owned and grow at half load, or are bound to a fixed array in a mapped
+// region, where they hold OffsetPtrs like the pools.
+class OrderIndex
+{
+public:
+	struct Slot
+	{
+		uint64_t id;
+		OffsetPtr<Order> order; // null: empty
+	};
+
+private:
+	std::vector<Slot> owned;
+	Slot *slots;
+	uint64_t mask;
+	uint64_t ownCount = 0;
+	uint64_t *count = &ownCount;
+	bool bound = false;
+
+	static uint64_t hash(uint64_t id)
+	{
+		id ^= id >> 33;
+		id *= 0xff51afd7ed558ccdULL;
+		return id ^ (id >> 33);
+	}
+
+	void grow()
+	{
+		std::vector<Slot> old(std::move(owned));
+		owned = std::vector<Slot>(old.size() * 2);
+		slots = owned.data();
+		mask = owned.size() - 1;
+		for (const Slot &e : old)
+			if (e.order)
+				slots[probe(e.id)] = e;
+	}
+
+	// Slot holding id, or the empty slot where it would go
+	uint64_t probe(uint64_t id) const
+	{
+		uint64_t i = hash(id) & mask;
+		while (slots[i].order && slots[i].id != id)
+			i = (i + 1) & mask;
+		return i;
+	}
+
+public:
+	OrderIndex() : owned(1024), slots(owned.data()), mask(1023) {}
+	OrderIndex(const OrderIndex &) = delete;
+	OrderIndex &operator=(const OrderIndex &) = delete;
+
+	// Uses a region's slot array (capacity a power of two, at least twice
+	// the order pool, so it never fills) and its live count
+	void bind(Slot *s, uint64_t capacity, uint64_t *liveCount)
+	{
+		owned = {};
+		slots = s;
+		mask = capacity - 1;
+		count = liveCount;
+		bound = true;
+	}
+
+	Order *find(uint64_t id) const { return slots[probe(id)].order; }
+
+	// Inserts id, or repoints it if present
+	void assign(uint64_t id, Order *o)
+	{
+		if (!bound && (*count + 1) * 2 > mask + 1)
+			grow();
+		Slot &e = slots[probe(id)];
+		if (!e.order)
+			++*count;
+		e.id = id;
+		e.order = o;
+	}
+
+	bool erase(uint64_t id)
+	{
+		uint64_t i = probe(id);
+		if (!slots[i].order)
+			return false;
+		// Pull back later members of the run that may not sit past the hole
+		for (uint64_t j = (i + 1) & mask; slots[j].order; j = (j + 1) & mask)
+		{
+			uint64_t home = hash(slots[j].id) & mask;
+			if (((j - home) & mask) >= ((j - i) & mask))
+			{
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+		slots[i].order = nullptr;
+		--*count;
+		return true;
+	}
+
+	void reserve(uint64_t n)
+	{
+		while (!bound && n * 2 > mask + 1)
+			grow();
+	}
+
+	size_t size() const { return *count; }
+	bool empty() const { return *count == 0; }
+};
+
+// Header of a file-backed pool region. The order and limit pools follow it,
+// then the slot arrays of the resting and stop order indexes. The indexes
+// are kept up to date in place; OrderBook::persist stores the remaining
+// roots and scalar state.
+struct BookRegion
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t clean;				   // set by persist, cleared on attach
+	uint64_t orderSize, limitSize; // layout of the build that created the region
+	uint64_t orderCapacity, limitCapacity, indexCapacity;
+	OffsetPtr<Order> freeOrder;
+	OffsetPtr<Limit> freeLimit;
+	OffsetPtr<Limit> buyRoot, sellRoot, stopBuyRoot, stopSellRoot;
+	OffsetPtr<Limit> buyPegs, sellPegs; // peg group levels chained through Limit::right
+	uint64_t orderCount, stopOrderCount; // live counts of the two id indexes
+	uint64_t lastSeq;
+	uint64_t timestampCounter, generatedIdCounter, rejectCount, haltCount;
+	int64_t referencePrice;
+	PriceBandConfig bandConfig;
+	CircuitBreakerConfig breakerConfig;
+	TradingState tradingState;
+};
+
 class MemoryManager
 {
 	std::vector<Order> oPool;
 	std::vector<Limit> lPool;
-	Order *fOrder;
-	Limit *fLimit;
+	Order *fOrder = nullptr;
+	Limit *fLimit = nullptr;
+	BookRegion *region = nullptr;
+	size_t regionBytes = 0;
+
+	void chainFree(Order *orders, size_t nOrders, Limit *limits, size_t nLimits)
+	{
+		for (size_t i = 0; i < nOrders - 1; ++i)
+			orders[i].nextFree = &orders[i + 1];
+		fOrder = &orders[0];
+		for (size_t i = 0; i < nLimits - 1; ++i)
+			limits[i].nextFree = &limits[i + 1];
+		fLimit = &limits[0];
+	}
+
+	static size_t align64(size_t n) { return (n + 63) & ~size_t(63); }
+	static size_t ordersOffset() { return align64(sizeof(BookRegion)); }
+	static size_t limitsOffset(size_t nOrders) { return align64(ordersOffset() + nOrders * sizeof(Order)); }
+	static size_t indexOffset(size_t nOrders) { return align64(limitsOffset(nOrders) + nOrders / 5 * sizeof(Limit)); }
+	static size_t regionSize(size_t nOrders, size_t indexCap) { return indexOffset(nOrders) + 2 * indexCap * sizeof(OrderIndex::Slot); }
 
 public:
 	MemoryManager(size_t n) : oPool(n), lPool(n / 5)
 	{
-		for (size_t i = 0; i < oPool.size() - 1; ++i)
-			oPool[i].nextFree = &oPool[i + 1];
-		fOrder = &oPool[0];
-		for (size_t i = 0; i < lPool.size() - 1; ++i)
-			lPool[i].nextFree = &lPool[i + 1];
-		fLimit = &lPool[0];
+		chainFree(oPool.data(), oPool.size(), lPool.data(), lPool.size());
+	}
+
+	// Pools in a file mapping, set up by createRegion or attachRegion
+	MemoryManager() = default;
+	MemoryManager(const MemoryManager &) = delete;
+	MemoryManager &operator=(const MemoryManager &) = delete;
+	~MemoryManager()
+	{
+		if (region)
+			munmap(region, regionBytes);
+	}
+
+	// Creates (truncating) a region file sized for n orders and maps the
+	// pools from it
+	bool createRegion(const char *path, size_t n)
+	{
+		if (region || !oPool.empty() || n < 5)
+			return false;
+		size_t nLimits = n / 5;
+		size_t indexCap = 1;
+		while (indexCap < 2 * n)
+			indexCap <<= 1;
+		size_t bytes = regionSize(n, indexCap);
+		int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			return false;
+		void *base = (::ftruncate(fd, static_cast<off_t>(bytes)) == 0)
+						 ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+						 : MAP_FAILED;
+		::close(fd);
+		if (base == MAP_FAILED)
+			return false;
+
+		char *b = static_cast<char *>(base);
+		region = new (b) BookRegion{};
+		regionBytes = bytes;
+		std::memcpy(region->magic, "MEBOOK01", 8);
+		region->version = 1;
+		region->orderSize = sizeof(Order);
+		region->limitSize = sizeof(Limit);
+		region->orderCapacity = n;
+		region->limitCapacity = nLimits;
+		region->indexCapacity = indexCap;
+		Order *orders = reinterpret_cast<Order *>(b + ordersOffset());
+		Limit *limits = reinterpret_cast<Limit *>(b + limitsOffset(n));
+		for (size_t i = 0; i < n; ++i)
+			new (&orders[i]) Order{};
+		for (size_t i = 0; i < nLimits; ++i)
+			new (&limits[i]) Limit();
+		OrderIndex::Slot *index = reinterpret_cast<OrderIndex::Slot *>(b + indexOffset(n));
+		for (size_t i = 0; i < 2 * indexCap; ++i)
+			new (&index[i]) OrderIndex::Slot{};
+		chainFree(orders, n, limits, nLimits);
+		return true;
+	}
+
+	// Maps an existing region in place at whatever address the kernel picks.
+	// Refuses a region whose layout differs from this build or that was not
+	// persisted after its last attach.
+	bool attachRegion(const char *path)
+	{
+		if (region || !oPool.empty())
+			return false;
+		int fd = ::open(path, O_RDWR);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		void *base = (::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(BookRegion))
+						 ? mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+						 : MAP_FAILED;
+		::close(fd);
+		if (base == MAP_FAILED)
+			return false;
+
+		BookRegion *r = static_cast<BookRegion *>(base);
+		size_t bytes = static_cast<size_t>(st.st_size);
+		if (std::memcmp(r->magic, "MEBOOK01", 8) != 0 || r->version != 1 || r->orderSize != sizeof(Order) ||
+			r->limitSize != sizeof(Limit) || r->limitCapacity != r->orderCapacity / 5 ||
+			r->indexCapacity < 2 * r->orderCapacity || (r->indexCapacity & (r->indexCapacity - 1)) != 0 ||
+			regionSize(r->orderCapacity, r->indexCapacity) != bytes || r->clean != 1)
+		{
+			munmap(base, bytes);
+			return false;
+		}
+
+		// A crash before the next persist leaves the region marked unclean
+		r->clean = 0;
+		msync(base, sizeof(BookRegion), MS_SYNC);
+		region = r;
+		regionBytes = bytes;
+		fOrder = r->freeOrder;
+		fLimit = r->freeLimit;
+		return true;
+	}
+
+	// Writes the free lists to the header, syncs the whole region and only
+	// then marks it clean
+	bool syncRegion()
+	{
+		if (!region)
+			return false;
+		region->freeOrder = fOrder;
+		region->freeLimit = fLimit;
+		if (msync(region, regionBytes, MS_SYNC) != 0)
+			return false;
+		region->clean = 1;
+		return msync(region, sizeof(BookRegion), MS_SYNC) == 0;
+	}
+
+	BookRegion *mappedRegion() { return region; }
+
+	// Slot array of the resting (0) or stop (1) order index in the region
+	OrderIndex::Slot *regionIndex(int which)
+	{
+		char *b = reinterpret_cast<char *>(region);
+		return reinterpret_cast<OrderIndex::Slot *>(b + indexOffset(region->orderCapacity)) + which * region->indexCapacity;
 	}
 
 	Order *getOrder(uint64_t i, Side s, OrderType t, uint32_t q, int64_t p, int64_t sp)
@@ -231,6 +1026,9 @@ public:
 		o->shares = q;
 		o->price = p;
 		o->stopPrice = sp;
+		o->hidden = false;
+		o->minQty = 0;
+		o->account = 0;
 		o->next = o->prev = nullptr;
 		o->parentLimit = nullptr;
 		return o;
@@ -254,6 +1052,11 @@ public:
 		l->height = 1;
 		l->left = l->right = nullptr;
 		l->head = l->tail = nullptr;
+		l->totalShares = 0;
+		l->orderCount = 0;
+		l->minQtyCount = 0;
+		l->hiddenHead = l->hiddenTail = nullptr;
+		l->hiddenShares = 0;
 		return l;
 	}
 
@@ -261,29 +1064,404 @@ public:
 	{
 		l->left = l->right = nullptr;
 		l->head = l->tail = nullptr;
+		l->totalShares = 0;
+		l->orderCount = 0;
+		l->minQtyCount = 0;
+		l->hiddenHead = l->hiddenTail = nullptr;
+		l->hiddenShares = 0;
 		l->nextFree = fLimit;
 		fLimit = l;
 	}
 };
 
-// --- 5. THE MATCHING ENGINE ---
-class OrderBook
+// --- 5. SNAPSHOT FILES ---
+// A snapshot is the header, then each price tree as its levels in ascending
+// price order, each level followed by its orders in FIFO order (displayed
+// queue first). A zeroed level ends a tree. The peg groups of each side
+// follow, then the breaker's price window and a trailer.
+struct SnapshotHeader
 {
-	MemoryManager &mm;
-	Limit *buyRoot = nullptr, *sellRoot = nullptr;
-	Limit *stopBuyRoot = nullptr, *stopSellRoot = nullptr;
-	std::unordered_map<uint64_t, Order *> orderMap;
-	std::unordered_map<uint64_t, Order *> stopOrderMap;
-	RingBuffer<65536> &tradeBuffer;
-	uint64_t timestampCounter = 0;
-	uint64_t generatedIdCounter = 1000000000;
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize; // sizeof(SnapshotOrder)
+	uint64_t lastSeq;	 // last journal sequence applied to the book
+	uint64_t orderCount;
+	uint64_t stopOrderCount;
+	uint64_t timestampCounter;
+	uint64_t generatedIdCounter;
+	uint64_t rejectCount;
+	uint64_t haltCount;
+	int64_t referencePrice;
+	PriceBandConfig bandConfig;
+	CircuitBreakerConfig breakerConfig;
+	TradingState tradingState;
+};
 
-	int h(Limit *n) { return n ? n->height : 0; }
-	void up(Limit *n) { n->height = 1 + std::max(h(n->left), h(n->right)); }
-	int getBal(Limit *n) { return n ? h(n->left) - h(n->right) : 0; }
+struct SnapshotLevel
+{
+	int64_t price; // peg offset for a peg group
+	uint32_t displayed;
+	uint32_t hidden;
+};
 
-	Limit *rotR(Limit *y)
-	{
+struct SnapshotPegGroup
+{
+	int64_t offset;
+	uint32_t orders;
+	PegType type;
+};
+
+// Side is implied by the tree or peg list the order is stored under
+struct SnapshotOrder
+{
+	uint64_t id;
+	int64_t price;
+	int64_t stopPrice;
+	uint32_t shares;
+	uint32_t minQty;
+	uint32_t account;
+	OrderType type;
+	PegType pegType;
+	bool hidden;
+};
+
+// Buffered sequential writer over a file descriptor. The buffer is allocated
+// at construction, so writing a snapshot does not allocate.
+class SnapshotWriter
+{
+	int fd;
+	std::unique_ptr<char[]> buf;
+	size_t cap, used = 0;
+	uint64_t total = 0;
+	bool ok = true;
+
+public:
+	explicit SnapshotWriter(int f, size_t capacity = 1 << 20) : fd(f), buf(new char[capacity]), cap(capacity) {}
+
+	void write(const void *data, size_t len)
+	{
+		const char *p = static_cast<const char *>(data);
+		while (len > 0 && ok)
+		{
+			size_t n = std::min(len, cap - used);
+			std::memcpy(buf.get() + used, p, n);
+			used += n;
+			p += n;
+			len -= n;
+			if (used == cap)
+				flush();
+		}
+	}
+
+	template <typename T>
+	void put(const T &v) { write(&v, sizeof(T)); }
+
+	bool flush()
+	{
+		size_t off = 0;
+		while (ok && off < used)
+		{
+			ssize_t n = ::write(fd, buf.get() + off, used - off);
+			if (n < 0)
+				ok = false;
+			else
+				off += static_cast<size_t>(n);
+		}
+		total += off;
+		used = 0;
+		return ok;
+	}
+
+	bool good() const { return ok; }
+	uint64_t bytes() const { return total + used; }
+};
+
+class SnapshotReader
+{
+	int fd;
+	std::unique_ptr<char[]> buf;
+	size_t cap, pos = 0, end = 0;
+	bool ok = true;
+
+public:
+	explicit SnapshotReader(int f, size_t capacity = 1 << 20) : fd(f), buf(new char[capacity]), cap(capacity) {}
+
+	// False on a short read; the reader then stays failed
+	bool read(void *data, size_t len)
+	{
+		char *p = static_cast<char *>(data);
+		while (len > 0 && ok)
+		{
+			if (pos == end)
+			{
+				ssize_t n = ::read(fd, buf.get(), cap);
+				if (n <= 0)
+				{
+					ok = false;
+					break;
+				}
+				pos = 0;
+				end = static_cast<size_t>(n);
+			}
+			size_t n = std::min(len, end - pos);
+			std::memcpy(p, buf.get() + pos, n);
+			pos += n;
+			p += n;
+			len -= n;
+		}
+		return ok;
+	}
+
+	template <typename T>
+	bool get(T &v) { return read(&v, sizeof(T)); }
+
+	bool good() const { return ok; }
+};
+
+// --- 6. ROLLING PRICE WINDOW ---
+// Rolling min/max of trade prices over the last `window` ticks of the
+// engine clock, kept with two monotonic deques so each sample costs
+// amortised O(1). The deques live in fixed rings sized at configuration;
+// should a ring fill, its oldest sample is dropped early.
+class PriceWindow
+{
+	struct Sample
+	{
+		uint64_t ts;
+		int64_t price;
+	};
+
+	struct Deque
+	{
+		std::vector<Sample> ring;
+		uint64_t head = 0, tail = 0;
+
+		bool empty() const { return head == tail; }
+		Sample &front() { return ring[head & (ring.size() - 1)]; }
+		Sample &back() { return ring[(tail - 1) & (ring.size() - 1)]; }
+		void popFront() { ++head; }
+		void popBack() { --tail; }
+		void pushBack(const Sample &s)
+		{
+			if (tail - head == ring.size())
+				++head;
+			ring[tail++ & (ring.size() - 1)] = s;
+		}
+	};
+
+	Deque minQ, maxQ;
+	uint64_t window = 0;
+
+public:
+	PriceWindow() { configure(0); }
+
+	void configure(uint64_t windowTicks, size_t maxSamples = 1 << 16)
+	{
+		window = windowTicks;
+		size_t cap = 1;
+		while (cap < std::min<uint64_t>(windowTicks, maxSamples))
+			cap <<= 1;
+		minQ.ring.assign(cap, {});
+		maxQ.ring.assign(cap, {});
+		clear();
+	}
+
+	void clear() { minQ.head = minQ.tail = maxQ.head = maxQ.tail = 0; }
+
+	void add(uint64_t ts, int64_t price)
+	{
+		while (!minQ.empty() && minQ.back().price >= price)
+			minQ.popBack();
+		minQ.pushBack({ts, price});
+		while (!maxQ.empty() && maxQ.back().price <= price)
+			maxQ.popBack();
+		maxQ.pushBack({ts, price});
+
+		while (minQ.front().ts + window < ts)
+			minQ.popFront();
+		while (maxQ.front().ts + window < ts)
+			maxQ.popFront();
+	}
+
+	int64_t min() { return minQ.front().price; }
+	int64_t max() { return maxQ.front().price; }
+
+	void save(SnapshotWriter &out) const
+	{
+		out.put(window);
+		out.put(static_cast<uint64_t>(minQ.ring.size()));
+		for (const Deque *q : {&minQ, &maxQ})
+		{
+			out.put(q->tail - q->head);
+			for (uint64_t i = q->head; i != q->tail; ++i)
+				out.put(q->ring[i & (q->ring.size() - 1)]);
+		}
+	}
+
+	bool load(SnapshotReader &in)
+	{
+		uint64_t cap;
+		// The rings always hold at least one sample, so a zero capacity is corrupt
+		if (!in.get(window) || !in.get(cap) || cap == 0 || (cap & (cap - 1)) != 0)
+			return false;
+		minQ.ring.assign(cap, {});
+		maxQ.ring.assign(cap, {});
+		clear();
+		for (Deque *q : {&minQ, &maxQ})
+		{
+			uint64_t n;
+			if (!in.get(n) || n > cap)
+				return false;
+			for (; n > 0; --n)
+			{
+				Sample smp;
+				if (!in.get(smp))
+					return false;
+				q->pushBack(smp);
+			}
+		}
+		return true;
+	}
+};
+
+// --- 7. PRE-TRADE RISK ---
+// Per-account exposure kept in one flat array indexed by account number.
+// Open quantity covers resting orders only; position is signed executed
+// quantity. The book updates both incrementally on every rest, amend,
+// cancel and fill, so a check is a single indexed load and two compares.
+class RiskManager
+{
+	struct Account
+	{
+		int64_t position = 0;
+		uint64_t openBuy = 0, openSell = 0;
+		int64_t maxLong = INT64_MAX, maxShort = INT64_MAX;
+	};
+
+	std::vector<Account> accounts;
+
+public:
+	explicit RiskManager(size_t n) : accounts(n) {}
+
+	void setLimits(uint32_t acct, int64_t maxLong, int64_t maxShort)
+	{
+		accounts[acct].maxLong = maxLong;
+		accounts[acct].maxShort = maxShort;
+	}
+
+	// Worst case: every resting order on that side and the new quantity fill.
+	// Unknown accounts fail, so their orders never rest or trade.
+	bool check(uint32_t acct, Side side, uint32_t qty) const
+	{
+		if (acct >= accounts.size())
+			return false;
+		const Account &a = accounts[acct];
+		if (side == Side::Buy)
+			return a.position + static_cast<int64_t>(a.openBuy + qty) <= a.maxLong;
+		return static_cast<int64_t>(a.openSell + qty) - a.position <= a.maxShort;
+	}
+
+	// The updates skip unknown accounts: orders restored from a snapshot or a
+	// mapped region, or resting before the manager was attached, were never
+	// checked and may belong to accounts the manager does not hold
+	void addOpen(uint32_t acct, Side side, uint64_t qty)
+	{
+		if (acct < accounts.size())
+			(side == Side::Buy ? accounts[acct].openBuy : accounts[acct].openSell) += qty;
+	}
+
+	void releaseOpen(uint32_t acct, Side side, uint64_t qty)
+	{
+		if (acct < accounts.size())
+			(side == Side::Buy ? accounts[acct].openBuy : accounts[acct].openSell) -= qty;
+	}
+
+	// The maker's filled quantity leaves its open exposure
+	void onTrade(uint32_t takerAcct, Side takerSide, uint32_t makerAcct, uint32_t qty)
+	{
+		int64_t signedQty = (takerSide == Side::Buy) ? qty : -static_cast<int64_t>(qty);
+		if (takerAcct < accounts.size())
+			accounts[takerAcct].position += signedQty;
+		if (makerAcct >= accounts.size())
+			return;
+		Account &m = accounts[makerAcct];
+		m.position -= signedQty;
+		(takerSide == Side::Buy ? m.openSell : m.openBuy) -= qty;
+	}
+
+	int64_t position(uint32_t acct) const { return accounts[acct].position; }
+	uint64_t openQty(uint32_t acct, Side side) const
+	{
+		return side == Side::Buy ? accounts[acct].openBuy : accounts[acct].openSell;
+	}
+};
+
+// --- 8. THE MATCHING ENGINE ---
+// OrderBook is deterministic: its state, trades and events are a function
+// of its configuration and the sequence of commands applied, nothing else.
+// Time is timestampCounter, the engine clock, which advances per order and
+// per trade. Nothing here reads the wall clock, a cycle counter or a random
+// source, and no output depends on addresses or on hash table iteration
+// order. Journal replay, snapshots and the hot standby all rely on this, so
+// keep it that way. The Gateway's throttle does read the clock, which is why
+// it runs before commands are sequenced. Configuration (bands, breaker, risk
+// limits) is not a command and has to be applied identically to a replica.
+class OrderBook
+{
+	MemoryManager &mm;
+	Limit *buyRoot = nullptr, *sellRoot = nullptr;
+	Limit *stopBuyRoot = nullptr, *stopSellRoot = nullptr;
+	OrderIndex orderMap;
+	OrderIndex stopOrderMap;
+	std::vector<PegGroup> buyPegs, sellPegs;
+	std::vector<uint64_t> massCancelIds;
+	RingBuffer<65536> &tradeBuffer;
+	RingBuffer<65536, OrderEvent> *eventBuffer = nullptr;
+	RingBuffer<65536, DepthUpdate> *depthBuffer = nullptr;
+	RingBuffer<65536, OrderFeedEvent> *orderFeed = nullptr;
+	uint64_t orderFeedLost = 0;
+	BboSlot *bboSlot = nullptr;
+	DepthImages *depthImages = nullptr;
+	uint64_t imageEvery = 0, imageSince = 0;
+	BboSnapshot bbo;
+	bool bboChanged = false;
+	// Best signalDepth displayed levels of each side, best first, behind the
+	// depth aggregates in bbo
+	struct TopLevels
+	{
+		static constexpr uint32_t MAX = 8;
+		int64_t price[MAX];
+		uint64_t qty[MAX];
+		uint32_t count = 0;
+	} topLevels[2];
+	uint32_t signalDepth = 0;
+	uint32_t depthLevels = 0;
+	uint16_t depthBook = 0;
+	uint64_t depthEvery = 0, depthSinceSnapshot = 0, depthSeq = 0;
+	RiskManager *risk = nullptr;
+	uint64_t timestampCounter = 0;
+	uint64_t generatedIdCounter = 1000000000;
+
+	// Risk limits cached as ready-to-compare bounds; disabled limits hold
+	// values no order can exceed
+	PriceBandConfig bandConfig;
+	int64_t referencePrice = 0;
+	int64_t bandLow = INT64_MIN, bandHigh = INT64_MAX;
+	uint32_t maxOrderQty = UINT32_MAX;
+	uint64_t rejectCount = 0;
+
+	TradingState tradingState = TradingState::Continuous;
+	CircuitBreakerConfig breakerConfig;
+	PriceWindow priceWindow;
+	uint64_t haltCount = 0;
+	bool regionBound = false;
+
+	int h(Limit *n) { return n ? n->height : 0; }
+	void up(Limit *n) { n->height = 1 + std::max(h(n->left), h(n->right)); }
+	int getBal(Limit *n) { return n ? h(n->left) - h(n->right) : 0; }
+
+	Limit *rotR(Limit *y)
+	{
 		Limit *x = y->left;
 		y->left = x->right;
 		x->right = y;
@@ -340,6 +1518,39 @@ class OrderBook
 	Limit *getMin(Limit *n) { return (n && n->left) ? getMin(n->left) : n; }
 	Limit *getMax(Limit *n) { return (n && n->right) ? getMax(n->right) : n; }
 
+	// Lowest level priced above p / highest level priced below p
+	Limit *nextAbove(Limit *n, int64_t p)
+	{
+		Limit *r = nullptr;
+		while (n)
+		{
+			if (n->price > p)
+			{
+				r = n;
+				n = n->left;
+			}
+			else
+				n = n->right;
+		}
+		return r;
+	}
+
+	Limit *nextBelow(Limit *n, int64_t p)
+	{
+		Limit *r = nullptr;
+		while (n)
+		{
+			if (n->price < p)
+			{
+				r = n;
+				n = n->right;
+			}
+			else
+				n = n->left;
+		}
+		return r;
+	}
+
 	Limit *removeLimit(Limit *root, int64_t p)
 	{
 		if (!root)
@@ -362,13 +1573,17 @@ class OrderBook
 			root->price = successor->price;
 			root->head = successor->head;
 			root->tail = successor->tail;
+			root->totalShares = successor->totalShares;
+			root->orderCount = successor->orderCount;
+			root->minQtyCount = successor->minQtyCount;
+			root->hiddenHead = successor->hiddenHead;
+			root->hiddenTail = successor->hiddenTail;
+			root->hiddenShares = successor->hiddenShares;
 
-			Order *curr = root->head;
-			while (curr)
-			{
+			for (Order *curr = root->head; curr; curr = curr->next)
+				curr->parentLimit = root;
+			for (Order *curr = root->hiddenHead; curr; curr = curr->next)
 				curr->parentLimit = root;
-				curr = curr->next;
-			}
 
 			root->right = removeLimit(root->right, successor->price);
 		}
@@ -395,408 +1610,7346 @@ class OrderBook
 		return root;
 	}
 
-	void checkStopOrders(int64_t executedPrice, Side executedSide, std::vector<TriggeredStop> &triggered)
+	// Returns every order and level of a price tree to the pools and drops
+	// the orders' index entries. The caller resets the root.
+	void clearTree(Limit *n)
 	{
-		// Only check stops ONCE per order, not per trade
-		if (executedSide == Side::Sell && stopSellRoot)
-		{
-			Limit *highest = getMax(stopSellRoot);
-			while (highest && executedPrice <= highest->price)
+		if (!n)
+			return;
+		clearTree(n->left);
+		clearTree(n->right);
+		for (Order *q : {n->head.get(), n->hiddenHead.get()})
+			while (q)
 			{
-				Order *stopOrder = highest->head;
-				while (stopOrder)
-				{
-					triggered.push_back({stopOrder->id, stopOrder->side,
-										 (stopOrder->type == OrderType::Stop) ? OrderType::Market : OrderType::Limit,
-										 stopOrder->shares, stopOrder->price});
+				Order *next = q->next;
+				orderMap.erase(q->id);
+				mm.recycleOrder(q);
+				q = next;
+			}
+		mm.recycleLimit(n);
+	}
 
-					stopOrderMap.erase(stopOrder->id);
-					Order *next = stopOrder->next;
-					mm.recycleOrder(stopOrder);
-					stopOrder = next;
-				}
+	// Lists the ids of an account's orders in a tree, both queues per level
+	void collectAccount(const Limit *n, uint32_t account, std::vector<uint64_t> &ids) const
+	{
+		if (!n)
+			return;
+		collectAccount(n->left, account, ids);
+		for (const Order *q : {n->head.get(), n->hiddenHead.get()})
+			for (; q; q = q->next)
+				if (q->account == account)
+					ids.push_back(q->id);
+		collectAccount(n->right, account, ids);
+	}
 
-				int64_t priceToRemove = highest->price;
-				stopSellRoot = removeLimit(stopSellRoot, priceToRemove);
-				highest = getMax(stopSellRoot);
-			}
-		}
+	// Appends o at the tail of its queue in L (displayed or hidden) and folds
+	// it into the level aggregates.
+	void linkOrder(Limit *L, Order *o)
+	{
+		OffsetPtr<Order> &head = o->hidden ? L->hiddenHead : L->head;
+		OffsetPtr<Order> &tail = o->hidden ? L->hiddenTail : L->tail;
+		o->next = nullptr;
+		o->prev = tail;
+		if (tail)
+			tail->next = o;
+		else
+			head = o;
+		tail = o;
+		o->parentLimit = L;
 
-		if (executedSide == Side::Buy && stopBuyRoot)
+		if (o->hidden)
+			L->hiddenShares += o->shares;
+		else
 		{
-			Limit *lowest = getMin(stopBuyRoot);
-			while (lowest && executedPrice >= lowest->price)
-			{
-				Order *stopOrder = lowest->head;
-				while (stopOrder)
-				{
-					triggered.push_back({stopOrder->id, stopOrder->side,
-										 (stopOrder->type == OrderType::Stop) ? OrderType::Market : OrderType::Limit,
-										 stopOrder->shares, stopOrder->price});
+			L->totalShares += o->shares;
+			L->orderCount++;
+		}
+		if (o->minQty)
+			L->minQtyCount++;
+	}
 
-					stopOrderMap.erase(stopOrder->id);
-					Order *next = stopOrder->next;
-					mm.recycleOrder(stopOrder);
-					stopOrder = next;
-				}
+	// Detaches o from its level without touching the tree. The caller decides
+	// whether an emptied level is removed or reused.
+	void unlinkOrder(Order *o)
+	{
+		Limit *L = o->parentLimit;
+		OffsetPtr<Order> &head = o->hidden ? L->hiddenHead : L->head;
+		OffsetPtr<Order> &tail = o->hidden ? L->hiddenTail : L->tail;
+		if (o->prev)
+			o->prev->next = o->next;
+		else
+			head = o->next;
 
-				int64_t priceToRemove = lowest->price;
-				stopBuyRoot = removeLimit(stopBuyRoot, priceToRemove);
-				lowest = getMin(stopBuyRoot);
-			}
+		if (o->next)
+			o->next->prev = o->prev;
+		else
+			tail = o->prev;
+
+		o->prev = o->next = nullptr;
+		if (o->hidden)
+			L->hiddenShares -= o->shares;
+		else
+		{
+			L->totalShares -= o->shares;
+			L->orderCount--;
 		}
+		if (o->minQty)
+			L->minQtyCount--;
 	}
 
-	void processOrderInternal(uint64_t id, Side side, OrderType type, uint32_t qty, int64_t price, int64_t stopPrice, bool checkStops)
+	void emitEvent(EventType type, const Order *o, uint64_t refId = 0)
 	{
-		if (type == OrderType::Stop || type == OrderType::StopLimit)
-		{
-			Order *stopOrder = mm.getOrder(id, side, type, qty, price, stopPrice);
-			if (!stopOrder)
-				return;
+		uint64_t ts = timestampCounter++;
+		if (eventBuffer)
+			eventBuffer->push({type, o->side, RejectReason::None, o->id, refId, o->shares, o->price, ts});
+	}
 
-			Limit *L = nullptr;
-			if (side == Side::Buy)
-				stopBuyRoot = insert(stopBuyRoot, stopPrice, L);
-			else
-				stopSellRoot = insert(stopSellRoot, stopPrice, L);
+	void emitReject(uint64_t id, Side side, uint32_t qty, int64_t price, RejectReason reason)
+	{
+		uint64_t ts = timestampCounter++;
+		rejectCount++;
+		if (eventBuffer)
+			eventBuffer->push({EventType::Rejected, side, reason, id, 0, qty, price, ts});
+	}
 
-			if (!L)
-				return;
+	void emitStateChange(EventType type)
+	{
+		uint64_t ts = timestampCounter++;
+		if (eventBuffer)
+			eventBuffer->push({type, Side::Buy, RejectReason::None, 0, 0, 0, referencePrice, ts});
+	}
 
-			if (!L->head)
-				L->head = L->tail = stopOrder;
-			else
-			{
-				L->tail->next = stopOrder;
-				stopOrder->prev = L->tail;
-				L->tail = stopOrder;
-			}
-			stopOrder->parentLimit = L;
-			stopOrderMap[id] = stopOrder;
-			return;
+	// One feed message per displayed level change, straight from the level's
+	// running aggregates. Reads the engine clock without advancing it, so
+	// attaching a feed never changes trade or event timestamps.
+	void publishLevel(Side side, const Limit *L)
+	{
+		if (bboSlot)
+		{
+			noteTop(side, L);
+			noteDepth(side, L);
+			publishBbo();
 		}
-
-		Order *taker = mm.getOrder(id, side, type, qty, price, stopPrice);
-		if (!taker)
+		if (depthImages)
+		{
+			depthImages->record(side, L->price, L->totalShares, L->orderCount);
+			if (imageEvery && ++imageSince >= imageEvery)
+				publishDepthImage();
+		}
+		if (!depthBuffer)
 			return;
+		depthBuffer->push({DepthMsgType::Level, side, depthBook, L->orderCount, L->price, L->totalShares, timestampCounter, ++depthSeq});
+		if (depthEvery && ++depthSinceSnapshot >= depthEvery)
+			publishDepthSnapshot();
+	}
 
-		std::vector<TriggeredStop> triggeredStops;
-		int64_t lastExecutedPrice = 0;
+	// Displayed orders are the ones the feeds show: not hidden, not pegged
+	static bool shown(const Order *o) { return !o->hidden && o->type != OrderType::Pegged; }
+
+	void publishOrder(OrderFeedType type, const Order *o, uint64_t ref, uint32_t shares, uint64_t other = 0)
+	{
+		if (orderFeed)
+			pushOrderFeed({type, o->side, shares, ref, other, o->price, timestampCounter});
+	}
 
-		while (taker->shares > 0)
+	// Keeps the cached BBO current from one displayed level change. Only a
+	// change at or inside the best touches it; when the best level empties
+	// (it may still be in the tree), the next displayed level takes over.
+	void noteTop(Side side, const Limit *L)
+	{
+		bool buy = side == Side::Buy;
+		int64_t &px = buy ? bbo.bidPrice : bbo.askPrice;
+		uint64_t &qty = buy ? bbo.bidQty : bbo.askQty;
+		if (L->totalShares && (qty == 0 || L->price == px || (buy ? L->price > px : L->price < px)))
 		{
-			Limit *best = (side == Side::Buy) ? getMin(sellRoot) : getMax(buyRoot);
-			if (!best || (side == Side::Buy && price < best->price) || (side == Side::Sell && price > best->price))
-				break;
+			px = L->price;
+			qty = L->totalShares;
+		}
+		else if (L->totalShares == 0 && qty && L->price == px)
+		{
+			Limit *n = buy ? nextBelow(buyRoot, px) : nextAbove(sellRoot, px);
+			while (n && n->totalShares == 0)
+				n = buy ? nextBelow(buyRoot, n->price) : nextAbove(sellRoot, n->price);
+			px = n ? n->price : 0;
+			qty = n ? n->totalShares : 0;
+		}
+		else
+			return;
+		bbo.timestamp = timestampCounter;
+		bboChanged = true;
+	}
 
-			Order *maker = best->head;
+	// Keeps the top signalDepth levels of a side current from one displayed
+	// level change. A change beyond the window costs one comparison per
+	// cached level; only a level leaving a full window walks the tree, once,
+	// for the level that replaces it.
+	void noteDepth(Side side, const Limit *L)
+	{
+		if (!signalDepth)
+			return;
+		bool buy = side == Side::Buy;
+		TopLevels &w = topLevels[buy ? 0 : 1];
+		uint32_t i = 0;
+		while (i < w.count && (buy ? w.price[i] > L->price : w.price[i] < L->price))
+			++i;
+		if (i < w.count && w.price[i] == L->price)
+		{
+			if (L->totalShares)
+				w.qty[i] = L->totalShares;
+			else
+			{
+				bool full = w.count == signalDepth;
+				for (uint32_t k = i + 1; k < w.count; ++k)
+				{
+					w.price[k - 1] = w.price[k];
+					w.qty[k - 1] = w.qty[k];
+				}
+				--w.count;
+				if (full)
+				{
+					int64_t edge = w.count ? w.price[w.count - 1] : L->price;
+					Limit *n = buy ? nextBelow(buyRoot, edge) : nextAbove(sellRoot, edge);
+					while (n && n->totalShares == 0)
+						n = buy ? nextBelow(buyRoot, n->price) : nextAbove(sellRoot, n->price);
+					if (n)
+					{
+						w.price[w.count] = n->price;
+						w.qty[w.count++] = n->totalShares;
+					}
+				}
+			}
+		}
+		else if (L->totalShares && i < signalDepth)
+		{
+			if (w.count == signalDepth)
+				--w.count;
+			for (uint32_t k = w.count; k > i; --k)
+			{
+				w.price[k] = w.price[k - 1];
+				w.qty[k] = w.qty[k - 1];
+			}
+			w.price[i] = L->price;
+			w.qty[i] = L->totalShares;
+			++w.count;
+		}
+		else
+			return;
+		sumDepth(side);
+		bbo.timestamp = timestampCounter;
+		bboChanged = true;
+	}
+
+	void sumDepth(Side side)
+	{
+		const TopLevels &w = topLevels[side == Side::Buy ? 0 : 1];
+		uint64_t qty = 0;
+		int64_t notional = 0;
+		for (uint32_t k = 0; k < w.count; ++k)
+		{
+			qty += w.qty[k];
+			notional += w.price[k] * static_cast<int64_t>(w.qty[k]);
+		}
+		(side == Side::Buy ? bbo.bidDepth : bbo.askDepth) = qty;
+		(side == Side::Buy ? bbo.bidNotional : bbo.askNotional) = notional;
+	}
+
+	void noteTrade(int64_t px, uint32_t qty, uint64_t match)
+	{
+		bbo.lastPrice = px;
+		bbo.lastQty = qty;
+		bbo.timestamp = match;
+		bboChanged = true;
+	}
+
+	void publishBbo()
+	{
+		if (bboChanged)
+		{
+			bboChanged = false;
+			bboSlot->publish(bbo);
+		}
+	}
+
+	// Unlike a lost depth update, a lost order event is not repaired by a
+	// later message, so overflow is counted for the caller to check.
+	void pushOrderFeed(const OrderFeedEvent &e)
+	{
+		if (!orderFeed->push(e))
+			++orderFeedLost;
+	}
+
+	// Feeds one execution price into the rolling window and trips the
+	// breaker if the window's range exceeds the configured move.
+	void trackTradePrice(int64_t px)
+	{
+		priceWindow.add(timestampCounter, px);
+		int64_t lo = priceWindow.min();
+		if ((priceWindow.max() - lo) * 10000 > breakerConfig.moveBps * lo)
+		{
+			tradingState = TradingState::Auction;
+			haltCount++;
+			emitStateChange(EventType::Halted);
+		}
+	}
+
+	static Order *frontOrder(Limit *L) { return L->head ? L->head : L->hiddenHead; }
+
+	// Equilibrium price for the crossed part of the book: maximises executable
+	// volume, then minimises the imbalance, then stays closest to the
+	// reference price. Only levels inside [best ask, best bid] can be
+	// candidates, so the work is proportional to the overlap.
+	int64_t auctionPrice()
+	{
+		Limit *bestBid = getMax(buyRoot), *bestAsk = getMin(sellRoot);
+		if (!bestBid || !bestAsk || bestBid->price < bestAsk->price)
+			return 0;
+
+		std::vector<std::pair<int64_t, uint64_t>> bids, asks; // descending / ascending
+		for (Limit *L = bestBid; L && L->price >= bestAsk->price; L = nextBelow(buyRoot, L->price))
+			bids.push_back({L->price, L->totalShares + L->hiddenShares});
+		for (Limit *L = bestAsk; L && L->price <= bestBid->price; L = nextAbove(sellRoot, L->price))
+			asks.push_back({L->price, L->totalShares + L->hiddenShares});
+
+		std::vector<int64_t> candidates;
+		for (auto &b : bids)
+			candidates.push_back(b.first);
+		for (auto &a : asks)
+			candidates.push_back(a.first);
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+		int64_t bestPx = 0;
+		uint64_t bestExec = 0, bestImbalance = 0, bestDist = 0;
+		for (int64_t p : candidates)
+		{
+			uint64_t buyVol = 0, sellVol = 0;
+			for (auto &b : bids)
+				if (b.first >= p)
+					buyVol += b.second;
+			for (auto &a : asks)
+				if (a.first <= p)
+					sellVol += a.second;
+
+			uint64_t exec = std::min(buyVol, sellVol);
+			uint64_t imbalance = std::max(buyVol, sellVol) - exec;
+			uint64_t dist = referencePrice ? static_cast<uint64_t>(std::abs(p - referencePrice)) : 0;
+			if (exec > bestExec || (exec == bestExec && (imbalance < bestImbalance || (imbalance == bestImbalance && dist < bestDist))))
+			{
+				bestPx = p;
+				bestExec = exec;
+				bestImbalance = imbalance;
+				bestDist = dist;
+			}
+		}
+		return bestPx;
+	}
+
+	void recomputeBands()
+	{
+		if (bandConfig.bandBps > 0 && referencePrice > 0)
+		{
+			int64_t width = referencePrice * bandConfig.bandBps / 10000;
+			bandLow = referencePrice - width;
+			bandHigh = referencePrice + width;
+		}
+		else
+		{
+			bandLow = INT64_MIN;
+			bandHigh = INT64_MAX;
+		}
+	}
+
+	// Pre-trade checks against the cached bounds. Market orders are collared
+	// to the band edge rather than rejected, which also caps how far a sweep
+	// can walk the book. Stop entries are checked for size only; their price
+	// is checked against the band in force when they trigger.
+	RejectReason checkOrder(OrderType type, Side side, uint32_t qty, int64_t &price)
+	{
+		if (qty > maxOrderQty)
+			return RejectReason::MaxQuantity;
+
+		if (type == OrderType::Market)
+			price = (side == Side::Buy) ? std::min(price, bandHigh) : std::max(price, bandLow);
+		else if (type == OrderType::Limit && (price < bandLow || price > bandHigh))
+			return RejectReason::PriceBand;
+
+		if (bandConfig.maxNotional > 0)
+		{
+			bool priced = type == OrderType::Limit || type == OrderType::StopLimit ||
+						  (type == OrderType::Market && bandHigh != INT64_MAX);
+			int64_t notional;
+			if (__builtin_mul_overflow(priced ? price : referencePrice, static_cast<int64_t>(qty), &notional) ||
+				notional > bandConfig.maxNotional)
+				return RejectReason::MaxNotional;
+		}
+		return RejectReason::None;
+	}
+
+	// Amendments are held to the same limits as new orders. Peg prices are
+	// offsets, so only their size is checked.
+	bool admitAmend(Order *o, uint64_t id, uint32_t qty, int64_t price)
+	{
+		RejectReason r = (o->type == OrderType::Pegged)
+							 ? (qty > maxOrderQty ? RejectReason::MaxQuantity : RejectReason::None)
+							 : checkOrder(OrderType::Limit, o->side, qty, price);
+		if (r == RejectReason::None && risk && qty > o->shares && !risk->check(o->account, o->side, qty - o->shares))
+			r = RejectReason::RiskLimit;
+		if (r == RejectReason::None)
+			return true;
+		emitReject(id, o->side, qty, price, r);
+		return false;
+	}
+
+	// Detaches a resting order from its level, dropping the level if it
+	// empties. The caller owns the index entry and the slot. movedFrom is
+	// set when the order is being moved: the id it was published under, so
+	// the feed's Delete can name the id it continues as.
+	void removeResting(Order *o, uint64_t movedFrom = 0)
+	{
+		Limit *L = o->parentLimit;
+		unlinkOrder(o);
+		if (risk)
+			risk->releaseOpen(o->account, o->side, o->shares);
+		if (shown(o))
+		{
+			publishLevel(o->side, L);
+			// An execution to zero has already taken the order off the book
+			if (o->shares > 0)
+				publishOrder(OrderFeedType::Delete, o, movedFrom ? movedFrom : o->id, o->shares, movedFrom ? o->id : 0);
+		}
+
+		if (L->empty())
+		{
+			if (o->type == OrderType::Pegged)
+				removePegGroup(o->side, L);
+			else if (o->side == Side::Buy)
+				buyRoot = removeLimit(buyRoot, L->price);
+			else
+				sellRoot = removeLimit(sellRoot, L->price);
+		}
+	}
+
+	BookTop displayedTop()
+	{
+		BookTop top;
+		if (Limit *b = getMax(buyRoot))
+		{
+			top.hasBid = true;
+			top.bid = b->price;
+		}
+		if (Limit *a = getMin(sellRoot))
+		{
+			top.hasAsk = true;
+			top.ask = a->price;
+		}
+		return top;
+	}
+
+	// Effective price of a peg group against the displayed BBO. Pegs never
+	// reference each other, and a peg is capped one tick inside the opposite
+	// best so it can never cross the book it tracks. Returns false when the
+	// reference is missing.
+	bool pegPrice(const PegGroup &g, Side side, const BookTop &top, int64_t &px)
+	{
+		switch (g.type)
+		{
+		case PegType::Primary:
+			if (side == Side::Buy ? !top.hasBid : !top.hasAsk)
+				return false;
+			px = (side == Side::Buy ? top.bid : top.ask) + g.offset;
+			break;
+		case PegType::Market:
+			if (side == Side::Buy ? !top.hasAsk : !top.hasBid)
+				return false;
+			px = (side == Side::Buy ? top.ask : top.bid) + g.offset;
+			break;
+		case PegType::Mid:
+			if (!top.hasBid || !top.hasAsk)
+				return false;
+			px = (side == Side::Buy ? (top.bid + top.ask) / 2 : (top.bid + top.ask + 1) / 2) + g.offset;
+			break;
+		default:
+			return false;
+		}
+
+		if (side == Side::Buy && top.hasAsk)
+			px = std::min(px, top.ask - 1);
+		else if (side == Side::Sell && top.hasBid)
+			px = std::max(px, top.bid + 1);
+		return px > 0;
+	}
+
+	// Best-priced group on one side. Groups are few (one per peg type and
+	// offset in use), so a scan beats maintaining an ordering that every
+	// BBO change would invalidate.
+	PegGroup *bestPegGroup(Side side, const BookTop &top, int64_t &bestPx)
+	{
+		std::vector<PegGroup> &pegs = (side == Side::Buy) ? buyPegs : sellPegs;
+		PegGroup *best = nullptr;
+		for (PegGroup &g : pegs)
+		{
+			int64_t px;
+			if (!pegPrice(g, side, top, px))
+				continue;
+			if (!best || (side == Side::Buy ? px > bestPx : px < bestPx))
+			{
+				best = &g;
+				bestPx = px;
+			}
+		}
+		return best;
+	}
+
+	Limit *pegLevel(Side side, PegType type, int64_t offset)
+	{
+		std::vector<PegGroup> &pegs = (side == Side::Buy) ? buyPegs : sellPegs;
+		for (PegGroup &g : pegs)
+			if (g.type == type && g.offset == offset)
+				return g.level;
+
+		Limit *level = mm.getLimit(offset);
+		if (level)
+			pegs.push_back({type, offset, level});
+		return level;
+	}
+
+	void removePegGroup(Side side, Limit *level)
+	{
+		std::vector<PegGroup> &pegs = (side == Side::Buy) ? buyPegs : sellPegs;
+		for (size_t i = 0; i < pegs.size(); ++i)
+		{
+			if (pegs[i].level == level)
+			{
+				pegs[i] = pegs.back();
+				pegs.pop_back();
+				mm.recycleLimit(level);
+				return;
+			}
+		}
+	}
+
+	void checkStopOrders(int64_t executedPrice, Side executedSide, std::vector<TriggeredStop> &triggered)
+	{
+		// Only check stops ONCE per order, not per trade
+		if (executedSide == Side::Sell && stopSellRoot)
+		{
+			Limit *highest = getMax(stopSellRoot);
+			while (highest && executedPrice <= highest->price)
+			{
+				Order *stopOrder = highest->head;
+				while (stopOrder)
+				{
+					triggered.push_back({stopOrder->id, stopOrder->side,
+										 (stopOrder->type == OrderType::Stop) ? OrderType::Market : OrderType::Limit,
+										 stopOrder->shares, stopOrder->price, stopOrder->account});
+
+					stopOrderMap.erase(stopOrder->id);
+					Order *next = stopOrder->next;
+					mm.recycleOrder(stopOrder);
+					stopOrder = next;
+				}
+
+				int64_t priceToRemove = highest->price;
+				stopSellRoot = removeLimit(stopSellRoot, priceToRemove);
+				highest = getMax(stopSellRoot);
+			}
+		}
+
+		if (executedSide == Side::Buy && stopBuyRoot)
+		{
+			Limit *lowest = getMin(stopBuyRoot);
+			while (lowest && executedPrice >= lowest->price)
+			{
+				Order *stopOrder = lowest->head;
+				while (stopOrder)
+				{
+					triggered.push_back({stopOrder->id, stopOrder->side,
+										 (stopOrder->type == OrderType::Stop) ? OrderType::Market : OrderType::Limit,
+										 stopOrder->shares, stopOrder->price, stopOrder->account});
+
+					stopOrderMap.erase(stopOrder->id);
+					Order *next = stopOrder->next;
+					mm.recycleOrder(stopOrder);
+					stopOrder = next;
+				}
+
+				int64_t priceToRemove = lowest->price;
+				stopBuyRoot = removeLimit(stopBuyRoot, priceToRemove);
+				lowest = getMin(stopBuyRoot);
+			}
+		}
+	}
+
+	bool processOrderInternal(uint64_t id, Side side, OrderType type, uint32_t qty, int64_t price, int64_t stopPrice, bool checkStops,
+							  const OrderOptions &opts = {})
+	{
+		RejectReason r = checkOrder(type, side, qty, price);
+		if (r == RejectReason::None && risk && !risk->check(opts.account, side, qty))
+			r = RejectReason::RiskLimit;
+		if (r != RejectReason::None)
+		{
+			emitReject(id, side, qty, price, r);
+			return false;
+		}
+
+		if (type == OrderType::Market && tradingState == TradingState::Auction)
+		{
+			emitReject(id, side, qty, price, RejectReason::Halted);
+			return false;
+		}
+
+		if (type == OrderType::Stop || type == OrderType::StopLimit)
+		{
+			Order *stopOrder = mm.getOrder(id, side, type, qty, price, stopPrice);
+			if (!stopOrder)
+				return false;
+			stopOrder->account = opts.account;
+
+			Limit *L = nullptr;
+			if (side == Side::Buy)
+				stopBuyRoot = insert(stopBuyRoot, stopPrice, L);
+			else
+				stopSellRoot = insert(stopSellRoot, stopPrice, L);
+
+			if (!L)
+			{
+				mm.recycleOrder(stopOrder);
+				return false;
+			}
+
+			linkOrder(L, stopOrder);
+			stopOrderMap.assign(id, stopOrder);
+			return true;
+		}
+
+		Order *taker = mm.getOrder(id, side, type, qty, price, stopPrice);
+		if (!taker)
+			return false;
+		taker->hidden = opts.hidden;
+		taker->minQty = opts.minQty;
+		taker->account = opts.account;
+
+		executeOrder(taker, checkStops, false);
+		return true;
+	}
+
+	// Matches an order that is not resting in the book, rests any limit
+	// remainder and then runs the stops it triggered. `indexed` is set when
+	// the order already owns its orderMap entry (a repriced resting order).
+	// Returns true if the order is left resting.
+	bool executeOrder(Order *taker, bool checkStops, bool indexed)
+	{
+		Side side = taker->side;
+		Side makerSide = (side == Side::Buy) ? Side::Sell : Side::Buy;
+		int64_t price = taker->price;
+		std::vector<TriggeredStop> triggeredStops;
+		int64_t lastExecutedPrice = 0;
+
+		// Pegs are priced off the BBO as it stood when this order arrived
+		bool pegsResting = !((side == Side::Buy) ? sellPegs : buyPegs).empty();
+		BookTop top;
+		if (pegsResting)
+			top = displayedTop();
+
+		// Set once a level is left holding only makers whose minimum quantity
+		// this taker cannot meet; later passes start beyond skipPrice
+		bool skipping = false;
+		int64_t skipPrice = 0;
+
+		while (taker->shares > 0 && tradingState == TradingState::Continuous)
+		{
+			Limit *best;
+			if (!skipping)
+				best = (side == Side::Buy) ? getMin(sellRoot) : getMax(buyRoot);
+			else
+				best = (side == Side::Buy) ? nextAbove(sellRoot, skipPrice) : nextBelow(buyRoot, skipPrice);
+			int64_t bestPrice = best ? best->price : 0;
+			bool fromPeg = false;
+
+			// Displayed levels keep priority over pegs at the same price
+			if (pegsResting)
+			{
+				int64_t pegPx;
+				PegGroup *peg = bestPegGroup(makerSide, top, pegPx);
+				if (peg && (!best || (side == Side::Buy ? pegPx < bestPrice : pegPx > bestPrice)))
+				{
+					best = peg->level;
+					bestPrice = pegPx;
+					fromPeg = true;
+				}
+			}
+
+			if (!best || (side == Side::Buy && price < bestPrice) || (side == Side::Sell && price > bestPrice))
+				break;
+
+			uint64_t shown = best->totalShares;
+			bool traded = matchLevel(taker, best, bestPrice);
+			if (!fromPeg && best->totalShares != shown)
+				publishLevel(makerSide, best);
+			else if (bboSlot)
+				publishBbo(); // fills against hidden orders or pegs only
+			if (traded)
+			{
+				lastExecutedPrice = bestPrice;
+				if (breakerConfig.moveBps > 0)
+					trackTradePrice(bestPrice);
+			}
+
+			if (best->empty())
+			{
+				if (fromPeg)
+					removePegGroup(makerSide, best);
+				else if (side == Side::Buy)
+					sellRoot = removeLimit(sellRoot, best->price);
+				else
+					buyRoot = removeLimit(buyRoot, best->price);
+			}
+			else if (taker->shares > 0)
+			{
+				if (fromPeg)
+					break;
+				skipping = true;
+				skipPrice = best->price;
+			}
+		}
+
+		if (lastExecutedPrice > 0 && bandConfig.followLastTrade && lastExecutedPrice != referencePrice)
+		{
+			referencePrice = lastExecutedPrice;
+			recomputeBands();
+		}
+
+		// Check stops ONCE after all matching completes. A halt defers them to
+		// the auction price.
+		if (checkStops && lastExecutedPrice > 0 && tradingState == TradingState::Continuous)
+			checkStopOrders(lastExecutedPrice, side, triggeredStops);
+
+		// A market order cut short by a halt in its own sweep cannot rest;
+		// its unfilled quantity is reported as rejected for the halt
+		if (taker->shares > 0 && taker->type == OrderType::Market && tradingState == TradingState::Auction)
+			emitReject(taker->id, side, taker->shares, price, RejectReason::Halted);
+
+		bool rested = taker->shares > 0 && taker->type == OrderType::Limit && restOrder(taker);
+		if (rested)
+		{
+			if (!indexed)
+				orderMap.assign(taker->id, taker);
+		}
+		else
+		{
+			if (indexed)
+				orderMap.erase(taker->id);
+			mm.recycleOrder(taker);
+		}
+
+		// Process triggered stops
+		for (const auto &ts : triggeredStops)
+		{
+			uint64_t newId = generatedIdCounter++;
+			processOrderInternal(newId, ts.side, ts.convertToType, ts.shares, ts.limitPrice, 0, false, {0, false, ts.account});
+		}
+		return rested;
+	}
+
+	// Fills taker against one level at px, displayed queue first and hidden
+	// queue second. Makers whose minimum quantity the taker cannot meet are
+	// stepped over in place; the taker only shrinks, so they stay ineligible
+	// for the rest of this order and no maker is visited twice. Returns true
+	// if anything traded.
+	bool matchLevel(Order *taker, Limit *L, int64_t px)
+	{
+		bool checkMinQty = L->minQtyCount > 0;
+		uint32_t before = taker->shares;
+
+		for (int q = 0; q < 2 && taker->shares > 0; ++q)
+		{
+			Order *maker = (q == 0) ? L->head : L->hiddenHead;
+			uint64_t &queueShares = (q == 0) ? L->totalShares : L->hiddenShares;
 			while (maker && taker->shares > 0)
 			{
+				if (checkMinQty && taker->shares < maker->minQty && taker->shares < maker->shares)
+				{
+					maker = maker->next;
+					continue;
+				}
+
 				uint32_t traded = std::min(taker->shares, maker->shares);
+				uint64_t match = timestampCounter++;
+				tradeBuffer.push({taker->id, maker->id, traded, px, match});
+				if (bboSlot)
+					noteTrade(px, traded, match);
+				if (orderFeed)
+					pushOrderFeed(shown(maker) ? OrderFeedEvent{OrderFeedType::Execute, maker->side, traded, maker->id, match, px, match}
+												 : OrderFeedEvent{OrderFeedType::HiddenTrade, maker->side, traded, 0, match, px, match});
+				if (risk)
+					risk->onTrade(taker->account, taker->side, maker->account, traded);
+
+				taker->shares -= traded;
+				maker->shares -= traded;
+				queueShares -= traded;
+
+				if (maker->shares == 0)
+				{
+					Order *next = maker->next;
+					unlinkOrder(maker);
+					orderMap.erase(maker->id);
+					mm.recycleOrder(maker);
+					maker = next;
+				}
+			}
+		}
+		return taker->shares != before;
+	}
+
+	// Inserts o at the tail of its price level, creating the level if needed.
+	bool restOrder(Order *o)
+	{
+		Limit *L = nullptr;
+		if (o->type == OrderType::Pegged)
+			L = pegLevel(o->side, o->pegType, o->price);
+		else if (o->side == Side::Buy)
+			buyRoot = insert(buyRoot, o->price, L);
+		else
+			sellRoot = insert(sellRoot, o->price, L);
+
+		if (!L)
+			return false;
+
+		linkOrder(L, o);
+		if (risk)
+			risk->addOpen(o->account, o->side, o->shares);
+		if (shown(o))
+		{
+			publishLevel(o->side, L);
+			publishOrder(OrderFeedType::Add, o, o->id, o->shares);
+		}
+		return true;
+	}
+
+	// Same-price amendment that never touches the tree: a reduction keeps
+	// queue priority, an increase requeues at the tail of the same level.
+	void amendQuantity(Order *o, uint32_t newQty)
+	{
+		Limit *L = o->parentLimit;
+		uint64_t &queueShares = o->hidden ? L->hiddenShares : L->totalShares;
+		if (newQty == o->shares)
+			return;
+		if (risk)
+		{
+			risk->releaseOpen(o->account, o->side, o->shares);
+			risk->addOpen(o->account, o->side, newQty);
+		}
+		if (shown(o))
+			publishOrder(newQty < o->shares ? OrderFeedType::Cancel : OrderFeedType::Replace, o, o->id,
+						 newQty < o->shares ? o->shares - newQty : newQty, o->id);
+		if (newQty < o->shares)
+		{
+			queueShares -= o->shares - newQty;
+			o->shares = newQty;
+		}
+		else if (o->next)
+		{
+			unlinkOrder(o);
+			o->shares = newQty;
+			linkOrder(L, o);
+		}
+		else
+		{
+			queueShares += newQty - o->shares;
+			o->shares = newQty;
+		}
+		if (shown(o))
+			publishLevel(o->side, L);
+	}
+
+	// Moves a resting order to a new price, keeping its slot and index entry.
+	// The order loses priority and trades first if the new price crosses.
+	// Returns false if the order did not survive the move.
+	bool moveOrder(Order *o, uint32_t newQty, int64_t newPrice, EventType ev, uint64_t refId = 0)
+	{
+		removeResting(o, refId ? refId : o->id);
+		o->price = newPrice;
+		o->shares = newQty;
+		emitEvent(ev, o, refId);
+
+		// Pegs are passive by construction and never cross on a move
+		Limit *opposite = (o->side == Side::Buy) ? getMin(sellRoot) : getMax(buyRoot);
+		bool crosses = o->type != OrderType::Pegged && tradingState == TradingState::Continuous && opposite && ((o->side == Side::Buy) ? newPrice >= opposite->price : newPrice <= opposite->price);
+		if (crosses)
+			return executeOrder(o, true, true);
+
+		if (restOrder(o))
+			return true;
+
+		orderMap.erase(o->id);
+		mm.recycleOrder(o);
+		return false;
+	}
+
+	// o is the leg's live order, or null if none is resting.
+	void applyQuoteLeg(Side side, const QuoteLeg &leg, Order *o, uint32_t account)
+	{
+		if (!o)
+		{
+			if (leg.qty > 0)
+				processOrderInternal(leg.orderId, side, OrderType::Limit, leg.qty, leg.price, 0, true, {0, false, account});
+			return;
+		}
+
+		if (o->side != side)
+			return;
+
+		if (leg.qty == 0)
+		{
+			removeResting(o);
+			orderMap.erase(o->id);
+			mm.recycleOrder(o);
+			return;
+		}
+
+		if (!admitAmend(o, leg.orderId, leg.qty, leg.price))
+			return;
+
+		if (leg.price != o->price)
+			moveOrder(o, leg.qty, leg.price, EventType::Replaced, leg.orderId);
+		else
+		{
+			amendQuantity(o, leg.qty);
+			emitEvent(EventType::Replaced, o, leg.orderId);
+		}
+	}
+
+	static SnapshotOrder toSnapshot(const Order *o)
+	{
+		SnapshotOrder so{};
+		so.id = o->id;
+		so.price = o->price;
+		so.stopPrice = o->stopPrice;
+		so.shares = o->shares;
+		so.minQty = o->minQty;
+		so.account = o->account;
+		so.type = o->type;
+		so.pegType = o->pegType;
+		so.hidden = o->hidden;
+		return so;
+	}
+
+	void saveQueue(SnapshotWriter &out, const Order *o) const
+	{
+		for (; o; o = o->next)
+			out.put(toSnapshot(o));
+	}
+
+	// In-order walk, so levels come out sorted by price
+	void saveTree(SnapshotWriter &out, const Limit *n) const
+	{
+		if (!n)
+			return;
+		saveTree(out, n->left);
+		uint32_t hidden = 0;
+		for (const Order *o = n->hiddenHead; o; o = o->next)
+			hidden++;
+		out.put(SnapshotLevel{n->price, n->orderCount, hidden});
+		saveQueue(out, n->head);
+		saveQueue(out, n->hiddenHead);
+		saveTree(out, n->right);
+	}
+
+	// Takes a slot, restores the order and appends it to L
+	Order *loadOrder(SnapshotReader &in, Side side, Limit *L)
+	{
+		SnapshotOrder so;
+		if (!in.get(so))
+			return nullptr;
+		Order *o = mm.getOrder(so.id, side, so.type, so.shares, so.price, so.stopPrice);
+		if (!o)
+			return nullptr;
+		o->pegType = so.pegType;
+		o->hidden = so.hidden;
+		o->minQty = so.minQty;
+		o->account = so.account;
+		linkOrder(L, o);
+		return o;
+	}
+
+	// Sorted levels become a height-balanced tree directly, so loading does
+	// no per-level insert or rotation
+	Limit *buildTree(std::vector<Limit *> &levels, size_t lo, size_t hi)
+	{
+		if (lo >= hi)
+			return nullptr;
+		size_t mid = lo + (hi - lo) / 2;
+		Limit *n = levels[mid];
+		n->left = buildTree(levels, lo, mid);
+		n->right = buildTree(levels, mid + 1, hi);
+		up(n);
+		return n;
+	}
+
+	bool loadTree(SnapshotReader &in, Side side, bool stops, Limit *&root)
+	{
+		auto &index = stops ? stopOrderMap : orderMap;
+		std::vector<Limit *> levels;
+		SnapshotLevel lv;
+		while (in.get(lv) && (lv.displayed || lv.hidden))
+		{
+			if (!levels.empty() && lv.price <= levels.back()->price)
+				return false;
+			Limit *L = mm.getLimit(lv.price);
+			if (!L)
+				return false;
+			levels.push_back(L);
+			for (uint64_t i = 0; i < uint64_t(lv.displayed) + lv.hidden; ++i)
+			{
+				Order *o = loadOrder(in, side, L);
+				if (!o)
+					return false;
+				index.assign(o->id, o);
+				if (risk && !stops)
+					risk->addOpen(o->account, side, o->shares);
+			}
+		}
+		root = buildTree(levels, 0, levels.size());
+		return in.good();
+	}
+
+	bool loadPegs(SnapshotReader &in, Side side)
+	{
+		uint64_t groups;
+		if (!in.get(groups))
+			return false;
+		for (; groups > 0; --groups)
+		{
+			SnapshotPegGroup g;
+			if (!in.get(g))
+				return false;
+			Limit *L = mm.getLimit(g.offset);
+			if (!L)
+				return false;
+			((side == Side::Buy) ? buyPegs : sellPegs).push_back({g.type, g.offset, L});
+			for (uint32_t i = 0; i < g.orders; ++i)
+			{
+				Order *o = loadOrder(in, side, L);
+				if (!o)
+					return false;
+				orderMap.assign(o->id, o);
+				if (risk)
+					risk->addOpen(o->account, side, o->shares);
+			}
+		}
+		return true;
+	}
+
+	// Points both id indexes at the slot arrays of the region the pools are
+	// mapped from, so the index persists with the book
+	void bindRegion()
+	{
+		BookRegion *r = mm.mappedRegion();
+		if (!r || regionBound)
+			return;
+		orderMap.bind(mm.regionIndex(0), r->indexCapacity, &r->orderCount);
+		stopOrderMap.bind(mm.regionIndex(1), r->indexCapacity, &r->stopOrderCount);
+		regionBound = true;
+	}
+
+	void addOpenTree(const Limit *n)
+	{
+		if (!n)
+			return;
+		addOpenTree(n->left);
+		for (const Order *q : {n->head.get(), n->hiddenHead.get()})
+			for (const Order *o = q; o; o = o->next)
+				risk->addOpen(o->account, o->side, o->shares);
+		addOpenTree(n->right);
+	}
+
+public:
+	// With a mapped memory manager, construct the book after createRegion
+	// or attachRegion so its index lives in the region too
+	OrderBook(MemoryManager &m, RingBuffer<65536> &rb) : mm(m), tradeBuffer(rb) { bindRegion(); }
+
+	// Returns false if the order was rejected by the pre-trade checks or
+	// the memory pools are exhausted.
+	bool processOrder(uint64_t id, Side side, OrderType type, uint32_t qty, int64_t price, int64_t stopPrice,
+					  const OrderOptions &opts = {})
+	{
+		return processOrderInternal(id, side, type, qty, price, stopPrice, true, opts);
+	}
+
+	// Rests a pegged order in the group for its peg type and offset. Pegs
+	// only ever provide liquidity, so entry never matches.
+	bool processPeggedOrder(uint64_t id, Side side, PegType pegType, uint32_t qty, int64_t offset, uint32_t account = 0)
+	{
+		if (qty == 0)
+			return false;
+		RejectReason r = (qty > maxOrderQty) ? RejectReason::MaxQuantity : RejectReason::None;
+		if (r == RejectReason::None && risk && !risk->check(account, side, qty))
+			r = RejectReason::RiskLimit;
+		if (r != RejectReason::None)
+		{
+			emitReject(id, side, qty, offset, r);
+			return false;
+		}
+
+		Order *o = mm.getOrder(id, side, OrderType::Pegged, qty, offset, 0);
+		if (!o)
+			return false;
+		o->pegType = pegType;
+		o->account = account;
+
+		if (!restOrder(o))
+		{
+			mm.recycleOrder(o);
+			return false;
+		}
+		orderMap.assign(id, o);
+		return true;
+	}
+
+	bool cancelOrder(uint64_t orderId)
+	{
+		if (Order *o = orderMap.find(orderId))
+		{
+			removeResting(o);
+			orderMap.erase(orderId);
+			mm.recycleOrder(o);
+			return true;
+		}
+
+		if (Order *o = stopOrderMap.find(orderId))
+		{
+			Limit *L = o->parentLimit;
+			unlinkOrder(o);
+
+			if (!L->head)
+			{
+				if (o->side == Side::Buy)
+					stopBuyRoot = removeLimit(stopBuyRoot, L->price);
+				else
+					stopSellRoot = removeLimit(stopSellRoot, L->price);
+			}
+
+			stopOrderMap.erase(orderId);
+			mm.recycleOrder(o);
+			return true;
+		}
+
+		return false;
+	}
+
+	// Cancels every resting, stop and pegged order of an account on the
+	// chosen sides. Walks the whole book, so it is a kill switch rather than
+	// an order-path operation. Returns the number of orders cancelled.
+	size_t massCancel(uint32_t account, bool buys = true, bool sells = true)
+	{
+		massCancelIds.clear();
+		for (Side side : {Side::Buy, Side::Sell})
+		{
+			if (!(side == Side::Buy ? buys : sells))
+				continue;
+			collectAccount(side == Side::Buy ? buyRoot : sellRoot, account, massCancelIds);
+			collectAccount(side == Side::Buy ? stopBuyRoot : stopSellRoot, account, massCancelIds);
+			for (const PegGroup &g : side == Side::Buy ? buyPegs : sellPegs)
+				for (const Order *q = g.level->head; q; q = q->next)
+					if (q->account == account)
+						massCancelIds.push_back(q->id);
+		}
+		size_t n = 0;
+		for (uint64_t id : massCancelIds)
+			n += cancelOrder(id);
+		return n;
+	}
+
+	// Same-price amendments never touch the tree: a reduction keeps queue
+	// priority, an increase requeues the order at the tail of its level.
+	// A price change loses priority and moves the order to the new level.
+	bool modifyOrder(uint64_t orderId, uint32_t newQty, int64_t newPrice)
+	{
+		if (newQty == 0)
+			return cancelOrder(orderId);
+
+		Order *o = orderMap.find(orderId);
+		if (!o)
+			return false;
+
+		if (!admitAmend(o, orderId, newQty, newPrice))
+			return false;
+		if (newPrice != o->price)
+			return moveOrder(o, newQty, newPrice, EventType::Repriced);
+
+		if (newQty != o->shares)
+		{
+			EventType ev = (newQty < o->shares) ? EventType::Reduced : EventType::Requeued;
+			amendQuantity(o, newQty);
+			emitEvent(ev, o);
+		}
+		return true;
+	}
+
+	// Cancel-replace that reuses the order's slot and re-keys its index entry
+	// in place, so only a price change touches the tree. Priority follows
+	// modifyOrder. Fails if orderId is unknown; a newId already live, resting
+	// or stop, is rejected.
+	bool replaceOrder(uint64_t orderId, uint64_t newId, uint32_t newQty, int64_t newPrice)
+	{
+		if (newQty == 0)
+			return cancelOrder(orderId);
+
+		Order *o = orderMap.find(orderId);
+		if (!o)
+			return false;
+
+		if (newId != orderId && (orderMap.find(newId) || stopOrderMap.find(newId)))
+		{
+			emitReject(newId, o->side, newQty, newPrice, RejectReason::DuplicateId);
+			return false;
+		}
+		if (!admitAmend(o, newId, newQty, newPrice))
+			return false;
+		if (newId != orderId)
+		{
+			orderMap.erase(orderId);
+			orderMap.assign(newId, o);
+			o->id = newId;
+		}
+
+		if (newPrice != o->price)
+			return moveOrder(o, newQty, newPrice, EventType::Replaced, orderId);
+
+		if (newId != orderId && shown(o))
+			publishOrder(OrderFeedType::Renumber, o, orderId, o->shares, newId);
+		amendQuantity(o, newQty);
+		emitEvent(EventType::Replaced, o, orderId);
+		return true;
+	}
+
+	// Two-sided quote update. Each leg replaces the live order with its id,
+	// enters a new limit order if none is live, or cancels it at zero
+	// quantity. When a leg moves through the other leg's current price, that
+	// leg is updated first so a quote never trades against itself. A crossed
+	// quote, a leg whose id rests on the other side and a new leg whose id a
+	// stop holds are rejected whole, both legs reported, before either leg
+	// is applied.
+	bool massQuote(const QuoteLeg &bid, const QuoteLeg &ask, uint32_t account = 0)
+	{
+		RejectReason r = RejectReason::None;
+		if ((bid.qty > 0 && ask.qty > 0 && bid.price >= ask.price) || bid.orderId == ask.orderId)
+			r = RejectReason::InvalidQuote;
+		for (auto [side, leg] : {std::pair{Side::Buy, &bid}, std::pair{Side::Sell, &ask}})
+		{
+			if (r != RejectReason::None)
+				break;
+			const Order *o = orderMap.find(leg->orderId);
+			if (o && o->side != side)
+				r = RejectReason::InvalidQuote;
+			else if (!o && leg->qty > 0 && stopOrderMap.find(leg->orderId))
+				r = RejectReason::DuplicateId;
+		}
+		if (r != RejectReason::None)
+		{
+			emitReject(bid.orderId, Side::Buy, bid.qty, bid.price, r);
+			emitReject(ask.orderId, Side::Sell, ask.qty, ask.price, r);
+			return false;
+		}
+
+		// The first leg can trigger stops that fill or cancel the other leg's
+		// order, so the second leg is looked up only once the first is done
+		Order *askOrder = orderMap.find(ask.orderId);
+		if (askOrder && bid.price >= askOrder->price)
+		{
+			applyQuoteLeg(Side::Sell, ask, askOrder, account);
+			applyQuoteLeg(Side::Buy, bid, orderMap.find(bid.orderId), account);
+		}
+		else
+		{
+			applyQuoteLeg(Side::Buy, bid, orderMap.find(bid.orderId), account);
+			applyQuoteLeg(Side::Sell, ask, orderMap.find(ask.orderId), account);
+		}
+		return true;
+	}
+
+	bool apply(const Command &c)
+	{
+		switch (c.type)
+		{
+		case CommandType::NewOrder:
+			return processOrder(c.id, c.side, c.orderType, c.qty, c.price, c.stopPrice, {c.minQty, c.hidden, c.account});
+		case CommandType::NewPegged:
+			return processPeggedOrder(c.id, c.side, c.pegType, c.qty, c.price, c.account);
+		case CommandType::Cancel:
+			return cancelOrder(c.id);
+		case CommandType::Modify:
+			return modifyOrder(c.id, c.qty, c.price);
+		case CommandType::Replace:
+			return replaceOrder(c.id, c.newId, c.qty, c.price);
+		case CommandType::MassQuote:
+			return massQuote({c.id, c.qty, c.price}, {c.newId, c.askQty, c.askPrice}, c.account);
+		case CommandType::StartAuction:
+			startAuction();
+			return true;
+		case CommandType::EndAuction:
+			endAuction();
+			return true;
+		case CommandType::MassCancel:
+			massCancel(c.account, c.qty & 1, c.qty & 2);
+			return true;
+		}
+		return false;
+	}
+
+	void setEventBuffer(RingBuffer<65536, OrderEvent> *rb) { eventBuffer = rb; }
+
+	// Attaches the market-by-price feed: a Level message for every displayed
+	// level change and a top-`levels` snapshot every `snapshotEvery` Level
+	// messages (0: only on request). Pegs and hidden orders are not shown.
+	// Books driven from one thread may share a ring, each with its own id.
+	void setDepthFeed(RingBuffer<65536, DepthUpdate> *rb, uint32_t levels = 10, uint64_t snapshotEvery = 0, uint16_t bookId = 0)
+	{
+		depthBuffer = rb;
+		depthBook = bookId;
+		depthLevels = levels;
+		depthEvery = snapshotEvery;
+		depthSinceSnapshot = 0;
+	}
+
+	// Attaches the market-by-order feed: an OrderFeedEvent for every change
+	// to a displayed order, enough to rebuild the displayed book order by
+	// order from an empty start. Like the depth feed it never advances the
+	// engine clock.
+	void setOrderFeed(RingBuffer<65536, OrderFeedEvent> *rb) { orderFeed = rb; }
+
+	// Attaches immutable depth images for query threads, starting them from
+	// the book's current full depth, and publishes a new image every
+	// `publishEvery` level changes (0: only on request).
+	void setDepthImages(DepthImages *images, uint64_t publishEvery = 0)
+	{
+		depthImages = images;
+		imageEvery = publishEvery;
+		imageSince = 0;
+		if (!images)
+			return;
+		DepthImage img;
+		for (Limit *L = getMax(buyRoot); L; L = nextBelow(buyRoot, L->price))
+			if (L->totalShares)
+				img.bids.push_back({L->price, L->totalShares, L->orderCount});
+		for (Limit *L = getMin(sellRoot); L; L = nextAbove(sellRoot, L->price))
+			if (L->totalShares)
+				img.asks.push_back({L->price, L->totalShares, L->orderCount});
+		img.timestamp = timestampCounter;
+		images->reset(img);
+	}
+
+	// Swaps in a new image holding every level change so far. Returns false
+	// when readers still hold both spare buffers; the next call catches up.
+	bool publishDepthImage()
+	{
+		imageSince = 0;
+		return depthImages && depthImages->publish(timestampCounter);
+	}
+
+	// Attaches a seqlock slot that always holds the displayed BBO, the last
+	// trade and the shares and notional of the best `depth` displayed levels
+	// of each side (at most TopLevels::MAX, 0 for none). The book writes it
+	// only when one of them changes, straight from the level aggregates it
+	// already maintains. Attach after loading a book.
+	void setBboSlot(BboSlot *slot, uint32_t depth = 5)
+	{
+		bboSlot = slot;
+		if (!slot)
+			return;
+		signalDepth = std::min(depth, TopLevels::MAX);
+		for (TopLevels &w : topLevels)
+			w.count = 0;
+		for (Limit *L = getMax(buyRoot); L && topLevels[0].count < signalDepth; L = nextBelow(buyRoot, L->price))
+			if (L->totalShares)
+			{
+				topLevels[0].price[topLevels[0].count] = L->price;
+				topLevels[0].qty[topLevels[0].count++] = L->totalShares;
+			}
+		for (Limit *L = getMin(sellRoot); L && topLevels[1].count < signalDepth; L = nextAbove(sellRoot, L->price))
+			if (L->totalShares)
+			{
+				topLevels[1].price[topLevels[1].count] = L->price;
+				topLevels[1].qty[topLevels[1].count++] = L->totalShares;
+			}
+		sumDepth(Side::Buy);
+		sumDepth(Side::Sell);
+		Limit *b = getMax(buyRoot), *a = getMin(sellRoot);
+		while (b && b->totalShares == 0)
+			b = nextBelow(buyRoot, b->price);
+		while (a && a->totalShares == 0)
+			a = nextAbove(sellRoot, a->price);
+		bbo.bidPrice = b ? b->price : 0;
+		bbo.bidQty = b ? b->totalShares : 0;
+		bbo.askPrice = a ? a->price : 0;
+		bbo.askQty = a ? a->totalShares : 0;
+		bbo.timestamp = timestampCounter;
+		bboChanged = true;
+		publishBbo();
+	}
+	uint64_t orderFeedOverflows() const { return orderFeedLost; }
+
+	// Publishes the best depthLevels displayed levels of each side. The
+	// snapshot reflects every Level message before it in the ring, so a
+	// consumer that lost messages resyncs from it. Call after loading a book.
+	void publishDepthSnapshot()
+	{
+		if (!depthBuffer)
+			return;
+		depthSinceSnapshot = 0;
+		depthBuffer->push({DepthMsgType::SnapshotBegin, Side::Buy, depthBook, depthLevels, 0, 0, timestampCounter, ++depthSeq});
+		auto put = [&](Side side, const Limit *L)
+		{
+			if (L->totalShares == 0) // hidden orders only
+				return false;
+			depthBuffer->push({DepthMsgType::Snapshot, side, depthBook, L->orderCount, L->price, L->totalShares, timestampCounter, ++depthSeq});
+			return true;
+		};
+		uint32_t n = 0;
+		for (Limit *L = getMax(buyRoot); L && n < depthLevels; L = nextBelow(buyRoot, L->price))
+			n += put(Side::Buy, L);
+		n = 0;
+		for (Limit *L = getMin(sellRoot); L && n < depthLevels; L = nextAbove(sellRoot, L->price))
+			n += put(Side::Sell, L);
+		depthBuffer->push({DepthMsgType::SnapshotEnd, Side::Buy, depthBook, depthLevels, 0, 0, timestampCounter, ++depthSeq});
+	}
+	// Orders already resting are counted into the manager's open quantity,
+	// so their later fills and cancels release only what was added
+	void setRiskManager(RiskManager *rm)
+	{
+		risk = rm;
+		if (!risk)
+			return;
+		addOpenTree(buyRoot);
+		addOpenTree(sellRoot);
+		for (const std::vector<PegGroup> *pegs : {&buyPegs, &sellPegs})
+			for (const PegGroup &g : *pegs)
+				for (const Order *o = g.level->head; o; o = o->next)
+					risk->addOpen(o->account, o->side, o->shares);
+	}
+
+	void setPriceBands(const PriceBandConfig &cfg)
+	{
+		bandConfig = cfg;
+		maxOrderQty = cfg.maxQty ? cfg.maxQty : UINT32_MAX;
+		recomputeBands();
+	}
+
+	void setReferencePrice(int64_t px)
+	{
+		referencePrice = px;
+		recomputeBands();
+	}
+
+	void setCircuitBreaker(const CircuitBreakerConfig &cfg)
+	{
+		breakerConfig = cfg;
+		if (cfg.moveBps > 0)
+			priceWindow.configure(cfg.window);
+	}
+
+	// Stops continuous matching. Limit orders keep resting (the book may
+	// cross), market orders are rejected and stops wait for the uncross.
+	void startAuction()
+	{
+		if (tradingState == TradingState::Auction)
+			return;
+		tradingState = TradingState::Auction;
+		emitStateChange(EventType::Halted);
+	}
+
+	// Uncrosses the book at the single equilibrium price and resumes
+	// continuous trading. Within each side orders fill in price-time
+	// priority, displayed before hidden; the buy order is reported as taker.
+	// Pegs stay out of the auction. Returns the auction price, 0 if the book
+	// was not crossed.
+	int64_t endAuction()
+	{
+		if (tradingState != TradingState::Auction)
+			return 0;
+
+		int64_t px = auctionPrice();
+		if (px > 0)
+		{
+			while (true)
+			{
+				Limit *bid = getMax(buyRoot), *ask = getMin(sellRoot);
+				if (!bid || !ask || bid->price < px || ask->price > px)
+					break;
+
+				Order *b = frontOrder(bid), *a = frontOrder(ask);
+				uint32_t traded = std::min(b->shares, a->shares);
+				uint64_t match = timestampCounter++;
+				tradeBuffer.push({b->id, a->id, traded, px, match});
+				if (bboSlot)
+					noteTrade(px, traded, match);
+				if (risk)
+				{
+					risk->releaseOpen(b->account, Side::Buy, traded);
+					risk->onTrade(b->account, Side::Buy, a->account, traded);
+				}
+
+				for (Order *o : {b, a})
+				{
+					if (orderFeed)
+						pushOrderFeed(shown(o) ? OrderFeedEvent{OrderFeedType::Execute, o->side, traded, o->id, match, px, match}
+												 : OrderFeedEvent{OrderFeedType::HiddenTrade, o->side, traded, 0, match, px, match});
+					Limit *L = o->parentLimit;
+					(o->hidden ? L->hiddenShares : L->totalShares) -= traded;
+					o->shares -= traded;
+					if (o->shares == 0)
+					{
+						removeResting(o);
+						orderMap.erase(o->id);
+						mm.recycleOrder(o);
+					}
+					else if (!o->hidden)
+						publishLevel(o->side, L);
+				}
+				if (bboSlot)
+					publishBbo();
+			}
+
+			referencePrice = px;
+			recomputeBands();
+		}
+
+		tradingState = TradingState::Continuous;
+		priceWindow.clear();
+		emitStateChange(EventType::Resumed);
+
+		if (px > 0)
+		{
+			std::vector<TriggeredStop> triggered;
+			checkStopOrders(px, Side::Buy, triggered);
+			checkStopOrders(px, Side::Sell, triggered);
+			for (const auto &ts : triggered)
+				processOrderInternal(generatedIdCounter++, ts.side, ts.convertToType, ts.shares, ts.limitPrice, 0, false, {0, false, ts.account});
+		}
+		return px;
+	}
+
+	TradingState getTradingState() const { return tradingState; }
+	uint64_t getHaltCount() const { return haltCount; }
+	// The engine clock: the timestamp the next event will carry
+	uint64_t getTimestamp() const { return timestampCounter; }
+	int64_t getReferencePrice() const { return referencePrice; }
+	uint64_t getRejectCount() const { return rejectCount; }
+
+	// The live resting order with this id, or null; for inspection only
+	const Order *findOrder(uint64_t id) const { return orderMap.find(id); }
+
+	size_t getOrderCount() const { return orderMap.size(); }
+	size_t getStopOrderCount() const { return stopOrderMap.size(); }
+	size_t getPegGroupCount() const { return buyPegs.size() + sellPegs.size(); }
+
+	// Passive mode: applies one market-by-order feed event to the book's
+	// levels and orders as the feed describes it. Nothing matches and no
+	// stop triggers; attached slots, images and feeds follow as they would
+	// for the matcher, on the source's clock. Returns false if the event
+	// does not fit the book (unknown or duplicate id, too many shares),
+	// which means the book has diverged from the source.
+	bool applyFeedEvent(const OrderFeedEvent &e)
+	{
+		timestampCounter = e.timestamp;
+		if (e.type == OrderFeedType::Add)
+		{
+			if (e.shares == 0 || orderMap.find(e.ref))
+				return false;
+			Order *o = mm.getOrder(e.ref, e.side, OrderType::Limit, e.shares, e.price, 0);
+			if (!o)
+				return false;
+			if (!restOrder(o))
+			{
+				mm.recycleOrder(o);
+				return false;
+			}
+			orderMap.assign(e.ref, o);
+			return true;
+		}
+		if (e.type == OrderFeedType::HiddenTrade)
+		{
+			noteTrade(e.price, e.shares, e.other);
+			if (bboSlot)
+				publishBbo();
+			return true;
+		}
+
+		Order *o = orderMap.find(e.ref);
+		if (!o)
+			return false;
+		switch (e.type)
+		{
+		case OrderFeedType::Execute:
+		{
+			if (e.shares == 0 || e.shares > o->shares)
+				return false;
+			Limit *L = o->parentLimit;
+			L->totalShares -= e.shares;
+			o->shares -= e.shares;
+			noteTrade(o->price, e.shares, e.other);
+			if (o->shares == 0)
+			{
+				removeResting(o);
+				orderMap.erase(e.ref);
+				mm.recycleOrder(o);
+			}
+			else
+				publishLevel(o->side, L);
+			if (bboSlot)
+				publishBbo();
+			return true;
+		}
+		case OrderFeedType::Cancel:
+			if (e.shares == 0 || e.shares >= o->shares)
+				return false;
+			amendQuantity(o, o->shares - e.shares);
+			return true;
+		case OrderFeedType::Delete:
+			removeResting(o);
+			orderMap.erase(e.ref);
+			mm.recycleOrder(o);
+			return true;
+		case OrderFeedType::Replace:
+			if (e.shares == 0 || (e.other != e.ref && orderMap.find(e.other)))
+				return false;
+			if (e.other == e.ref && e.price == o->price)
+			{
+				// Back of the same queue without touching the tree
+				Limit *L = o->parentLimit;
+				unlinkOrder(o);
+				o->shares = e.shares;
+				linkOrder(L, o);
+				publishLevel(o->side, L);
+				publishOrder(OrderFeedType::Replace, o, o->id, o->shares, o->id);
+				return true;
+			}
+			removeResting(o);
+			orderMap.erase(e.ref);
+			o->id = e.other;
+			o->shares = e.shares;
+			o->price = e.price;
+			if (!restOrder(o))
+			{
+				mm.recycleOrder(o);
+				return false;
+			}
+			orderMap.assign(e.other, o);
+			return true;
+		case OrderFeedType::Renumber:
+			if (orderMap.find(e.other))
+				return false;
+			orderMap.erase(e.ref);
+			o->id = e.other;
+			orderMap.assign(e.other, o);
+			if (shown(o))
+				publishOrder(OrderFeedType::Renumber, o, e.ref, o->shares, e.other);
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// Drops every resting order and loads a snapshot in their place, then
+	// brings attached BBO slots and depth images up to the loaded book. For
+	// passive books, which hold only displayed limit orders.
+	bool resetFromSnapshot(int fd, uint64_t &lastSeq)
+	{
+		if (!buyPegs.empty() || !sellPegs.empty() || stopBuyRoot || stopSellRoot)
+			return false;
+		clearTree(buyRoot);
+		clearTree(sellRoot);
+		buyRoot = sellRoot = nullptr;
+		if (!loadSnapshot(fd, lastSeq))
+			return false;
+		if (bboSlot)
+			setBboSlot(bboSlot, signalDepth);
+		if (depthImages)
+			setDepthImages(depthImages, imageEvery);
+		return true;
+	}
+
+	// Writes the full book state: every resting and stop order in queue
+	// order, peg groups, clocks and id counters, protection settings and the
+	// breaker window. lastSeq records the journal position the state
+	// corresponds to. Attached rings and the RiskManager are not part of the
+	// book and are not saved. Does not allocate.
+	bool saveSnapshot(SnapshotWriter &out, uint64_t lastSeq) const
+	{
+		SnapshotHeader h{};
+		std::memcpy(h.magic, "MESNAP01", 8);
+		h.version = 1;
+		h.recordSize = sizeof(SnapshotOrder);
+		h.lastSeq = lastSeq;
+		h.orderCount = orderMap.size();
+		h.stopOrderCount = stopOrderMap.size();
+		h.timestampCounter = timestampCounter;
+		h.generatedIdCounter = generatedIdCounter;
+		h.rejectCount = rejectCount;
+		h.haltCount = haltCount;
+		h.referencePrice = referencePrice;
+		h.bandConfig = bandConfig;
+		h.breakerConfig = breakerConfig;
+		h.tradingState = tradingState;
+		out.put(h);
+
+		for (const Limit *root : {buyRoot, sellRoot, stopBuyRoot, stopSellRoot})
+		{
+			saveTree(out, root);
+			out.put(SnapshotLevel{});
+		}
+		for (const std::vector<PegGroup> *pegs : {&buyPegs, &sellPegs})
+		{
+			out.put(static_cast<uint64_t>(pegs->size()));
+			for (const PegGroup &g : *pegs)
+			{
+				out.put(SnapshotPegGroup{g.offset, g.level->orderCount, g.type});
+				saveQueue(out, g.level->head);
+			}
+		}
+		priceWindow.save(out);
+		out.write("MESNAPND", 8);
+		return out.flush();
+	}
+
+	bool saveSnapshot(int fd, uint64_t lastSeq) const
+	{
+		SnapshotWriter out(fd);
+		return saveSnapshot(out, lastSeq);
+	}
+
+	// Writes to path.tmp, syncs it and renames it over path, so a crash
+	// mid-write never leaves a torn snapshot behind
+	bool saveSnapshot(const char *path, uint64_t lastSeq) const
+	{
+		std::string tmp = std::string(path) + ".tmp";
+		int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			return false;
+		bool ok = saveSnapshot(fd, lastSeq) && ::fsync(fd) == 0;
+		ok = ::close(fd) == 0 && ok;
+		if (ok && std::rename(tmp.c_str(), path) == 0)
+			return true;
+		std::remove(tmp.c_str());
+		return false;
+	}
+
+	// Rebuilds an empty book from a snapshot: levels are bulk-loaded into
+	// balanced trees and the index is presized. An attached RiskManager gets
+	// the open quantity of the restored orders. On false the book is
+	// partially loaded and must be discarded.
+	bool loadSnapshot(int fd, uint64_t &lastSeq)
+	{
+		if (buyRoot || sellRoot || stopBuyRoot || stopSellRoot || !orderMap.empty() ||
+			!stopOrderMap.empty() || !buyPegs.empty() || !sellPegs.empty())
+			return false;
+
+		SnapshotReader in(fd);
+		SnapshotHeader h;
+		if (!in.get(h) || std::memcmp(h.magic, "MESNAP01", 8) != 0 || h.version != 1 ||
+			h.recordSize != sizeof(SnapshotOrder))
+			return false;
+
+		orderMap.reserve(h.orderCount);
+		stopOrderMap.reserve(h.stopOrderCount);
+		if (!loadTree(in, Side::Buy, false, buyRoot) || !loadTree(in, Side::Sell, false, sellRoot) ||
+			!loadTree(in, Side::Buy, true, stopBuyRoot) || !loadTree(in, Side::Sell, true, stopSellRoot) ||
+			!loadPegs(in, Side::Buy) || !loadPegs(in, Side::Sell) || !priceWindow.load(in))
+			return false;
+
+		char trailer[8];
+		if (!in.read(trailer, 8) || std::memcmp(trailer, "MESNAPND", 8) != 0 ||
+			orderMap.size() != h.orderCount || stopOrderMap.size() != h.stopOrderCount)
+			return false;
+
+		timestampCounter = h.timestampCounter;
+		generatedIdCounter = h.generatedIdCounter;
+		rejectCount = h.rejectCount;
+		haltCount = h.haltCount;
+		tradingState = h.tradingState;
+		breakerConfig = h.breakerConfig;
+		setPriceBands(h.bandConfig);
+		setReferencePrice(h.referencePrice);
+		lastSeq = h.lastSeq;
+		return true;
+	}
+
+	// Stores the tree roots, peg groups and scalar state in the region the
+	// pools are mapped from and syncs it; the region can then be reattached
+	// by a later process or a new build with the same layout. The book stays
+	// usable. lastSeq records the journal position the state corresponds to.
+	bool persist(uint64_t lastSeq)
+	{
+		BookRegion *r = mm.mappedRegion();
+		if (!r || !regionBound)
+			return false;
+		r->buyRoot = buyRoot;
+		r->sellRoot = sellRoot;
+		r->stopBuyRoot = stopBuyRoot;
+		r->stopSellRoot = stopSellRoot;
+		// Peg levels sit outside the trees, so their right link is free to
+		// chain them; it is rewritten on every persist
+		for (Side side : {Side::Buy, Side::Sell})
+		{
+			std::vector<PegGroup> &pegs = (side == Side::Buy) ? buyPegs : sellPegs;
+			Limit *chain = nullptr;
+			for (size_t i = pegs.size(); i > 0; --i)
+			{
+				pegs[i - 1].level->right = chain;
+				chain = pegs[i - 1].level;
+			}
+			(side == Side::Buy ? r->buyPegs : r->sellPegs) = chain;
+		}
+		r->lastSeq = lastSeq;
+		r->timestampCounter = timestampCounter;
+		r->generatedIdCounter = generatedIdCounter;
+		r->rejectCount = rejectCount;
+		r->haltCount = haltCount;
+		r->referencePrice = referencePrice;
+		r->bandConfig = bandConfig;
+		r->breakerConfig = breakerConfig;
+		r->tradingState = tradingState;
+		return mm.syncRegion();
+	}
+
+	// Adopts the book held in a region the memory manager has just attached.
+	// Levels, queues and the id indexes are used in place, so the cost does
+	// not grow with the book; only the short peg group list is rebuilt. An
+	// attached RiskManager is given the open quantity, which does walk every
+	// order. The breaker's rolling window starts empty.
+	bool attach(uint64_t &lastSeq)
+	{
+		bindRegion();
+		BookRegion *r = mm.mappedRegion();
+		if (!r || buyRoot || sellRoot || stopBuyRoot || stopSellRoot || !buyPegs.empty() || !sellPegs.empty())
+			return false;
+
+		buyRoot = r->buyRoot;
+		sellRoot = r->sellRoot;
+		stopBuyRoot = r->stopBuyRoot;
+		stopSellRoot = r->stopSellRoot;
+		for (Side side : {Side::Buy, Side::Sell})
+			for (Limit *L = (side == Side::Buy) ? r->buyPegs : r->sellPegs; L; L = L->right)
+			{
+				((side == Side::Buy) ? buyPegs : sellPegs).push_back({L->head->pegType, L->price, L});
+				if (risk)
+					for (const Order *o = L->head; o; o = o->next)
+						risk->addOpen(o->account, side, o->shares);
+			}
+		if (risk)
+		{
+			addOpenTree(buyRoot);
+			addOpenTree(sellRoot);
+		}
+
+		timestampCounter = r->timestampCounter;
+		generatedIdCounter = r->generatedIdCounter;
+		rejectCount = r->rejectCount;
+		haltCount = r->haltCount;
+		tradingState = r->tradingState;
+		setCircuitBreaker(r->breakerConfig);
+		setPriceBands(r->bandConfig);
+		setReferencePrice(r->referencePrice);
+		lastSeq = r->lastSeq;
+		return true;
+	}
+
+	bool loadSnapshot(const char *path, uint64_t &lastSeq)
+	{
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+		bool ok = loadSnapshot(fd, lastSeq);
+		::close(fd);
+		return ok;
+	}
+};
+
+// Snapshot that does not stop matching. start() forks on the engine thread
+// between two commands, so the child inherits a consistent image of the
+// book; copy-on-write keeps that image frozen while the parent carries on.
+// Everything the child needs (file, buffer, paths) is prepared before the
+// fork, so the child never allocates: it serializes at low priority, syncs,
+// renames the file into place and exits. The parent pays for the fork's
+// page-table copy once, then one page copy per pool page it first writes.
+class SnapshotFork
+{
+	pid_t child = -1;
+	bool written = false;
+	std::string path, tmpPath;
+
+	void reap(bool block)
+	{
+		int status = 0;
+		pid_t r = ::waitpid(child, &status, block ? 0 : WNOHANG);
+		if (r == 0)
+			return;
+		written = r > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		if (!written)
+			std::remove(tmpPath.c_str());
+		child = -1;
+	}
+
+public:
+	~SnapshotFork() { wait(); }
+
+	bool start(const OrderBook &book, const char *target, uint64_t lastSeq)
+	{
+		if (child > 0)
+			return false;
+		written = false;
+		path = target;
+		tmpPath = path + ".tmp";
+		int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			return false;
+		SnapshotWriter out(fd);
+
+		child = ::fork();
+		if (child == 0)
+		{
+			(void)::nice(10);
+			bool ok = book.saveSnapshot(out, lastSeq) && ::fsync(fd) == 0 &&
+					  ::rename(tmpPath.c_str(), path.c_str()) == 0;
+			::_exit(ok ? 0 : 1);
+		}
+		::close(fd);
+		if (child > 0)
+			return true;
+		std::remove(tmpPath.c_str());
+		return false;
+	}
+
+	bool running()
+	{
+		if (child > 0)
+			reap(false);
+		return child > 0;
+	}
+
+	// Blocks until the child exits; true if the last snapshot was written
+	bool wait()
+	{
+		if (child > 0)
+			reap(true);
+		return written;
+	}
+};
+
+// --- 9. COMMAND JOURNAL ---
+// blockAlign is non-zero when records were written with O_DIRECT. Each write
+// is then zero-padded to a block boundary with at least 8 bytes, so a record
+// that reads seq 0 is padding and the next one starts at the following
+// multiple of blockAlign.
+struct JournalHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint32_t blockAlign;
+	uint32_t reserved;
+};
+
+struct JournalRecord
+{
+	uint64_t seq;
+	Command cmd;
+};
+
+enum class JournalBackend : uint8_t
+{
+	Posix,	// write() + fdatasync on the writer thread
+	IoUring // registered buffers on a fixed file, several writes in flight
+};
+
+struct JournalConfig
+{
+	uint64_t commitWindowUs = 200; // longest a written record waits for its fdatasync; 0 syncs every batch
+	bool sync = true;			   // false: write() only, the durable cursor follows writes
+	size_t batchRecords = 4096;
+	JournalBackend backend = JournalBackend::Posix;
+	bool directIo = false;				 // io_uring only; dropped if the filesystem refuses O_DIRECT
+	unsigned uringBuffers = 8;			 // writes in flight
+	size_t uringBufferBytes = 256 << 10; // multiple of 4096
+};
+
+#if defined(__linux__)
+// Minimal io_uring driver on the raw syscalls (no liburing): the submission
+// and completion rings are mapped from the kernel and driven by one thread.
+class IoUring
+{
+	int ringFd = -1;
+	void *sqRing = MAP_FAILED, *cqRing = MAP_FAILED, *sqeMem = MAP_FAILED;
+	size_t sqRingBytes = 0, cqRingBytes = 0, sqeBytes = 0;
+	io_uring_sqe *sqes = nullptr;
+	io_uring_cqe *cqes = nullptr;
+	unsigned *sqHead = nullptr, *sqTail = nullptr, *sqArray = nullptr;
+	unsigned *cqHead = nullptr, *cqTail = nullptr;
+	unsigned sqMask = 0, cqMask = 0, sqEntries = 0;
+	unsigned localTail = 0, toSubmit = 0;
+
+	template <typename T>
+	static T *at(void *base, uint32_t offset) { return reinterpret_cast<T *>(static_cast<char *>(base) + offset); }
+
+public:
+	~IoUring() { destroy(); }
+
+	bool init(unsigned entries)
+	{
+		io_uring_params p{};
+		ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+		if (ringFd < 0)
+			return false;
+
+		sqRingBytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cqRingBytes = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+		if (single)
+			sqRingBytes = cqRingBytes = std::max(sqRingBytes, cqRingBytes);
+		sqeBytes = p.sq_entries * sizeof(io_uring_sqe);
+
+		sqRing = mmap(nullptr, sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+		cqRing = single ? sqRing : mmap(nullptr, cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		sqeMem = mmap(nullptr, sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+		if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqeMem == MAP_FAILED)
+		{
+			destroy();
+			return false;
+		}
+
+		sqHead = at<unsigned>(sqRing, p.sq_off.head);
+		sqTail = at<unsigned>(sqRing, p.sq_off.tail);
+		sqArray = at<unsigned>(sqRing, p.sq_off.array);
+		sqMask = *at<unsigned>(sqRing, p.sq_off.ring_mask);
+		sqEntries = p.sq_entries;
+		cqHead = at<unsigned>(cqRing, p.cq_off.head);
+		cqTail = at<unsigned>(cqRing, p.cq_off.tail);
+		cqMask = *at<unsigned>(cqRing, p.cq_off.ring_mask);
+		cqes = at<io_uring_cqe>(cqRing, p.cq_off.cqes);
+		sqes = static_cast<io_uring_sqe *>(sqeMem);
+		localTail = *sqTail;
+		return true;
+	}
+
+	void destroy()
+	{
+		if (sqeMem != MAP_FAILED)
+			munmap(sqeMem, sqeBytes);
+		if (cqRing != MAP_FAILED && cqRing != sqRing)
+			munmap(cqRing, cqRingBytes);
+		if (sqRing != MAP_FAILED)
+			munmap(sqRing, sqRingBytes);
+		sqRing = cqRing = sqeMem = MAP_FAILED;
+		if (ringFd >= 0)
+			::close(ringFd);
+		ringFd = -1;
+	}
+
+	bool registerBuffers(const iovec *iov, unsigned n)
+	{
+		return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, iov, n) == 0;
+	}
+
+	// The file becomes fixed slot 0 (IOSQE_FIXED_FILE with fd 0)
+	bool registerFile(int fd)
+	{
+		return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES, &fd, 1) == 0;
+	}
+
+	// Zeroed SQE queued for the next submit(), or nullptr when the ring is full
+	io_uring_sqe *getSqe()
+	{
+		unsigned head = std::atomic_ref<unsigned>(*sqHead).load(std::memory_order_acquire);
+		if (localTail - head >= sqEntries)
+			return nullptr;
+		unsigned idx = localTail & sqMask;
+		sqArray[idx] = idx;
+		++localTail;
+		++toSubmit;
+		std::memset(&sqes[idx], 0, sizeof(io_uring_sqe));
+		return &sqes[idx];
+	}
+
+	// Publishes queued SQEs in one io_uring_enter. Also called with nothing
+	// queued to let the kernel flush completions still pending as task work.
+	bool submit(unsigned waitFor = 0)
+	{
+		std::atomic_ref<unsigned>(*sqTail).store(localTail, std::memory_order_release);
+		long r = syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor, IORING_ENTER_GETEVENTS, nullptr, 0);
+		if (r < 0)
+			return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+		toSubmit -= std::min<unsigned>(toSubmit, static_cast<unsigned>(r));
+		return true;
+	}
+
+	bool peek(io_uring_cqe &out)
+	{
+		unsigned head = std::atomic_ref<unsigned>(*cqHead).load(std::memory_order_relaxed);
+		if (head == std::atomic_ref<unsigned>(*cqTail).load(std::memory_order_acquire))
+			return false;
+		out = cqes[head & cqMask];
+		std::atomic_ref<unsigned>(*cqHead).store(head + 1, std::memory_order_release);
+		return true;
+	}
+};
+#endif
+
+// Write-ahead journal. The engine thread hands each sequenced command to a
+// dedicated writer thread through an SPSC ring; the writer drains the ring
+// in batches with one write() each and group-commits them with a single
+// fdatasync once the oldest unsynced record has waited commitWindowUs.
+// durableSeq() is the acknowledgment cursor: every command up to it is on
+// stable storage.
+//
+// The io_uring backend fills a small set of registered buffers instead and
+// keeps up to uringBuffers writes in flight against the fixed file, so the
+// writer thread never blocks in write(). Buffers are reused in submission
+// order, which makes them the FIFO of in-flight writes: the written cursor
+// advances past a buffer once it and every buffer before it have completed.
+// The group commit is an IORING_OP_FSYNC covering completed writes only.
+// If io_uring is unavailable, open() falls back to the write() backend.
+class JournalWriter
+{
+	static constexpr size_t BLOCK = 4096;
+	static constexpr uint64_t SYNC_TAG = ~0ull;
+
+	JournalConfig cfg;
+	std::unique_ptr<RingBuffer<65536, JournalRecord>> ring;
+	int fd = -1;
+	JournalBackend active = JournalBackend::Posix;
+	bool direct = false;
+#if defined(__linux__)
+	IoUring uring;
+	std::vector<char *> buffers;
+#endif
+	std::thread writer;
+	std::atomic<bool> running{false};
+	std::atomic<bool> failed{false};
+	alignas(64) std::atomic<uint64_t> durable{0};
+	std::atomic<uint64_t> written{0};
+	std::atomic<uint64_t> syncs{0}, bytes{0};
+
+	bool writeAll(const void *data, size_t len)
+	{
+		const char *p = static_cast<const char *>(data);
+		while (len > 0)
+		{
+			ssize_t n = ::write(fd, p, len);
+			if (n < 0)
+				return false;
+			p += n;
+			len -= static_cast<size_t>(n);
+		}
+		bytes.fetch_add(p - static_cast<const char *>(data), std::memory_order_relaxed);
+		return true;
+	}
+
+	void syncFile()
+	{
+#if defined(__APPLE__)
+		::fsync(fd);
+#else
+		::fdatasync(fd);
+#endif
+	}
+
+	JournalHeader header() const
+	{
+		return {{'M', 'E', 'J', 'R', 'N', 'L', '0', '1'}, 2, sizeof(JournalRecord), direct ? static_cast<uint32_t>(BLOCK) : 0, 0};
+	}
+
+	void runPosix()
+	{
+		std::vector<JournalRecord> batch(cfg.batchRecords);
+		auto window = std::chrono::microseconds(cfg.commitWindowUs);
+		auto oldestUnsynced = std::chrono::steady_clock::time_point::max();
+		uint64_t lastWritten = 0;
+
+		while (true)
+		{
+			bool stopping = !running.load(std::memory_order_acquire);
+			size_t n = 0;
+			while (n < batch.size() && ring->pop(batch[n]))
+				++n;
+
+			if (n > 0)
+			{
+				if (!writeAll(batch.data(), n * sizeof(JournalRecord)))
+				{
+					failed.store(true, std::memory_order_release);
+					return;
+				}
+				if (lastWritten == durable.load(std::memory_order_relaxed))
+					oldestUnsynced = std::chrono::steady_clock::now();
+				lastWritten = batch[n - 1].seq;
+				written.store(lastWritten, std::memory_order_release);
+			}
+
+			bool drained = n == 0 && ring->size() == 0;
+			if (lastWritten != durable.load(std::memory_order_relaxed) &&
+				(!cfg.sync || stopping || std::chrono::steady_clock::now() - oldestUnsynced >= window))
+			{
+				if (cfg.sync)
+				{
+					syncFile();
+					syncs.fetch_add(1, std::memory_order_relaxed);
+				}
+				durable.store(lastWritten, std::memory_order_release);
+			}
+			else if (stopping && drained)
+				return;
+			else if (n == 0)
+				std::this_thread::yield();
+		}
+	}
+
+#if defined(__linux__)
+	bool setupUring()
+	{
+		size_t bufBytes = (cfg.uringBufferBytes + BLOCK - 1) / BLOCK * BLOCK;
+		if (cfg.uringBuffers == 0 || bufBytes < sizeof(JournalHeader) + sizeof(JournalRecord) ||
+			!uring.init(cfg.uringBuffers * 2 + 2))
+			return false;
+		cfg.uringBufferBytes = bufBytes;
+		std::vector<iovec> iov;
+		for (unsigned i = 0; i < cfg.uringBuffers; ++i)
+		{
+			// One spare block for padding that has to spill past a full buffer
+			char *b = static_cast<char *>(std::aligned_alloc(BLOCK, bufBytes + BLOCK));
+			if (!b)
+				break;
+			std::memset(b, 0, bufBytes + BLOCK);
+			buffers.push_back(b);
+			iov.push_back({b, bufBytes + BLOCK});
+		}
+		if (buffers.size() == cfg.uringBuffers && uring.registerBuffers(iov.data(), cfg.uringBuffers) &&
+			uring.registerFile(fd))
+			return true;
+		releaseUring();
+		return false;
+	}
+
+	void releaseUring()
+	{
+		uring.destroy();
+		for (char *b : buffers)
+			std::free(b);
+		buffers.clear();
+	}
+
+	void runUring()
+	{
+		const unsigned slots = static_cast<unsigned>(buffers.size());
+		const size_t bufBytes = cfg.uringBufferBytes;
+		std::vector<uint64_t> slotSeq(slots, 0);
+		std::vector<uint8_t> slotDone(slots, 0);
+		// What each slot's write still has to put on disk: buffer position,
+		// length and file offset, advanced past short completions
+		std::vector<uint64_t> slotPos(slots, 0), slotLen(slots, 0), slotOffset(slots, 0);
+		uint64_t submitted = 0, completed = 0; // buffer counters; slot = counter % slots
+		uint64_t fileOffset = 0;
+		uint64_t lastFilled = 0, lastSubmitted = 0, lastWritten = 0;
+		uint64_t syncedUpTo = 0, syncTarget = 0;
+		bool syncInFlight = false;
+		auto window = std::chrono::microseconds(cfg.commitWindowUs);
+		auto oldestUnsynced = std::chrono::steady_clock::time_point::max();
+
+		// The header leads the first buffer so O_DIRECT never sees an unaligned write
+		JournalHeader h = header();
+		std::memcpy(buffers[0], &h, sizeof(h));
+		size_t fill = sizeof(h);
+
+		auto fail = [this]
+		{ failed.store(true, std::memory_order_release); };
+
+		auto submitWrite = [&](unsigned slot)
+		{
+			io_uring_sqe *sqe = uring.getSqe();
+			if (!sqe)
+				return false;
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->flags = IOSQE_FIXED_FILE;
+			sqe->fd = 0;
+			sqe->addr = reinterpret_cast<uint64_t>(buffers[slot] + slotPos[slot]);
+			sqe->len = static_cast<uint32_t>(slotLen[slot]);
+			sqe->off = slotOffset[slot];
+			sqe->buf_index = static_cast<uint16_t>(slot);
+			sqe->user_data = slot;
+			return uring.submit();
+		};
+
+		while (true)
+		{
+			bool stopping = !running.load(std::memory_order_acquire);
+			bool progressed = false;
+
+			io_uring_cqe cqe;
+			while (uring.peek(cqe))
+			{
+				progressed = true;
+				if (cqe.res < 0)
+					return fail();
+				if (cqe.user_data == SYNC_TAG)
+				{
+					syncInFlight = false;
+					syncs.fetch_add(1, std::memory_order_relaxed);
+					durable.store(syncTarget, std::memory_order_release);
+					continue;
+				}
+				unsigned slot = static_cast<unsigned>(cqe.user_data);
+				uint64_t done = static_cast<uint64_t>(cqe.res);
+				bytes.fetch_add(done, std::memory_order_relaxed);
+				if (done < slotLen[slot])
+				{
+					// A short write: the rest goes out again, or the journal
+					// would have a hole that a later sync appears to cover.
+					// O_DIRECT cannot continue from an unaligned position.
+					slotPos[slot] += done;
+					slotOffset[slot] += done;
+					slotLen[slot] -= done;
+					if (done == 0 || (direct && done % BLOCK != 0) || !submitWrite(slot))
+						return fail();
+					continue;
+				}
+				slotDone[slot] = 1;
+			}
+			while (completed < submitted && slotDone[completed % slots])
+			{
+				slotDone[completed % slots] = 0;
+				lastWritten = slotSeq[completed % slots];
+				++completed;
+				written.store(lastWritten, std::memory_order_release);
+				if (!cfg.sync)
+					durable.store(lastWritten, std::memory_order_release);
+			}
+
+			// Fill the next free buffer with whole records
+			bool drained = false;
+			if (submitted - completed < slots)
+			{
+				char *buf = buffers[submitted % slots];
+				JournalRecord r;
+				while (fill + sizeof(JournalRecord) <= bufBytes)
+				{
+					if (!ring->pop(r))
+					{
+						drained = true;
+						break;
+					}
+					std::memcpy(buf + fill, &r, sizeof(r));
+					fill += sizeof(r);
+					lastFilled = r.seq;
+					progressed = true;
+				}
+
+				// A full buffer goes out at once; a partial one only when the disk
+				// is idle, which batches records while earlier writes are in flight
+				bool full = fill + sizeof(JournalRecord) > bufBytes;
+				if (fill > 0 && (full || (drained && (submitted == completed || stopping))))
+				{
+					size_t len = fill;
+					if (direct && fill % BLOCK != 0)
+					{
+						len = (fill + sizeof(uint64_t) + BLOCK - 1) / BLOCK * BLOCK;
+						std::memset(buf + fill, 0, len - fill);
+					}
+					unsigned slot = static_cast<unsigned>(submitted % slots);
+					slotSeq[slot] = lastFilled;
+					slotPos[slot] = 0;
+					slotLen[slot] = len;
+					slotOffset[slot] = fileOffset;
+					if (!submitWrite(slot))
+						return fail();
+					if (lastSubmitted == syncedUpTo)
+						oldestUnsynced = std::chrono::steady_clock::now();
+					fileOffset += len;
+					lastSubmitted = lastFilled;
+					++submitted;
+					fill = 0;
+				}
+			}
+
+			if (cfg.sync && !syncInFlight && lastWritten != syncedUpTo &&
+				(stopping || std::chrono::steady_clock::now() - oldestUnsynced >= window))
+			{
+				io_uring_sqe *sqe = uring.getSqe();
+				if (!sqe)
+					return fail();
+				sqe->opcode = IORING_OP_FSYNC;
+				sqe->flags = IOSQE_FIXED_FILE;
+				sqe->fd = 0;
+				sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+				sqe->user_data = SYNC_TAG;
+				if (!uring.submit())
+					return fail();
+				syncInFlight = true;
+				syncTarget = syncedUpTo = lastWritten;
+				if (lastSubmitted != lastWritten)
+					oldestUnsynced = std::chrono::steady_clock::now();
+				progressed = true;
+			}
+
+			bool idle = submitted == completed && !syncInFlight;
+			if (stopping && drained && fill == 0 && idle && (!cfg.sync || syncedUpTo == lastWritten))
+				return;
+			if (!progressed)
+			{
+				// Completions of buffered writes may wait as task work until we enter
+				if (!idle && !uring.submit())
+					return fail();
+				std::this_thread::yield();
+			}
+		}
+	}
+#endif
+
+	void run()
+	{
+#if defined(__linux__)
+		if (active == JournalBackend::IoUring)
+			return runUring();
+#endif
+		runPosix();
+	}
+
+public:
+	explicit JournalWriter(const JournalConfig &c = {}) : cfg(c), ring(std::make_unique<RingBuffer<65536, JournalRecord>>()) {}
+	~JournalWriter() { close(); }
+
+	// Creates (truncating) the journal file and starts the writer thread
+	bool open(const char *path)
+	{
+		active = JournalBackend::Posix;
+		direct = false;
+		int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#if defined(__linux__)
+		if (cfg.backend == JournalBackend::IoUring)
+		{
+			if (cfg.directIo)
+			{
+				fd = ::open(path, flags | O_DIRECT, 0644);
+				direct = fd >= 0;
+			}
+			if (fd < 0)
+				fd = ::open(path, flags, 0644);
+			if (fd >= 0 && setupUring())
+				active = JournalBackend::IoUring;
+			else if (direct)
+			{
+				// The write() path does not align its batches
+				::close(fd);
+				fd = -1;
+				direct = false;
+			}
+		}
+#endif
+		if (fd < 0)
+			fd = ::open(path, flags, 0644);
+		if (fd < 0)
+			return false;
+		JournalHeader h = header();
+		if (active == JournalBackend::Posix && !writeAll(&h, sizeof(h)))
+			return false;
+		running.store(true, std::memory_order_release);
+		writer = std::thread([this]
+							 { run(); });
+		return true;
+	}
+
+	// Engine thread. Blocks only while the ring is full, which is the
+	// backpressure a write-ahead log has to apply. Returns false once the
+	// writer has failed: the record will never reach the file.
+	bool append(uint64_t seq, const Command &cmd)
+	{
+		JournalRecord r{seq, cmd};
+		if (failed.load(std::memory_order_acquire))
+			return false;
+		while (!ring->push(r))
+		{
+			if (failed.load(std::memory_order_relaxed))
+				return false;
+			std::this_thread::yield();
+		}
+		return true;
+	}
+
+	// Drains the ring, syncs and stops the writer
+	void close()
+	{
+		if (fd < 0)
+			return;
+		running.store(false, std::memory_order_release);
+		if (writer.joinable())
+			writer.join();
+#if defined(__linux__)
+		releaseUring();
+#endif
+		::close(fd);
+		fd = -1;
+	}
+
+	uint64_t durableSeq() const { return durable.load(std::memory_order_acquire); }
+	uint64_t writtenSeq() const { return written.load(std::memory_order_acquire); }
+	uint64_t syncCount() const { return syncs.load(std::memory_order_relaxed); }
+	uint64_t bytesWritten() const { return bytes.load(std::memory_order_relaxed); }
+	bool hasFailed() const { return failed.load(std::memory_order_acquire); }
+	JournalBackend backend() const { return active; }
+	bool directIo() const { return direct; }
+};
+
+// Sequential reader for a journal file written by either backend; skips the
+// block padding of O_DIRECT journals.
+class JournalReader
+{
+	int fd = -1;
+	std::unique_ptr<SnapshotReader> in;
+	uint64_t offset = 0;
+	uint32_t blockAlign = 0;
+
+public:
+	~JournalReader() { close(); }
+
+	bool open(const char *path)
+	{
+		close();
+		fd = ::open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+		in = std::make_unique<SnapshotReader>(fd);
+		JournalHeader h;
+		if (!in->get(h) || std::memcmp(h.magic, "MEJRNL01", 8) != 0 || h.version != 2 ||
+			h.recordSize != sizeof(JournalRecord))
+		{
+			close();
+			return false;
+		}
+		offset = sizeof(h);
+		blockAlign = h.blockAlign;
+		return true;
+	}
+
+	// False at the end of the journal (or at a torn final record). Padding
+	// is at least 8 bytes, so reading the seq alone tells it apart.
+	bool next(JournalRecord &r)
+	{
+		while (fd >= 0 && in->get(r.seq))
+		{
+			offset += sizeof(r.seq);
+			if (r.seq != 0)
+			{
+				offset += sizeof(r.cmd);
+				return in->get(r.cmd);
+			}
+			if (blockAlign == 0)
+				return false;
+			uint64_t start = offset - sizeof(r.seq);
+			uint64_t skip = (start + blockAlign - 1) / blockAlign * blockAlign - offset;
+			char pad[4096];
+			for (uint64_t n; skip > 0; skip -= n)
+			{
+				n = std::min<uint64_t>(skip, sizeof(pad));
+				if (!in->read(pad, n))
+					return false;
+				offset += n;
+			}
+		}
+		return false;
+	}
+
+	void close()
+	{
+		in.reset();
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+	}
+};
+
+// Applies the journaled commands sequenced after afterSeq, which is how a
+// book loaded from a snapshot catches up. Returns the last sequence seen.
+uint64_t replayJournal(OrderBook &book, const char *path, uint64_t afterSeq)
+{
+	JournalReader reader;
+	uint64_t last = afterSeq;
+	if (!reader.open(path))
+		return last;
+	JournalRecord r;
+	while (reader.next(r))
+	{
+		if (r.seq <= afterSeq)
+			continue;
+		book.apply(r.cmd);
+		last = r.seq;
+	}
+	return last;
+}
+
+// Holds executions back until the commands that produced them are durable.
+// After each journaled command that traded, the engine thread marks the
+// trade ring position it reached; the consumer only pops trades up to the
+// last mark whose command the journal has synced.
+class ReleaseGate
+{
+	struct Mark
+	{
+		uint64_t seq;
+		uint64_t tradePos;
+	};
+
+	JournalWriter &journal;
+	RingBuffer<65536> &trades;
+	std::unique_ptr<RingBuffer<65536, Mark>> marks;
+	uint64_t lastMarkedPos; // engine thread
+	Mark pending{};			// consumer thread from here on
+	bool hasPending = false;
+	uint64_t releasable;
+
+public:
+	ReleaseGate(JournalWriter &j, RingBuffer<65536> &t)
+		: journal(j), trades(t), marks(std::make_unique<RingBuffer<65536, Mark>>()),
+		  lastMarkedPos(t.writePosition()), releasable(t.writePosition()) {}
+
+	void mark(uint64_t seq)
+	{
+		uint64_t pos = trades.writePosition();
+		if (pos == lastMarkedPos)
+			return;
+		lastMarkedPos = pos;
+		while (!marks->push({seq, pos}) && !journal.hasFailed())
+			std::this_thread::yield();
+	}
+
+	// Consumer thread: trades below this ring position may be released
+	uint64_t releasablePosition()
+	{
+		uint64_t durableSeq = journal.durableSeq();
+		while (hasPending || marks->pop(pending))
+		{
+			if (pending.seq > durableSeq)
+			{
+				hasPending = true;
+				break;
+			}
+			releasable = pending.tradePos;
+			hasPending = false;
+		}
+		return releasable;
+	}
+};
+
+// --- 10. COMPACT LOGS ---
+// Archive format for trade logs and journals. Records are delta/varint
+// encoded against the previous record and packed into blocks of about
+// blockBytes, each framed with a CRC-32C. Every block starts from a reset
+// codec, so it decodes on its own. An index of block offsets and first keys
+// follows the last block, and a trailer points back at it. A file whose
+// writer died has no trailer; the reader then rebuilds the index by walking
+// the block headers and stops at the first torn block.
+struct CompactLogHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t kind; // Codec::KIND
+	uint32_t blockBytes;
+	uint32_t reserved;
+};
+
+struct CompactBlockHeader
+{
+	uint32_t payloadBytes;
+	uint32_t records;
+	uint64_t firstKey;
+	uint32_t crc; // CRC-32C of the payload
+	uint32_t reserved;
+};
+
+struct CompactIndexEntry
+{
+	uint64_t offset; // of the block header
+	uint64_t firstKey;
+	uint64_t firstRecord;
+};
+
+struct CompactLogTrailer
+{
+	uint64_t indexOffset;
+	uint64_t blocks;
+	uint64_t records;
+	char magic[8];
+};
+
+// CRC-32C (Castagnoli): the SSE4.2 crc32 instruction when the build targets
+// it, a lookup table otherwise. Both give the same value.
+inline uint32_t crc32c(const uint8_t *p, size_t n)
+{
+	uint32_t c = ~0u;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+	uint64_t c64 = c;
+	for (; n >= 8; p += 8, n -= 8)
+	{
+		uint64_t v;
+		std::memcpy(&v, p, 8);
+		c64 = _mm_crc32_u64(c64, v);
+	}
+	c = static_cast<uint32_t>(c64);
+	for (; n > 0; ++p, --n)
+		c = _mm_crc32_u8(c, *p);
+#else
+	static const auto table = []
+	{
+		std::array<uint32_t, 256> t{};
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t v = i;
+			for (int k = 0; k < 8; ++k)
+				v = (v >> 1) ^ (0x82f63b78u & (0u - (v & 1)));
+			t[i] = v;
+		}
+		return t;
+	}();
+	for (; n > 0; ++p, --n)
+		c = table[(c ^ *p) & 0xff] ^ (c >> 8);
+#endif
+	return ~c;
+}
+
+// LEB128 varints; signed deltas are zigzagged first so small moves either
+// way stay one byte
+inline uint8_t *putVarint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80)
+	{
+		*p++ = static_cast<uint8_t>(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = static_cast<uint8_t>(v);
+	return p;
+}
+
+inline uint8_t *putSigned(uint8_t *p, int64_t v)
+{
+	return putVarint(p, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+}
+
+// nullptr when the varint runs past end
+inline const uint8_t *getVarint(const uint8_t *p, const uint8_t *end, uint64_t &v)
+{
+	v = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7)
+	{
+		uint8_t b = *p++;
+		v |= static_cast<uint64_t>(b & 0x7f) << shift;
+		if (b < 0x80)
+			return p;
+	}
+	return nullptr;
+}
+
+inline const uint8_t *getSigned(const uint8_t *p, const uint8_t *end, int64_t &v)
+{
+	uint64_t u;
+	p = getVarint(p, end, u);
+	v = static_cast<int64_t>(u >> 1) ^ -static_cast<int64_t>(u & 1);
+	return p;
+}
+
+// Deltas wrap modulo 2^64, so every pair of values round-trips
+inline int64_t delta(uint64_t to, uint64_t from) { return static_cast<int64_t>(to - from); }
+inline uint64_t undelta(uint64_t from, int64_t d) { return from + static_cast<uint64_t>(d); }
+
+// Trades: ids, price and timestamp as deltas from the previous trade, so a
+// sweep through one level costs a few bytes per fill. Keyed by timestamp.
+struct TradeCodec
+{
+	using Record = TradeReport;
+	static constexpr uint32_t KIND = 1;
+	static constexpr size_t MAX_BYTES = 5 * 10;
+
+	TradeReport prev{};
+
+	void reset() { prev = {}; }
+	static uint64_t key(const TradeReport &t) { return t.timestamp; }
+
+	uint8_t *encode(uint8_t *p, const TradeReport &t)
+	{
+		p = putSigned(p, delta(t.takerId, prev.takerId));
+		p = putSigned(p, delta(t.makerId, prev.makerId));
+		p = putVarint(p, t.qty);
+		p = putSigned(p, delta(t.price, prev.price));
+		p = putSigned(p, delta(t.timestamp, prev.timestamp));
+		prev = t;
+		return p;
+	}
+
+	const uint8_t *decode(const uint8_t *p, const uint8_t *end, TradeReport &t)
+	{
+		int64_t taker, maker, price, ts;
+		uint64_t qty;
+		if (!(p = getSigned(p, end, taker)) || !(p = getSigned(p, end, maker)) || !(p = getVarint(p, end, qty)) ||
+			!(p = getSigned(p, end, price)) || !(p = getSigned(p, end, ts)))
+			return nullptr;
+		t = {undelta(prev.takerId, taker), undelta(prev.makerId, maker), static_cast<uint32_t>(qty),
+			 static_cast<int64_t>(undelta(prev.price, price)), undelta(prev.timestamp, ts)};
+		prev = t;
+		return p;
+	}
+};
+
+// Journal records: a two-byte head packs the command's enums and a presence
+// bit for each field that is usually zero, so absent fields cost nothing.
+// The command type takes the head's low three bits plus its top bit, so
+// types 0-7 encode with the top bit clear and 8 and up set it.
+// Ids and prices are deltas from the previous command. Keyed by sequence.
+struct CommandCodec
+{
+	using Record = JournalRecord;
+	static constexpr uint32_t KIND = 2;
+	static constexpr size_t MAX_BYTES = 2 + 11 * 10;
+
+	enum : uint16_t
+	{
+		HAS_MIN_QTY = 1 << 10,
+		HAS_ACCOUNT = 1 << 11,
+		HAS_ASK = 1 << 12, // askQty and askPrice
+		HAS_NEW_ID = 1 << 13,
+		HAS_STOP = 1 << 14,
+		TYPE_HIGH = 1 << 15
+	};
+
+	uint64_t prevSeq = 0, prevId = 0;
+	int64_t prevPrice = 0;
+
+	void reset()
+	{
+		prevSeq = prevId = 0;
+		prevPrice = 0;
+	}
+	static uint64_t key(const JournalRecord &r) { return r.seq; }
+
+	uint8_t *encode(uint8_t *p, const JournalRecord &r)
+	{
+		const Command &c = r.cmd;
+		uint16_t type = static_cast<uint16_t>(c.type);
+		uint16_t head = static_cast<uint16_t>((type & 7) | (type >> 3) << 15 | static_cast<uint16_t>(c.side) << 3 |
+											  static_cast<uint16_t>(c.orderType) << 4 | static_cast<uint16_t>(c.pegType) << 7 |
+											  static_cast<uint16_t>(c.hidden) << 9);
+		head |= (c.minQty ? HAS_MIN_QTY : 0) | (c.account ? HAS_ACCOUNT : 0) | (c.askQty || c.askPrice ? HAS_ASK : 0) |
+				(c.newId ? HAS_NEW_ID : 0) | (c.stopPrice ? HAS_STOP : 0);
+		*p++ = static_cast<uint8_t>(head);
+		*p++ = static_cast<uint8_t>(head >> 8);
+		p = putVarint(p, r.seq - prevSeq);
+		p = putSigned(p, delta(c.id, prevId));
+		p = putVarint(p, c.qty);
+		p = putSigned(p, delta(c.price, prevPrice));
+		if (head & HAS_MIN_QTY)
+			p = putVarint(p, c.minQty);
+		if (head & HAS_ACCOUNT)
+			p = putVarint(p, c.account);
+		if (head & HAS_ASK)
+		{
+			p = putVarint(p, c.askQty);
+			p = putSigned(p, delta(c.askPrice, c.price));
+		}
+		if (head & HAS_NEW_ID)
+			p = putSigned(p, delta(c.newId, c.id));
+		if (head & HAS_STOP)
+			p = putSigned(p, delta(c.stopPrice, c.price));
+		prevSeq = r.seq;
+		prevId = c.id;
+		prevPrice = c.price;
+		return p;
+	}
+
+	const uint8_t *decode(const uint8_t *p, const uint8_t *end, JournalRecord &r)
+	{
+		if (end - p < 2)
+			return nullptr;
+		uint16_t head = static_cast<uint16_t>(p[0] | p[1] << 8);
+		p += 2;
+		Command c{};
+		c.type = static_cast<CommandType>((head & 7) | (head & TYPE_HIGH) >> 12);
+		c.side = static_cast<Side>((head >> 3) & 1);
+		c.orderType = static_cast<OrderType>((head >> 4) & 7);
+		c.pegType = static_cast<PegType>((head >> 7) & 3);
+		c.hidden = (head >> 9) & 1;
+		uint64_t seq, u;
+		int64_t s;
+		if (!(p = getVarint(p, end, seq)) || !(p = getSigned(p, end, s)))
+			return nullptr;
+		c.id = undelta(prevId, s);
+		if (!(p = getVarint(p, end, u)) || !(p = getSigned(p, end, s)))
+			return nullptr;
+		c.qty = static_cast<uint32_t>(u);
+		c.price = static_cast<int64_t>(undelta(prevPrice, s));
+		if ((head & HAS_MIN_QTY) && !(p = getVarint(p, end, u)))
+			return nullptr;
+		c.minQty = (head & HAS_MIN_QTY) ? static_cast<uint32_t>(u) : 0;
+		if ((head & HAS_ACCOUNT) && !(p = getVarint(p, end, u)))
+			return nullptr;
+		c.account = (head & HAS_ACCOUNT) ? static_cast<uint32_t>(u) : 0;
+		if (head & HAS_ASK)
+		{
+			if (!(p = getVarint(p, end, u)) || !(p = getSigned(p, end, s)))
+				return nullptr;
+			c.askQty = static_cast<uint32_t>(u);
+			c.askPrice = static_cast<int64_t>(undelta(c.price, s));
+		}
+		if (head & HAS_NEW_ID)
+		{
+			if (!(p = getSigned(p, end, s)))
+				return nullptr;
+			c.newId = undelta(c.id, s);
+		}
+		if (head & HAS_STOP)
+		{
+			if (!(p = getSigned(p, end, s)))
+				return nullptr;
+			c.stopPrice = static_cast<int64_t>(undelta(c.price, s));
+		}
+		r = {prevSeq + seq, c};
+		prevSeq = r.seq;
+		prevId = c.id;
+		prevPrice = c.price;
+		return p;
+	}
+};
+
+// Single-threaded: meant to run on the thread that consumes the records,
+// such as the trade consumer. append() encodes straight into the current
+// block; the only syscall is one write() per sealed block.
+template <typename Codec>
+class CompactLogWriter
+{
+	using Record = typename Codec::Record;
+
+	int fd = -1;
+	Codec codec;
+	std::unique_ptr<uint8_t[]> block; // block header, then payload
+	size_t blockBytes = 0, used = 0;
+	CompactBlockHeader current{};
+	std::vector<CompactIndexEntry> index;
+	uint64_t offset = 0, records = 0;
+	bool ok = true;
+
+	bool writeAll(const void *data, size_t len)
+	{
+		const char *p = static_cast<const char *>(data);
+		while (ok && len > 0)
+		{
+			ssize_t n = ::write(fd, p, len);
+			if (n < 0 && errno != EINTR)
+				ok = false;
+			else if (n > 0)
+			{
+				p += n;
+				len -= static_cast<size_t>(n);
+				offset += static_cast<uint64_t>(n);
+			}
+		}
+		return ok;
+	}
+
+	void seal()
+	{
+		if (current.records == 0)
+			return;
+		current.payloadBytes = static_cast<uint32_t>(used);
+		current.crc = crc32c(block.get() + sizeof(CompactBlockHeader), used);
+		std::memcpy(block.get(), &current, sizeof(current));
+		index.push_back({offset, current.firstKey, records - current.records});
+		writeAll(block.get(), sizeof(current) + used);
+		current = {};
+		used = 0;
+	}
+
+public:
+	~CompactLogWriter() { close(); }
+
+	bool open(const char *path, size_t targetBlockBytes = 64 << 10)
+	{
+		close();
+		fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			return false;
+		blockBytes = std::max(targetBlockBytes, 2 * Codec::MAX_BYTES);
+		block.reset(new uint8_t[sizeof(CompactBlockHeader) + blockBytes]);
+		index.clear();
+		offset = records = used = 0;
+		current = {};
+		ok = true;
+		CompactLogHeader h{{'M', 'E', 'C', 'L', 'O', 'G', '0', '1'}, 1, Codec::KIND, static_cast<uint32_t>(blockBytes), 0};
+		return writeAll(&h, sizeof(h));
+	}
+
+	void append(const Record &r)
+	{
+		if (used + Codec::MAX_BYTES > blockBytes)
+			seal();
+		if (current.records++ == 0)
+		{
+			codec.reset();
+			current.firstKey = Codec::key(r);
+		}
+		uint8_t *payload = block.get() + sizeof(CompactBlockHeader);
+		used = static_cast<size_t>(codec.encode(payload + used, r) - payload);
+		++records;
+	}
+
+	// Seals the open block and writes the index and trailer
+	bool close()
+	{
+		if (fd < 0)
+			return ok;
+		seal();
+		CompactLogTrailer t{offset, index.size(), records, {'M', 'E', 'C', 'L', 'I', 'D', 'X', '1'}};
+		writeAll(index.data(), index.size() * sizeof(CompactIndexEntry));
+		writeAll(&t, sizeof(t));
+		::close(fd);
+		fd = -1;
+		return ok;
+	}
+
+	bool good() const { return ok; }
+	uint64_t recordCount() const { return records; }
+	uint64_t bytesWritten() const { return offset + (used ? sizeof(CompactBlockHeader) + used : 0); }
+};
+
+// Reads a compact log sequentially or from any key. A block is verified
+// against its CRC and decoded whole before its records are handed out.
+template <typename Codec>
+class CompactLogReader
+{
+	using Record = typename Codec::Record;
+
+	int fd = -1;
+	std::vector<CompactIndexEntry> index;
+	std::vector<uint8_t> payload;
+	std::vector<Record> decoded;
+	size_t nextBlock = 0, pos = 0;
+	uint64_t records = 0;
+	uint32_t blockBytes = 0;
+	bool corrupt = false;
+
+	bool fail()
+	{
+		corrupt = true;
+		decoded.clear();
+		pos = 0;
+		return false;
+	}
+
+	bool readAt(void *data, size_t len, uint64_t at)
+	{
+		char *p = static_cast<char *>(data);
+		while (len > 0)
+		{
+			ssize_t n = ::pread(fd, p, len, static_cast<off_t>(at));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			p += n;
+			len -= static_cast<size_t>(n);
+			at += static_cast<uint64_t>(n);
+		}
+		return true;
+	}
+
+	// No trailer: walk the block headers and keep every complete block
+	void rebuildIndex(uint64_t fileSize)
+	{
+		uint64_t at = sizeof(CompactLogHeader);
+		CompactBlockHeader b;
+		while (at + sizeof(b) <= fileSize && readAt(&b, sizeof(b), at) && b.records > 0 &&
+			   b.payloadBytes <= blockBytes && at + sizeof(b) + b.payloadBytes <= fileSize)
+		{
+			index.push_back({at, b.firstKey, records});
+			records += b.records;
+			at += sizeof(b) + b.payloadBytes;
+		}
+	}
+
+	bool loadBlock(size_t i)
+	{
+		// The header is not covered by the CRC, so bound it before trusting it
+		CompactBlockHeader b;
+		if (!readAt(&b, sizeof(b), index[i].offset) || b.payloadBytes > blockBytes || b.records > b.payloadBytes)
+			return fail();
+		payload.resize(b.payloadBytes);
+		if (!readAt(payload.data(), b.payloadBytes, index[i].offset + sizeof(b)) ||
+			crc32c(payload.data(), b.payloadBytes) != b.crc)
+			return fail();
+		Codec codec;
+		decoded.resize(b.records);
+		const uint8_t *p = payload.data(), *end = p + b.payloadBytes;
+		for (uint32_t k = 0; k < b.records; ++k)
+			if (!(p = codec.decode(p, end, decoded[k])))
+				return fail();
+		nextBlock = i + 1;
+		pos = 0;
+		return true;
+	}
+
+public:
+	~CompactLogReader() { close(); }
+
+	bool open(const char *path)
+	{
+		close();
+		fd = ::open(path, O_RDONLY);
+		struct stat st;
+		CompactLogHeader h;
+		if (fd < 0 || fstat(fd, &st) != 0 || !readAt(&h, sizeof(h), 0) || std::memcmp(h.magic, "MECLOG01", 8) != 0 ||
+			h.version != 1 || h.kind != Codec::KIND)
+		{
+			close();
+			return false;
+		}
+		blockBytes = h.blockBytes;
+		uint64_t size = static_cast<uint64_t>(st.st_size);
+		CompactLogTrailer t;
+		if (size >= sizeof(h) + sizeof(t) && readAt(&t, sizeof(t), size - sizeof(t)) &&
+			std::memcmp(t.magic, "MECLIDX1", 8) == 0 && t.indexOffset + t.blocks * sizeof(CompactIndexEntry) + sizeof(t) == size)
+		{
+			index.resize(t.blocks);
+			records = t.records;
+			if (!readAt(index.data(), index.size() * sizeof(CompactIndexEntry), t.indexOffset))
+			{
+				close();
+				return false;
+			}
+		}
+		else
+			rebuildIndex(size);
+		return true;
+	}
+
+	// False at the end of the log or at a block that fails its CRC
+	bool next(Record &r)
+	{
+		while (pos == decoded.size())
+			if (nextBlock == index.size() || !loadBlock(nextBlock))
+				return false;
+		r = decoded[pos++];
+		return true;
+	}
+
+	// Positions next() at the first record whose key is >= key. Binary search
+	// over the index picks the block; keys repeat (trades of one command share
+	// a timestamp), so it starts one block before the first that opens at key.
+	bool seek(uint64_t key)
+	{
+		auto it = std::lower_bound(index.begin(), index.end(), key,
+								   [](const CompactIndexEntry &e, uint64_t k)
+								   { return e.firstKey < k; });
+		size_t i = it == index.begin() ? 0 : static_cast<size_t>(it - index.begin()) - 1;
+		decoded.clear();
+		pos = 0;
+		nextBlock = i;
+		if (index.empty() || !loadBlock(i))
+			return false;
+		while (pos < decoded.size() && Codec::key(decoded[pos]) < key)
+			++pos;
+		return true;
+	}
+
+	void close()
+	{
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+		index.clear();
+		decoded.clear();
+		nextBlock = pos = 0;
+		records = 0;
+		corrupt = false;
+	}
+
+	uint64_t recordCount() const { return records; }
+	size_t blockCount() const { return index.size(); }
+	bool failed() const { return corrupt; }
+};
+
+using TradeLogWriter = CompactLogWriter<TradeCodec>;
+using TradeLogReader = CompactLogReader<TradeCodec>;
+
+// Re-encodes a write-ahead journal as a compact command log for archiving.
+// Returns the number of records copied, or -1 if either file fails.
+int64_t compactJournal(const char *journalPath, const char *outPath)
+{
+	JournalReader reader;
+	CompactLogWriter<CommandCodec> writer;
+	if (!reader.open(journalPath) || !writer.open(outPath))
+		return -1;
+	JournalRecord r;
+	while (reader.next(r))
+		writer.append(r);
+	return writer.close() ? static_cast<int64_t>(writer.recordCount()) : -1;
+}
+
+// --- 11. HOT STANDBY ---
+// Cycle counter read without a syscall: TSC on x86, the virtual counter on
+// ARM64, steady_clock elsewhere.
+inline uint64_t readTsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t v;
+	asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+	return v;
+#else
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Counter ticks per second, measured once against steady_clock (read from
+// cntfrq_el0 on ARM64).
+inline uint64_t tscFrequency()
+{
+	static const uint64_t hz = []
+	{
+#if defined(__aarch64__)
+		uint64_t f;
+		asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+		return f;
+#elif defined(__x86_64__) || defined(__i386__)
+		auto t0 = std::chrono::steady_clock::now();
+		uint64_t c0 = readTsc();
+		while (std::chrono::steady_clock::now() - t0 < std::chrono::milliseconds(20))
+			;
+		uint64_t c1 = readTsc();
+		std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+		return static_cast<uint64_t>((c1 - c0) / dt.count());
+#else
+		return static_cast<uint64_t>(std::chrono::steady_clock::period::den / std::chrono::steady_clock::period::num);
+#endif
+	}();
+	return hz;
+}
+
+// Unix-domain stream sockets for shipping the command stream to a standby
+// on the same host. Sends use MSG_NOSIGNAL (SO_NOSIGPIPE on macOS), so a
+// dead peer shows up as an error rather than SIGPIPE.
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+inline bool unixAddress(const char *path, sockaddr_un &addr)
+{
+	addr = {};
+	addr.sun_family = AF_UNIX;
+	if (std::strlen(path) >= sizeof(addr.sun_path))
+		return false;
+	std::strcpy(addr.sun_path, path);
+	return true;
+}
+
+inline void noSigPipe([[maybe_unused]] int fd)
+{
+#if defined(SO_NOSIGPIPE)
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+int listenUnix(const char *path)
+{
+	sockaddr_un addr;
+	if (!unixAddress(path, addr))
+		return -1;
+	::unlink(path);
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(fd, 1) != 0)
+	{
+		::close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// -1 if nobody connects within timeoutMs
+int acceptUnix(int listenFd, int timeoutMs)
+{
+	pollfd p{listenFd, POLLIN, 0};
+	if (::poll(&p, 1, timeoutMs) != 1)
+		return -1;
+	int fd = ::accept(listenFd, nullptr, nullptr);
+	if (fd >= 0)
+		noSigPipe(fd);
+	return fd;
+}
+
+// Retries until the listener is up or timeoutMs has passed
+int connectUnix(const char *path, int timeoutMs)
+{
+	sockaddr_un addr;
+	if (!unixAddress(path, addr))
+		return -1;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+	do
+	{
+		int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0)
+		{
+			noSigPipe(fd);
+			return fd;
+		}
+		::close(fd);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	} while (std::chrono::steady_clock::now() < deadline);
+	return -1;
+}
+
+// Primary side. Ships every sequenced command to a hot standby over a
+// connected stream socket. As with the journal, the engine thread only
+// pushes the record into an SPSC ring; a sender thread writes the ring out
+// in batches and reads back the standby's acknowledgments, each the last
+// sequence the standby has applied. Every 64th record is timestamped on the
+// way in, so acknowledgments also yield the replication lag: the time from
+// sequencing on the primary until the standby has applied the command and
+// said so. A standby that goes away fails the publisher; the engine then
+// carries on without it.
+class ReplicationPublisher
+{
+	struct Sample
+	{
+		uint64_t seq;
+		uint64_t tsc;
+	};
+
+	std::unique_ptr<RingBuffer<65536, JournalRecord>> ring;
+	std::unique_ptr<RingBuffer<4096, Sample>> samples;
+	int fd = -1;
+	std::thread sender;
+	std::atomic<bool> running{false};
+	std::atomic<bool> failed{false};
+	alignas(64) std::atomic<uint64_t> acked{0};
+	std::atomic<uint64_t> bytes{0};
+	std::vector<uint64_t> lagTicks; // sender thread until close()
+	char ackBuf[512];
+	size_t ackHave = 0; // bytes of a split acknowledgment
+
+	bool sendAll(const void *data, size_t len)
+	{
+		const char *p = static_cast<const char *>(data);
+		while (len > 0)
+		{
+			ssize_t n = ::send(fd, p, len, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			p += n;
+			len -= static_cast<size_t>(n);
+		}
+		bytes.fetch_add(p - static_cast<const char *>(data), std::memory_order_relaxed);
+		return true;
+	}
+
+	// Reads whatever acknowledgments have arrived; false once the standby
+	// has closed its end
+	bool readAcks(bool block, Sample &pending, bool &hasPending)
+	{
+		ssize_t n = ::recv(fd, ackBuf + ackHave, sizeof(ackBuf) - ackHave, block ? 0 : MSG_DONTWAIT);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+			return false;
+		if (n < 0)
+			return true;
+		ackHave += static_cast<size_t>(n);
+		size_t whole = ackHave / sizeof(uint64_t);
+		if (whole == 0)
+			return true;
+		// Acks only grow, so the newest whole one is all that matters
+		uint64_t seq;
+		std::memcpy(&seq, ackBuf + (whole - 1) * sizeof(uint64_t), sizeof(seq));
+		ackHave -= whole * sizeof(uint64_t);
+		std::memmove(ackBuf, ackBuf + whole * sizeof(uint64_t), ackHave);
+		uint64_t now = readTsc();
+		acked.store(seq, std::memory_order_release);
+		while (hasPending || samples->pop(pending))
+		{
+			if (pending.seq > seq)
+			{
+				hasPending = true;
+				break;
+			}
+			lagTicks.push_back(now - pending.tsc);
+			hasPending = false;
+		}
+		return true;
+	}
+
+	void run()
+	{
+		std::vector<JournalRecord> batch(4096);
+		Sample pending{};
+		bool hasPending = false;
+		while (true)
+		{
+			bool stopping = !running.load(std::memory_order_acquire);
+			size_t n = 0;
+			while (n < batch.size() && ring->pop(batch[n]))
+				++n;
+			if (n > 0 && !sendAll(batch.data(), n * sizeof(JournalRecord)))
+				break;
+			if (!readAcks(false, pending, hasPending))
+				break;
+			if (stopping && n == 0 && ring->size() == 0)
+			{
+				// End of stream: the standby applies the rest, acks and closes
+				::shutdown(fd, SHUT_WR);
+				while (readAcks(true, pending, hasPending))
+					;
+				return;
+			}
+			if (n == 0)
+				std::this_thread::yield();
+		}
+		failed.store(true, std::memory_order_release);
+	}
+
+public:
+	ReplicationPublisher()
+		: ring(std::make_unique<RingBuffer<65536, JournalRecord>>()), samples(std::make_unique<RingBuffer<4096, Sample>>()) {}
+	~ReplicationPublisher() { close(); }
+
+	// Takes ownership of a connected socket
+	bool start(int connectedFd)
+	{
+		if (connectedFd < 0 || fd >= 0)
+			return false;
+		fd = connectedFd;
+		running.store(true, std::memory_order_release);
+		sender = std::thread([this]
+							 { run(); });
+		return true;
+	}
+
+	// Engine thread. Waits only while the ring is full; a failed standby is
+	// skipped rather than allowed to stall matching.
+	void append(uint64_t seq, const Command &cmd)
+	{
+		if ((seq & 63) == 0)
+			samples->push({seq, readTsc()});
+		JournalRecord r{seq, cmd};
+		while (!ring->push(r))
+		{
+			if (failed.load(std::memory_order_relaxed))
+				return;
+			std::this_thread::yield();
+		}
+	}
+
+	// Sends what is queued, ends the stream and waits for the standby's
+	// final acknowledgment
+	void close()
+	{
+		if (fd < 0)
+			return;
+		running.store(false, std::memory_order_release);
+		if (sender.joinable())
+			sender.join();
+		::close(fd);
+		fd = -1;
+	}
+
+	uint64_t ackedSeq() const { return acked.load(std::memory_order_acquire); }
+	uint64_t bytesSent() const { return bytes.load(std::memory_order_relaxed); }
+	bool hasFailed() const { return failed.load(std::memory_order_acquire); }
+	// Valid after close()
+	std::vector<uint64_t> &lagSamples() { return lagTicks; }
+};
+
+// Standby side. Applies the primary's command stream to its own book and
+// acknowledges each batch read with the last sequence applied. OrderBook is
+// deterministic (see the note on the class), so as of that sequence the
+// standby's book is the primary's book, and it takes over by resuming a
+// Gateway after lastApplied(). A standby publishes nothing: its trade and
+// event rings may fill and drop, which never affects book state.
+class Replica
+{
+	OrderBook &book;
+	uint64_t applied;
+	bool gap = false;
+
+public:
+	// afterSeq: the sequence the book already reflects, e.g. from a snapshot
+	explicit Replica(OrderBook &b, uint64_t afterSeq = 0) : book(b), applied(afterSeq) {}
+
+	// Returns when the primary ends the stream or goes away. False on a read
+	// error or a gap in the sequence, after which the book must be rebuilt.
+	bool run(int fd)
+	{
+		constexpr size_t BATCH = 1024;
+		std::vector<JournalRecord> buf(BATCH);
+		char *base = reinterpret_cast<char *>(buf.data());
+		size_t have = 0;
+		while (true)
+		{
+			ssize_t n = ::read(fd, base + have, BATCH * sizeof(JournalRecord) - have);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return n == 0 && have == 0;
+			have += static_cast<size_t>(n);
+			size_t whole = have / sizeof(JournalRecord);
+			for (size_t i = 0; i < whole; ++i)
+			{
+				uint64_t seq = buf[i].seq;
+				if (seq <= applied)
+					continue;
+				if (seq != applied + 1)
+				{
+					gap = true;
+					return false;
+				}
+				book.apply(buf[i].cmd);
+				applied = seq;
+			}
+			have -= whole * sizeof(JournalRecord);
+			std::memmove(base, base + whole * sizeof(JournalRecord), have);
+			if (whole > 0)
+				::send(fd, &applied, sizeof(applied), MSG_NOSIGNAL);
+		}
+	}
+
+	uint64_t lastApplied() const { return applied; }
+	bool sawGap() const { return gap; }
+};
+
+// --- 12. MARKET DATA ---
+// Market-by-order feed encoded in the style of NASDAQ ITCH: fixed-layout,
+// big-endian messages, each preceded by its two-byte length as in an ITCH
+// file. Every message starts with type(1) locate(2) tracking(2)
+// timestamp(6); locate identifies the book, tracking is always zero and the
+// timestamp is the engine clock. Prices are full signed 64-bit engine
+// prices rather than ITCH's 32-bit fixed point. After the header:
+//   'A' add          ref(8) side(1 'B'/'S') shares(4) price(8)
+//   'E' executed     ref(8) shares(4) match(8)
+//   'X' cancel       ref(8) shares(4)             shares removed, priority kept
+//   'D' delete       ref(8)
+//   'U' replace      ref(8) newRef(8) shares(4) price(8)   back of the queue
+//   'N' renumber     ref(8) newRef(8)             priority kept (not in ITCH)
+//   'P' hidden trade ref(8)=0 side(1) shares(4) price(8) match(8)
+// Applied in order from an empty book, these rebuild the displayed book
+// order by order with its queue priority. Messages are numbered from 1 and
+// travel in packets, as in MoldUDP64 without the session field:
+//   sequence(8) count(2)   then count length-prefixed messages
+// where sequence is that of the packet's first message. A receiver that
+// loses a packet sees the gap in the next one.
+class ItchEncoder
+{
+	uint16_t locate;
+	OrderFeedEvent held{}; // a moving Delete, waiting to become a Replace
+	bool holding = false;
+	uint64_t sequence = 0; // last message written
+	uint8_t *packet = nullptr;
+	uint64_t packetFirst = 1;
+
+	static uint8_t *put8(uint8_t *p, uint8_t v)
+	{
+		*p = v;
+		return p + 1;
+	}
+	static uint8_t *put16(uint8_t *p, uint16_t v)
+	{
+		v = std::byteswap(v);
+		std::memcpy(p, &v, 2);
+		return p + 2;
+	}
+	static uint8_t *put32(uint8_t *p, uint32_t v)
+	{
+		v = std::byteswap(v);
+		std::memcpy(p, &v, 4);
+		return p + 4;
+	}
+	static uint8_t *put48(uint8_t *p, uint64_t v)
+	{
+		v = std::byteswap(v << 16);
+		std::memcpy(p, &v, 6);
+		return p + 6;
+	}
+	static uint8_t *put64(uint8_t *p, uint64_t v)
+	{
+		v = std::byteswap(v);
+		std::memcpy(p, &v, 8);
+		return p + 8;
+	}
+
+	uint8_t *header(uint8_t *p, char type, uint16_t bodyBytes, uint64_t timestamp)
+	{
+		++sequence;
+		p = put16(p, static_cast<uint16_t>(11 + bodyBytes));
+		p = put8(p, static_cast<uint8_t>(type));
+		p = put16(p, locate);
+		p = put16(p, 0);
+		return put48(p, timestamp);
+	}
+
+	static uint8_t sideCode(Side s) { return s == Side::Buy ? 'B' : 'S'; }
+
+	uint8_t *writeDelete(uint8_t *p, const OrderFeedEvent &e)
+	{
+		p = header(p, 'D', 8, e.timestamp);
+		return put64(p, e.ref);
+	}
+
+	uint8_t *writeReplace(uint8_t *p, uint64_t ref, const OrderFeedEvent &e)
+	{
+		p = header(p, 'U', 28, e.timestamp);
+		p = put64(p, ref);
+		p = put64(p, e.ref);
+		p = put32(p, e.shares);
+		return put64(p, static_cast<uint64_t>(e.price));
+	}
+
+public:
+	static constexpr size_t MAX_MESSAGE = 2 + 11 + 29;
+	static constexpr size_t PACKET_HEADER = 10;
+	static constexpr uint64_t MAX_PACKET_MESSAGES = 65535;
+
+	explicit ItchEncoder(uint16_t stockLocate = 0) : locate(stockLocate) {}
+
+	// Opens a packet at p and returns where its first message goes
+	uint8_t *beginPacket(uint8_t *p)
+	{
+		packet = p;
+		packetFirst = sequence + 1;
+		return p + PACKET_HEADER;
+	}
+
+	// Writes the open packet's header; the packet ends where the last
+	// encode() left off
+	void endPacket() { put16(put64(packet, packetFirst), static_cast<uint16_t>(packetMessages())); }
+
+	uint64_t packetMessages() const { return sequence + 1 - packetFirst; }
+	// Whether the open packet can take another encode() (up to two messages)
+	bool packetHasRoom() const { return packetMessages() + 2 <= MAX_PACKET_MESSAGES; }
+	uint64_t lastSequence() const { return sequence; }
+
+	// Encodes e in place at p and returns the new end; p needs room for
+	// 2 * MAX_MESSAGE. A Delete that moves the order (the engine names the
+	// id it continues as) is held back: if the order's Add comes next it
+	// becomes one 'U', otherwise the 'D' goes out ahead of whatever follows.
+	uint8_t *encode(uint8_t *p, const OrderFeedEvent &e)
+	{
+		if (holding)
+		{
+			holding = false;
+			if (e.type == OrderFeedType::Add && e.ref == held.other)
+				return writeReplace(p, held.ref, e);
+			p = writeDelete(p, held);
+		}
+
+		switch (e.type)
+		{
+		case OrderFeedType::Add:
+			p = header(p, 'A', 21, e.timestamp);
+			p = put64(p, e.ref);
+			p = put8(p, sideCode(e.side));
+			p = put32(p, e.shares);
+			return put64(p, static_cast<uint64_t>(e.price));
+		case OrderFeedType::Execute:
+			p = header(p, 'E', 20, e.timestamp);
+			p = put64(p, e.ref);
+			p = put32(p, e.shares);
+			return put64(p, e.other);
+		case OrderFeedType::Cancel:
+			p = header(p, 'X', 12, e.timestamp);
+			p = put64(p, e.ref);
+			return put32(p, e.shares);
+		case OrderFeedType::Delete:
+			if (e.other == 0)
+				return writeDelete(p, e);
+			held = e;
+			holding = true;
+			return p;
+		case OrderFeedType::Replace:
+			return writeReplace(p, e.ref, {e.type, e.side, e.shares, e.other, 0, e.price, e.timestamp});
+		case OrderFeedType::Renumber:
+			p = header(p, 'N', 16, e.timestamp);
+			p = put64(p, e.ref);
+			return put64(p, e.other);
+		case OrderFeedType::HiddenTrade:
+			p = header(p, 'P', 29, e.timestamp);
+			p = put64(p, 0);
+			p = put8(p, sideCode(e.side));
+			p = put32(p, e.shares);
+			p = put64(p, static_cast<uint64_t>(e.price));
+			return put64(p, e.other);
+		}
+		return p;
+	}
+
+	// Releases a held Delete at the end of the stream
+	uint8_t *finish(uint8_t *p)
+	{
+		if (holding)
+			p = writeDelete(p, held);
+		holding = false;
+		return p;
+	}
+};
+
+// Turns ItchEncoder packets back into OrderFeedEvents for a BookBuilder.
+// A 'U' comes back as a Replace, so a fused delete and re-add arrives as
+// the one event that has the same effect on the book. Messages that carry
+// no side decode as Buy; applyFeedEvent takes the side from the order.
+class ItchDecoder
+{
+	static uint16_t get16(const uint8_t *p)
+	{
+		uint16_t v;
+		std::memcpy(&v, p, 2);
+		return std::byteswap(v);
+	}
+	static uint32_t get32(const uint8_t *p)
+	{
+		uint32_t v;
+		std::memcpy(&v, p, 4);
+		return std::byteswap(v);
+	}
+	static uint64_t get48(const uint8_t *p)
+	{
+		uint64_t v = 0;
+		std::memcpy(&v, p, 6);
+		return std::byteswap(v) >> 16;
+	}
+	static uint64_t get64(const uint8_t *p)
+	{
+		uint64_t v;
+		std::memcpy(&v, p, 8);
+		return std::byteswap(v);
+	}
+
+	static Side side(uint8_t code) { return code == 'S' ? Side::Sell : Side::Buy; }
+
+	// Body length of a message type after the 11-byte header; 0 if unknown
+	static size_t bodyBytes(uint8_t type)
+	{
+		switch (type)
+		{
+		case 'A':
+			return 21;
+		case 'E':
+			return 20;
+		case 'X':
+			return 12;
+		case 'D':
+			return 8;
+		case 'U':
+			return 28;
+		case 'N':
+			return 16;
+		case 'P':
+			return 29;
+		}
+		return 0;
+	}
+
+public:
+	// Decodes one message without its length prefix. Returns false for an
+	// unknown type or a length that does not match it.
+	static bool decode(const uint8_t *m, size_t len, OrderFeedEvent &e)
+	{
+		// The length must match the type before any body field is read
+		if (len < 11 || bodyBytes(m[0]) == 0 || len != 11 + bodyBytes(m[0]))
+			return false;
+		const uint8_t *b = m + 11;
+		e = {};
+		e.timestamp = get48(m + 5);
+		switch (m[0])
+		{
+		case 'A':
+			e = {OrderFeedType::Add, side(b[8]), get32(b + 9), get64(b), 0, static_cast<int64_t>(get64(b + 13)), e.timestamp};
+			return true;
+		case 'E':
+			e = {OrderFeedType::Execute, Side::Buy, get32(b + 8), get64(b), get64(b + 12), 0, e.timestamp};
+			return true;
+		case 'X':
+			e = {OrderFeedType::Cancel, Side::Buy, get32(b + 8), get64(b), 0, 0, e.timestamp};
+			return true;
+		case 'D':
+			e = {OrderFeedType::Delete, Side::Buy, 0, get64(b), 0, 0, e.timestamp};
+			return true;
+		case 'U':
+			e = {OrderFeedType::Replace, Side::Buy, get32(b + 16), get64(b), get64(b + 8), static_cast<int64_t>(get64(b + 20)),
+				 e.timestamp};
+			return true;
+		case 'N':
+			e = {OrderFeedType::Renumber, Side::Buy, 0, get64(b), get64(b + 8), 0, e.timestamp};
+			return true;
+		case 'P':
+			e = {OrderFeedType::HiddenTrade, side(b[8]), get32(b + 9), 0, get64(b + 21), static_cast<int64_t>(get64(b + 13)),
+				 e.timestamp};
+			return true;
+		}
+		return false;
+	}
+
+	// Hands each message of the packet at p to sink(seq, event) in order
+	// and returns the end of the packet, or nullptr if it is truncated or
+	// malformed (messages before the fault have been handed over)
+	template <typename Sink>
+	static const uint8_t *decodePacket(const uint8_t *p, const uint8_t *end, Sink &&sink)
+	{
+		if (end - p < static_cast<ptrdiff_t>(ItchEncoder::PACKET_HEADER))
+			return nullptr;
+		uint64_t seq = get64(p);
+		uint16_t count = get16(p + 8);
+		p += ItchEncoder::PACKET_HEADER;
+		OrderFeedEvent e;
+		for (uint16_t i = 0; i < count; ++i, ++seq)
+		{
+			if (end - p < 2)
+				return nullptr;
+			size_t len = get16(p);
+			if (static_cast<size_t>(end - p - 2) < len || !decode(p + 2, len, e))
+				return nullptr;
+			sink(seq, e);
+			p += 2 + len;
+		}
+		return p;
+	}
+};
+
+// Publisher thread for the market-by-order feed. It drains the book's
+// order feed ring and encodes each event straight into its output buffer,
+// which goes out as one packet with one write() when it fills or when the
+// ring runs dry.
+class OrderFeedPublisher
+{
+	RingBuffer<65536, OrderFeedEvent> &ring;
+	ItchEncoder encoder;
+	int fd = -1;
+	std::unique_ptr<uint8_t[]> buf;
+	size_t cap;
+	std::thread publisher;
+	std::atomic<bool> running{false};
+	std::atomic<bool> failed{false};
+	std::atomic<uint64_t> events{0}, bytes{0}, encodeTicks{0};
+
+	bool flush(size_t used)
+	{
+		for (size_t off = 0; off < used;)
+		{
+			ssize_t n = ::write(fd, buf.get() + off, used - off);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			off += static_cast<size_t>(n);
+		}
+		bytes.fetch_add(used, std::memory_order_relaxed);
+		return true;
+	}
+
+	void run()
+	{
+		uint8_t *start = buf.get(), *p = encoder.beginPacket(start);
+		OrderFeedEvent e;
+		while (true)
+		{
+			bool stopping = !running.load(std::memory_order_acquire);
+			uint64_t n = 0, c0 = readTsc();
+			while (p + 2 * ItchEncoder::MAX_MESSAGE <= start + cap && encoder.packetHasRoom() && ring.pop(e))
+			{
+				p = encoder.encode(p, e);
+				++n;
+			}
+			if (n > 0)
+			{
+				encodeTicks.fetch_add(readTsc() - c0, std::memory_order_relaxed);
+				events.fetch_add(n, std::memory_order_relaxed);
+			}
+			bool drained = ring.size() == 0;
+			if (stopping && drained)
+				p = encoder.finish(p);
+			if (encoder.packetMessages() > 0 &&
+				(drained || n == 0 || p + 2 * ItchEncoder::MAX_MESSAGE > start + cap || !encoder.packetHasRoom()))
+			{
+				encoder.endPacket();
+				if (!flush(static_cast<size_t>(p - start)))
+				{
+					failed.store(true, std::memory_order_release);
+					return;
+				}
+				p = encoder.beginPacket(start);
+			}
+			if (stopping && drained)
+				return;
+			if (n == 0)
+				std::this_thread::yield();
+		}
+	}
+
+public:
+	OrderFeedPublisher(RingBuffer<65536, OrderFeedEvent> &r, uint16_t locate = 0, size_t bufferBytes = 64 << 10)
+		: ring(r), encoder(locate), buf(new uint8_t[std::max(bufferBytes, ItchEncoder::PACKET_HEADER + 4 * ItchEncoder::MAX_MESSAGE)]),
+		  cap(std::max(bufferBytes, ItchEncoder::PACKET_HEADER + 4 * ItchEncoder::MAX_MESSAGE)) {}
+	~OrderFeedPublisher() { stop(); }
+
+	// Publishes to fd (a file, pipe or socket) until stop()
+	bool start(int outFd)
+	{
+		if (outFd < 0 || publisher.joinable())
+			return false;
+		fd = outFd;
+		running.store(true, std::memory_order_release);
+		publisher = std::thread([this]
+								{ run(); });
+		return true;
+	}
+
+	// Encodes what is left in the ring and stops; the fd stays open
+	void stop()
+	{
+		running.store(false, std::memory_order_release);
+		if (publisher.joinable())
+			publisher.join();
+	}
+
+	uint64_t eventCount() const { return events.load(std::memory_order_relaxed); }
+	uint64_t bytesWritten() const { return bytes.load(std::memory_order_relaxed); }
+	double encodeNanos() const { return encodeTicks.load(std::memory_order_relaxed) * 1e9 / tscFrequency(); }
+	bool hasFailed() const { return failed.load(std::memory_order_acquire); }
+};
+
+// Client-side book builder: an OrderBook in passive mode, fed sequenced
+// market-by-order events, normally the messages ItchDecoder takes out of
+// the feed's packets with their message sequence numbers. A gap, or an event that does not fit the book, makes it
+// stale: later events are buffered, not applied, until resync() loads a
+// snapshot taken at some sequence S and replays the buffered events after
+// S. Retransmitted events at or below the applied sequence are ignored.
+class BookBuilder
+{
+	OrderBook &book;
+	uint64_t applied; // last sequence applied to the book
+	bool stale = false;
+	std::vector<std::pair<uint64_t, OrderFeedEvent>> buffered;
+	uint64_t gapCount = 0, errorCount = 0, resyncCount = 0;
+
+	void markStale()
+	{
+		stale = true;
+		buffered.clear();
+	}
+
+public:
+	explicit BookBuilder(OrderBook &b, uint64_t lastSeq = 0) : book(b), applied(lastSeq) {}
+
+	// Returns false while the book is stale
+	bool apply(uint64_t seq, const OrderFeedEvent &e)
+	{
+		if (stale)
+		{
+			if (seq > applied && (buffered.empty() || seq > buffered.back().first))
+				buffered.push_back({seq, e});
+			return false;
+		}
+		if (seq <= applied)
+			return true;
+		if (seq != applied + 1)
+		{
+			++gapCount;
+			markStale();
+			buffered.push_back({seq, e});
+			return false;
+		}
+		if (!book.applyFeedEvent(e))
+		{
+			++errorCount;
+			markStale();
+			return false;
+		}
+		applied = seq;
+		return true;
+	}
+
+	// Rebuilds the book from a snapshot and catches up from the buffer.
+	// Returns true once the book is current; false if the snapshot is
+	// unreadable, or older than the first buffered event so a second gap
+	// remains (the buffer is kept for a newer snapshot).
+	bool resync(int fd)
+	{
+		uint64_t seq;
+		if (!book.resetFromSnapshot(fd, seq))
+			return false;
+		++resyncCount;
+		applied = seq;
+		size_t i = 0;
+		while (i < buffered.size() && buffered[i].first <= applied)
+			++i;
+		if (i < buffered.size() && buffered[i].first != applied + 1)
+			return false;
+		stale = false;
+		std::vector<std::pair<uint64_t, OrderFeedEvent>> replay(buffered.begin() + i, buffered.end());
+		buffered.clear();
+		for (auto &[s, e] : replay)
+			if (!apply(s, e))
+				break;
+		return !stale;
+	}
+
+	bool resync(const char *path)
+	{
+		int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		bool ok = resync(fd);
+		::close(fd);
+		return ok;
+	}
+
+	bool isStale() const { return stale; }
+	uint64_t lastApplied() const { return applied; }
+	size_t bufferedEvents() const { return buffered.size(); }
+	uint64_t gaps() const { return gapCount; }
+	uint64_t errors() const { return errorCount; }
+	uint64_t resyncs() const { return resyncCount; }
+};
+
+// Conflation for the market-by-price feed. Holds the latest aggregate of
+// every displayed level of every book; a flush emits each level that
+// changed since the last flush once, with its newest value. Dirty levels
+// are listed per book and dirty books globally, so a flush costs the number
+// of changed levels, never a scan of clean books or levels. A level that
+// appeared and vanished between flushes is never sent at all.
+class DepthConflator
+{
+	struct Level
+	{
+		int64_t price;
+		uint64_t qty;
+		uint64_t timestamp;
+		uint32_t orders;
+		Side side;
+		bool dirty;		// on its book's dirty list
+		bool published; // the consumer holds this level
+		bool seen;		// present in the snapshot being applied
+	};
+
+	// (side, price) -> level slot of one book. Open addressing with linear
+	// probing and backward-shift deletion like OrderIndex; presized for the
+	// book's expected levels and grown at half load, so steady-state updates
+	// never allocate.
+	class LevelIndex
+	{
+		static constexpr uint32_t EMPTY = UINT32_MAX;
+
+		struct Entry
+		{
+			int64_t price;
+			uint32_t slot = EMPTY;
+			Side side;
+		};
+
+		std::vector<Entry> entries;
+		uint64_t mask;
+		size_t count = 0;
+
+		static uint64_t hash(int64_t price, Side side)
+		{
+			uint64_t k = (static_cast<uint64_t>(price) << 1) | static_cast<uint64_t>(side);
+			k ^= k >> 33;
+			k *= 0xff51afd7ed558ccdULL;
+			return k ^ (k >> 33);
+		}
+
+		uint64_t probe(int64_t price, Side side) const
+		{
+			uint64_t i = hash(price, side) & mask;
+			while (entries[i].slot != EMPTY && (entries[i].price != price || entries[i].side != side))
+				i = (i + 1) & mask;
+			return i;
+		}
+
+		void grow()
+		{
+			std::vector<Entry> old(std::move(entries));
+			entries = std::vector<Entry>(old.size() * 2);
+			mask = entries.size() - 1;
+			for (const Entry &e : old)
+				if (e.slot != EMPTY)
+					entries[probe(e.price, e.side)] = e;
+		}
+
+	public:
+		static constexpr uint32_t NONE = EMPTY;
+
+		explicit LevelIndex(size_t levels) : entries(std::bit_ceil(std::max<size_t>(levels, 8) * 2)), mask(entries.size() - 1) {}
+
+		uint32_t find(int64_t price, Side side) const { return entries[probe(price, side)].slot; }
+
+		void insert(int64_t price, Side side, uint32_t slot)
+		{
+			if ((count + 1) * 2 > mask + 1)
+				grow();
+			Entry &e = entries[probe(price, side)];
+			if (e.slot == EMPTY)
+				++count;
+			e = {price, slot, side};
+		}
+
+		void erase(int64_t price, Side side)
+		{
+			uint64_t i = probe(price, side);
+			if (entries[i].slot == EMPTY)
+				return;
+			for (uint64_t j = (i + 1) & mask; entries[j].slot != EMPTY; j = (j + 1) & mask)
+			{
+				uint64_t home = hash(entries[j].price, entries[j].side) & mask;
+				if (((j - home) & mask) >= ((j - i) & mask))
+				{
+					entries[i] = entries[j];
+					i = j;
+				}
+			}
+			entries[i].slot = EMPTY;
+			--count;
+		}
+	};
+
+	struct Book
+	{
+		LevelIndex index;
+		std::vector<Level> levels; // slots; freed slots hold qty 0 and are not indexed
+		std::vector<uint32_t> freeSlots, dirty;
+		uint64_t inSeq = 0, outSeq = 0;
+		uint32_t snapshotDepth = 0, snapshotCount[2] = {};
+		int64_t snapshotWorst[2] = {};
+		bool queued = false;	// on dirtyBooks
+		bool stale = false;		// lost messages, waiting for a snapshot
+		bool resyncing = false; // applying that snapshot
+
+		explicit Book(size_t expectedLevels) : index(expectedLevels)
+		{
+			levels.reserve(expectedLevels);
+			freeSlots.reserve(expectedLevels);
+			dirty.reserve(expectedLevels);
+		}
+	};
+
+	std::vector<Book> books;
+	std::vector<uint16_t> dirtyBooks;
+	uint64_t gapCount = 0, resyncCount = 0;
+
+	void markDirty(uint16_t id, Book &b, uint32_t slot)
+	{
+		Level &L = b.levels[slot];
+		if (!L.dirty)
+		{
+			L.dirty = true;
+			b.dirty.push_back(slot);
+		}
+		if (!b.queued)
+		{
+			b.queued = true;
+			dirtyBooks.push_back(id);
+		}
+	}
+
+	void set(uint16_t id, Book &b, const DepthUpdate &u)
+	{
+		uint32_t slot = b.index.find(u.price, u.side);
+		if (slot == LevelIndex::NONE)
+		{
+			if (u.qty == 0)
+				return;
+			if (b.freeSlots.empty())
+			{
+				slot = static_cast<uint32_t>(b.levels.size());
+				b.levels.emplace_back();
+			}
+			else
+			{
+				slot = b.freeSlots.back();
+				b.freeSlots.pop_back();
+			}
+			b.levels[slot] = {u.price, 0, 0, 0, u.side, false, false, false};
+			b.index.insert(u.price, u.side, slot);
+		}
+		Level &L = b.levels[slot];
+		L.qty = u.qty;
+		L.orders = u.orders;
+		L.timestamp = u.timestamp;
+		L.seen = b.resyncing;
+		markDirty(id, b, slot);
+	}
+
+	// Levels the snapshot covers but did not list are gone. A side with
+	// fewer levels than the snapshot depth is covered entirely; otherwise
+	// only down to its worst listed price.
+	void endResync(uint16_t id, Book &b)
+	{
+		// Freed slots hold qty 0, so walking every slot only touches live levels
+		for (uint32_t slot = 0; slot < b.levels.size(); ++slot)
+		{
+			Level &L = b.levels[slot];
+			int side = static_cast<int>(L.side);
+			bool whole = b.snapshotCount[side] < b.snapshotDepth;
+			int64_t worst = b.snapshotWorst[side];
+			bool covered = whole || (side == 0 ? L.price >= worst : L.price <= worst);
+			if (!L.seen && covered && L.qty)
+			{
+				L.qty = 0;
+				L.orders = 0;
+				markDirty(id, b, slot);
+			}
+			L.seen = false;
+		}
+		b.stale = b.resyncing = false;
+		++resyncCount;
+	}
+
+public:
+	// Storage for levelsPerBook levels of each book is allocated up front
+	explicit DepthConflator(size_t bookCount, size_t levelsPerBook = 256)
+	{
+		books.reserve(bookCount);
+		for (size_t i = 0; i < bookCount; ++i)
+			books.emplace_back(levelsPerBook);
+		dirtyBooks.reserve(bookCount);
+	}
+
+	// Applies one message from a book's depth feed. Level messages always
+	// carry absolute values, so they apply even while the book is stale;
+	// the next snapshot after a gap removes levels whose deletes were lost.
+	void apply(const DepthUpdate &u)
+	{
+		if (u.book >= books.size())
+			return;
+		Book &b = books[u.book];
+		if (u.seq != b.inSeq + 1)
+		{
+			++gapCount;
+			b.stale = true;
+			b.resyncing = false;
+		}
+		b.inSeq = u.seq;
+
+		switch (u.type)
+		{
+		case DepthMsgType::Level:
+			set(u.book, b, u);
+			break;
+		case DepthMsgType::SnapshotBegin:
+			if (b.stale)
+			{
+				b.resyncing = true;
+				b.snapshotDepth = u.orders;
+				b.snapshotCount[0] = b.snapshotCount[1] = 0;
+			}
+			break;
+		case DepthMsgType::Snapshot:
+			if (b.resyncing)
+			{
+				int side = static_cast<int>(u.side);
+				++b.snapshotCount[side];
+				b.snapshotWorst[side] = u.price;
+				set(u.book, b, u);
+			}
+			break;
+		case DepthMsgType::SnapshotEnd:
+			if (b.resyncing)
+				endResync(u.book, b);
+			break;
+		}
+	}
+
+	// Hands every changed level to sink(const DepthUpdate &) as a Level
+	// message numbered by its own per-book sequence. If the sink refuses
+	// one, the rest stay dirty for the next flush. Returns messages sent.
+	template <typename Sink>
+	size_t flush(Sink &&sink)
+	{
+		size_t sent = 0;
+		for (size_t i = 0; i < dirtyBooks.size(); ++i)
+		{
+			uint16_t id = dirtyBooks[i];
+			Book &b = books[id];
+			while (!b.dirty.empty())
+			{
+				uint32_t slot = b.dirty.back();
+				Level &L = b.levels[slot];
+				if (L.qty || L.published)
+				{
+					if (!sink(DepthUpdate{DepthMsgType::Level, L.side, id, L.orders, L.price, L.qty, L.timestamp, b.outSeq + 1}))
+					{
+						dirtyBooks.erase(dirtyBooks.begin(), dirtyBooks.begin() + i);
+						return sent;
+					}
+					++b.outSeq;
+					++sent;
+				}
+				b.dirty.pop_back();
+				L.dirty = false;
+				L.published = L.qty != 0;
+				if (L.qty == 0)
+				{
+					b.index.erase(L.price, L.side);
+					b.freeSlots.push_back(slot);
+				}
+			}
+			b.queued = false;
+		}
+		dirtyBooks.clear();
+		return sent;
+	}
+
+	bool pending() const { return !dirtyBooks.empty(); }
+	uint64_t gaps() const { return gapCount; }
+	uint64_t resyncs() const { return resyncCount; }
+};
+
+// Runs a DepthConflator on its own thread. It drains the books' depth
+// rings as they fill and flushes changed levels to the output ring every
+// interval or on request. When the output ring is full the levels stay
+// dirty and go out, newer, on a later flush: a slow consumer sees fewer
+// updates, never a gap.
+class DepthConflationStage
+{
+	std::vector<RingBuffer<65536, DepthUpdate> *> inputs;
+	RingBuffer<65536, DepthUpdate> &output;
+	DepthConflator conflator;
+	uint64_t intervalTicks;
+	std::atomic<bool> running{false}, flushNow{false};
+	std::atomic<uint64_t> received{0}, sent{0}, flushes{0};
+	std::thread worker;
+
+	void run()
+	{
+		uint64_t due = readTsc() + intervalTicks;
+		while (true)
+		{
+			bool stopping = !running.load(std::memory_order_acquire);
+			uint64_t n = 0;
+			DepthUpdate u;
+			for (auto *in : inputs)
+				while (in->pop(u))
+				{
+					conflator.apply(u);
+					++n;
+				}
+			received.fetch_add(n, std::memory_order_relaxed);
+
+			uint64_t now = readTsc();
+			if (now >= due || stopping || flushNow.exchange(false, std::memory_order_acq_rel))
+			{
+				sent.fetch_add(conflator.flush([&](const DepthUpdate &d)
+											   { return output.push(d); }),
+							   std::memory_order_relaxed);
+				flushes.fetch_add(1, std::memory_order_relaxed);
+				due = now + intervalTicks;
+			}
+			if (stopping && !conflator.pending())
+				return;
+			if (n == 0)
+				std::this_thread::yield();
+		}
+	}
+
+public:
+	DepthConflationStage(std::vector<RingBuffer<65536, DepthUpdate> *> in, RingBuffer<65536, DepthUpdate> &out,
+						 size_t bookCount, uint64_t intervalMicros, size_t levelsPerBook = 256)
+		: inputs(std::move(in)), output(out), conflator(bookCount, levelsPerBook),
+		  intervalTicks(tscFrequency() / 1000000 * intervalMicros) {}
+	~DepthConflationStage() { stop(); }
+
+	bool start()
+	{
+		if (worker.joinable())
+			return false;
+		running.store(true, std::memory_order_release);
+		worker = std::thread([this]
+							 { run(); });
+		return true;
+	}
+
+	// Drains the inputs and flushes until everything is delivered, so the
+	// output ring's consumer must still be running.
+	void stop()
+	{
+		running.store(false, std::memory_order_release);
+		if (worker.joinable())
+			worker.join();
+	}
+
+	void requestFlush() { flushNow.store(true, std::memory_order_release); }
+
+	uint64_t updatesIn() const { return received.load(std::memory_order_relaxed); }
+	uint64_t updatesOut() const { return sent.load(std::memory_order_relaxed); }
+	uint64_t flushCount() const { return flushes.load(std::memory_order_relaxed); }
+	// Gap and resync counts; read after stop()
+	const DepthConflator &state() const { return conflator; }
+};
+
+// Seqlock over any trivially copyable value too big for one slot of
+// fields. The value is copied word by word through relaxed atomics, so a
+// torn read is well defined and caught by the version check.
+template <typename T>
+class SeqlockCell
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+	static constexpr size_t WORDS = (sizeof(T) + 7) / 8;
+
+	alignas(64) std::atomic<uint64_t> version{0};
+	std::atomic<uint64_t> words[WORDS] = {};
+
+public:
+	void write(const T &value)
+	{
+		uint64_t buf[WORDS] = {};
+		std::memcpy(buf, &value, sizeof(T));
+		uint64_t v = version.load(std::memory_order_relaxed);
+		version.store(v + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (size_t i = 0; i < WORDS; ++i)
+			words[i].store(buf[i], std::memory_order_relaxed);
+		version.store(v + 2, std::memory_order_release);
+	}
+
+	// Lock-free from any thread; `seq` gets the number of writes seen
+	T read(uint64_t *seq = nullptr) const
+	{
+		uint64_t buf[WORDS], v;
+		do
+		{
+			while ((v = version.load(std::memory_order_acquire)) & 1)
+				;
+			for (size_t i = 0; i < WORDS; ++i)
+				buf[i] = words[i].load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+		} while (version.load(std::memory_order_relaxed) != v);
+		if (seq)
+			*seq = v / 2;
+		T value;
+		std::memcpy(&value, buf, sizeof(T));
+		return value;
+	}
+};
+
+// One OHLCV bar. `start` is on the engine clock, a multiple of the bar's
+// interval; notional is the sum of price * qty.
+struct Bar
+{
+	uint64_t start;
+	int64_t open, high, low, close;
+	uint64_t volume;
+	int64_t notional;
+	uint32_t trades;
+
+	double vwap() const { return volume ? static_cast<double>(notional) / volume : 0.0; }
+};
+
+// Running totals for one symbol and, per bar interval, the bar in progress
+// and the last one completed
+struct TradeStats
+{
+	static constexpr int MAX_INTERVALS = 4;
+
+	uint64_t trades;
+	uint64_t volume;
+	int64_t notional;
+	int64_t lastPrice;
+	uint64_t timestamp;
+	Bar current[MAX_INTERVALS];
+	Bar completed[MAX_INTERVALS];
+
+	double vwap() const { return volume ? static_cast<double>(notional) / volume : 0.0; }
+};
+
+// Consumer-side trade analytics. add() folds one trade into its symbol's
+// running totals and bars; publish(), once per drained batch, copies every
+// symbol touched since the last publish into its seqlock cell. Bars are
+// cut on the engine clock the trades carry, so they are reproducible from
+// the trade log; an interval without trades produces no bar.
+class TradeAnalytics
+{
+	std::vector<uint64_t> intervals;
+	std::vector<TradeStats> stats; // consumer thread only
+	std::unique_ptr<SeqlockCell<TradeStats>[]> cells;
+	std::vector<uint32_t> dirty;
+	std::vector<uint8_t> queued;
+	uint64_t publishCount = 0;
+
+public:
+	// Bar intervals in engine clock ticks, at most MAX_INTERVALS of them and
+	// none zero; anything else throws std::invalid_argument
+	TradeAnalytics(size_t symbols, std::vector<uint64_t> barTicks)
+		: intervals(std::move(barTicks)), stats(symbols), cells(new SeqlockCell<TradeStats>[symbols]), queued(symbols)
+	{
+		if (intervals.size() > TradeStats::MAX_INTERVALS)
+			throw std::invalid_argument("TradeAnalytics: more bar intervals than MAX_INTERVALS");
+		if (std::ranges::find(intervals, 0) != intervals.end())
+			throw std::invalid_argument("TradeAnalytics: zero bar interval");
+	}
+
+	// symbol must be below symbolCount()
+	void add(uint32_t symbol, const TradeReport &t)
+	{
+		assert(symbol < stats.size());
+		TradeStats &s = stats[symbol];
+		int64_t notional = t.price * static_cast<int64_t>(t.qty);
+		s.trades++;
+		s.volume += t.qty;
+		s.notional += notional;
+		s.lastPrice = t.price;
+		s.timestamp = t.timestamp;
+		for (size_t i = 0; i < intervals.size(); ++i)
+		{
+			Bar &b = s.current[i];
+			uint64_t start = t.timestamp - t.timestamp % intervals[i];
+			if (b.trades == 0 || start > b.start)
+			{
+				if (b.trades)
+					s.completed[i] = b;
+				b = {start, t.price, t.price, t.price, t.price, t.qty, notional, 1};
+				continue;
+			}
+			b.high = std::max(b.high, t.price);
+			b.low = std::min(b.low, t.price);
+			b.close = t.price;
+			b.volume += t.qty;
+			b.notional += notional;
+			b.trades++;
+		}
+		if (!queued[symbol])
+		{
+			queued[symbol] = 1;
+			dirty.push_back(symbol);
+		}
+	}
+
+	void publish()
+	{
+		for (uint32_t symbol : dirty)
+		{
+			cells[symbol].write(stats[symbol]);
+			queued[symbol] = 0;
+		}
+		publishCount += dirty.size();
+		dirty.clear();
+	}
+
+	// Any thread. `seq` gets the number of publishes of this symbol.
+	TradeStats read(uint32_t symbol, uint64_t *seq = nullptr) const { return cells[symbol].read(seq); }
+
+	size_t symbolCount() const { return stats.size(); }
+	size_t intervalCount() const { return intervals.size(); }
+	uint64_t interval(size_t i) const { return intervals[i]; }
+	// Cell writes so far; consumer thread only
+	uint64_t publishes() const { return publishCount; }
+};
+
+// --- 13. SESSION GATEWAY ---
+// Per-session token buckets in one flat array. Credit is kept in counter
+// ticks, so a refill is a subtraction and a min and a message costs a
+// precomputed number of ticks: no division, no syscall on the hot path.
+class SessionThrottle
+{
+	struct Bucket
+	{
+		uint64_t credit = 0, last = 0;
+		uint64_t cost = 0, capacity = 0;
+		uint64_t admitted = 0, rejected = 0;
+	};
+
+	std::vector<Bucket> buckets;
+
+public:
+	SessionThrottle(size_t sessions, uint64_t msgsPerSec, uint64_t burst) : buckets(sessions)
+	{
+		for (size_t i = 0; i < sessions; ++i)
+			setRate(static_cast<uint32_t>(i), msgsPerSec, burst);
+	}
+
+	void setRate(uint32_t session, uint64_t msgsPerSec, uint64_t burst)
+	{
+		Bucket &b = buckets[session];
+		b.cost = tscFrequency() / std::max<uint64_t>(msgsPerSec, 1);
+		b.capacity = b.cost * std::max<uint64_t>(burst, 1);
+		b.credit = b.capacity;
+		b.last = readTsc();
+	}
+
+	bool admit(uint32_t session, uint64_t now)
+	{
+		if (session >= buckets.size())
+			return false;
+		Bucket &b = buckets[session];
+		// The TSC of another core can read behind b.last; never refill on that
+		if (now > b.last)
+		{
+			b.credit = std::min(b.capacity, b.credit + (now - b.last));
+			b.last = now;
+		}
+		if (b.credit >= b.cost)
+		{
+			b.credit -= b.cost;
+			b.admitted++;
+			return true;
+		}
+		b.rejected++;
+		return false;
+	}
+
+	uint64_t admitted(uint32_t session) const { return buckets[session].admitted; }
+	uint64_t rejected(uint32_t session) const { return buckets[session].rejected; }
+
+	uint64_t totalRejected() const
+	{
+		uint64_t n = 0;
+		for (const Bucket &b : buckets)
+			n += b.rejected;
+		return n;
+	}
+};
+
+// Command ingress in front of an OrderBook. Throttling happens here, ahead
+// of the book, so what reaches the book depends only on admitted commands.
+// Throttled commands never touch book state; they are counted per session
+// and reported as Rejected events on the book's event ring if one is given,
+// stamped with the engine clock but without advancing it. Once an attached
+// journal has failed, every command is rejected the same way.
+// Cancels and mass cancels bypass the throttle so a flooded session can
+// always pull quotes. Auction control is accepted only from the admin
+// session set with setAdminSession, and is throttled like other commands;
+// from any other session it is rejected as Unauthorized. Admitted commands are sequenced and, with a journal
+// attached, written ahead before the book applies them; with a replica
+// attached they are also shipped to a hot standby.
+class Gateway
+{
+	OrderBook &book;
+	SessionThrottle *throttle;
+	RingBuffer<65536, OrderEvent> *events;
+	JournalWriter *journal = nullptr;
+	ReleaseGate *gate = nullptr;
+	ReplicationPublisher *replica = nullptr;
+	uint64_t sequence = 0;
+	uint32_t adminSession = NO_SESSION;
+
+	bool reject(const Command &c, RejectReason reason)
+	{
+		if (events)
+			events->push({EventType::Rejected, c.side, reason, c.id, 0, c.qty, c.price, book.getTimestamp()});
+		return false;
+	}
+
+	bool admit(uint32_t session, const Command &c)
+	{
+		if ((c.type == CommandType::StartAuction || c.type == CommandType::EndAuction) && session != adminSession)
+			return reject(c, RejectReason::Unauthorized);
+		if (!throttle || c.type == CommandType::Cancel || c.type == CommandType::MassCancel || throttle->admit(session, readTsc()))
+			return true;
+		return reject(c, RejectReason::Throttled);
+	}
+
+public:
+	static constexpr uint32_t NO_SESSION = UINT32_MAX;
+
+	Gateway(OrderBook &b, SessionThrottle *t = nullptr, RingBuffer<65536, OrderEvent> *ev = nullptr)
+		: book(b), throttle(t), events(ev) {}
+
+	void setJournal(JournalWriter *j, ReleaseGate *g = nullptr)
+	{
+		journal = j;
+		gate = g;
+	}
+
+	// Ships every sequenced command to a hot standby as well
+	void setReplica(ReplicationPublisher *r) { replica = r; }
+
+	// The one session allowed to start and end auctions; NO_SESSION (the
+	// default) leaves auction control to direct calls on the book
+	void setAdminSession(uint32_t session) { adminSession = session; }
+
+	bool submit(uint32_t session, const Command &c)
+	{
+		if (!admit(session, c))
+			return false;
+		// Write-ahead: nothing is applied that the journal cannot record
+		uint64_t seq = sequence + 1;
+		if (journal && !journal->append(seq, c))
+			return reject(c, RejectReason::JournalFailed);
+		sequence = seq;
+		if (replica)
+			replica->append(seq, c);
+		bool ok = book.apply(c);
+		if (gate)
+			gate->mark(seq);
+		return ok;
+	}
+
+	// Ingress for client order-entry protocols. Auction control is refused
+	// here even from the admin session, so no wire message can halt or
+	// uncross the book.
+	bool submitOrderEntry(uint32_t session, const Command &c)
+	{
+		if (c.type == CommandType::StartAuction || c.type == CommandType::EndAuction)
+			return reject(c, RejectReason::Unauthorized);
+		return submit(session, c);
+	}
+
+	bool newOrder(uint32_t session, uint64_t id, Side side, OrderType type, uint32_t qty, int64_t price, int64_t stopPrice,
+				  const OrderOptions &opts = {})
+	{
+		Command c{CommandType::NewOrder, side, type, PegType::Primary, opts.hidden, qty, opts.minQty, opts.account, 0, id, 0, price, stopPrice, 0};
+		return submit(session, c);
+	}
+
+	bool newPeggedOrder(uint32_t session, uint64_t id, Side side, PegType pegType, uint32_t qty, int64_t offset, uint32_t account = 0)
+	{
+		Command c{CommandType::NewPegged, side, OrderType::Pegged, pegType, false, qty, 0, account, 0, id, 0, offset, 0, 0};
+		return submit(session, c);
+	}
+
+	bool cancel(uint32_t session, uint64_t orderId)
+	{
+		Command c{CommandType::Cancel, Side::Buy, OrderType::Limit, PegType::Primary, false, 0, 0, 0, 0, orderId, 0, 0, 0, 0};
+		return submit(session, c);
+	}
+
+	bool modify(uint32_t session, uint64_t orderId, uint32_t newQty, int64_t newPrice)
+	{
+		Command c{CommandType::Modify, Side::Buy, OrderType::Limit, PegType::Primary, false, newQty, 0, 0, 0, orderId, 0, newPrice, 0, 0};
+		return submit(session, c);
+	}
+
+	bool replace(uint32_t session, uint64_t orderId, uint64_t newId, uint32_t newQty, int64_t newPrice)
+	{
+		Command c{CommandType::Replace, Side::Buy, OrderType::Limit, PegType::Primary, false, newQty, 0, 0, 0, orderId, newId, newPrice, 0, 0};
+		return submit(session, c);
+	}
+
+	bool massQuote(uint32_t session, const QuoteLeg &bid, const QuoteLeg &ask, uint32_t account = 0)
+	{
+		Command c{CommandType::MassQuote, Side::Buy, OrderType::Limit, PegType::Primary, false,
+				  bid.qty, 0, account, ask.qty, bid.orderId, ask.orderId, bid.price, 0, ask.price};
+		return submit(session, c);
+	}
+
+	bool massCancel(uint32_t session, uint32_t account, bool buys = true, bool sells = true)
+	{
+		Command c{CommandType::MassCancel, Side::Buy, OrderType::Limit, PegType::Primary, false,
+				  (buys ? 1u : 0u) | (sells ? 2u : 0u), 0, account, 0, 0, 0, 0, 0, 0};
+		return submit(session, c);
+	}
+
+	bool startAuction(uint32_t session)
+	{
+		Command c{};
+		c.type = CommandType::StartAuction;
+		return submit(session, c);
+	}
+
+	bool endAuction(uint32_t session)
+	{
+		Command c{};
+		c.type = CommandType::EndAuction;
+		return submit(session, c);
+	}
+
+	// Continues numbering after a restart from a snapshot and journal replay
+	void resumeAfter(uint64_t seq) { sequence = seq; }
+	uint64_t lastSequence() const { return sequence; }
+};
+
+// Binary order entry in the style of SBE: every message is an 8-byte
+// header (blockLength, templateId, schemaId, version) and a fixed block of
+// little-endian fields at fixed offsets. A layout is declared once as the
+// list of its field types; offsets, block length and the encoder come from
+// the list at compile time, and the decoder reads each field straight out
+// of the receive buffer.
+template <typename... Ts>
+struct SbeBlock
+{
+	static_assert((std::is_integral_v<Ts> && ...), "fields are plain integers");
+	static constexpr uint16_t BLOCK_LENGTH = (sizeof(Ts) + ... + 0);
+
+	template <size_t I>
+	using Type = std::tuple_element_t<I, std::tuple<Ts...>>;
+
+	template <size_t I>
+	static constexpr size_t offset()
+	{
+		constexpr size_t sizes[] = {sizeof(Ts)...};
+		size_t off = 0;
+		for (size_t k = 0; k < I; ++k)
+			off += sizes[k];
+		return off;
+	}
+
+	template <size_t I>
+	static Type<I> get(const uint8_t *block)
+	{
+		Type<I> v;
+		std::memcpy(&v, block + offset<I>(), sizeof(v));
+		if constexpr (std::endian::native == std::endian::big && sizeof(v) > 1)
+			v = std::byteswap(v);
+		return v;
+	}
+
+	static uint8_t *put(uint8_t *block, Ts... fields)
+	{
+		auto one = [&block](auto v)
+		{
+			if constexpr (std::endian::native == std::endian::big && sizeof(v) > 1)
+				v = std::byteswap(v);
+			std::memcpy(block, &v, sizeof(v));
+			block += sizeof(v);
+		};
+		(one(fields), ...);
+		return block;
+	}
+};
+
+struct SbeHeader : SbeBlock<uint16_t, uint16_t, uint16_t, uint16_t>
+{
+	enum : size_t
+	{
+		BlockLength,
+		TemplateId,
+		SchemaId,
+		Version
+	};
+	static constexpr uint16_t SCHEMA_ID = 1, SCHEMA_VERSION = 1;
+};
+
+// side: 0 buy, 1 sell. type: an OrderType other than Pegged. flags bit 0:
+// hidden.
+struct NewOrderMsg : SbeBlock<uint64_t, int64_t, int64_t, uint32_t, uint32_t, uint32_t, uint8_t, uint8_t, uint8_t>
+{
+	enum : size_t
+	{
+		Id,
+		Price,
+		StopPrice,
+		Qty,
+		MinQty,
+		Account,
+		SideCode,
+		Type,
+		Flags
+	};
+	static constexpr uint16_t TEMPLATE_ID = 1;
+};
+
+struct CancelMsg : SbeBlock<uint64_t>
+{
+	enum : size_t
+	{
+		Id
+	};
+	static constexpr uint16_t TEMPLATE_ID = 2;
+};
+
+struct ReplaceMsg : SbeBlock<uint64_t, uint64_t, int64_t, uint32_t>
+{
+	enum : size_t
+	{
+		Id,
+		NewId,
+		Price,
+		Qty
+	};
+	static constexpr uint16_t TEMPLATE_ID = 3;
+};
+
+// sides: bit 0 buys, bit 1 sells
+struct MassCancelMsg : SbeBlock<uint32_t, uint8_t>
+{
+	enum : size_t
+	{
+		Account,
+		Sides
+	};
+	static constexpr uint16_t TEMPLATE_ID = 4;
+};
+
+// Writes one message, header included, and returns the new end. Fields
+// follow the message's declaration order.
+template <typename M, typename... Args>
+uint8_t *encodeSbe(uint8_t *p, Args... fields)
+{
+	p = SbeHeader::put(p, M::BLOCK_LENGTH, M::TEMPLATE_ID, SbeHeader::SCHEMA_ID, SbeHeader::SCHEMA_VERSION);
+	return M::put(p, fields...);
+}
+
+// Decodes order-entry messages from a receive buffer and submits them for
+// one session through Gateway::submitOrderEntry, so they are throttled,
+// sequenced, journaled and replicated like any other command, and can
+// never carry auction control. A block longer than the
+// decoder knows (a newer schema version) is read up to the known fields. Another schema, an unknown
+// template, a block shorter than its template or a field out of range
+// counts as malformed, and the message is skipped by its blockLength.
+class SbeOrderDecoder
+{
+	Gateway &gateway;
+	uint32_t session;
+	uint64_t messages = 0, rejects = 0, malformed = 0;
+
+	static uint16_t knownLength(uint16_t templateId)
+	{
+		switch (templateId)
+		{
+		case NewOrderMsg::TEMPLATE_ID:
+			return NewOrderMsg::BLOCK_LENGTH;
+		case CancelMsg::TEMPLATE_ID:
+			return CancelMsg::BLOCK_LENGTH;
+		case ReplaceMsg::TEMPLATE_ID:
+			return ReplaceMsg::BLOCK_LENGTH;
+		case MassCancelMsg::TEMPLATE_ID:
+			return MassCancelMsg::BLOCK_LENGTH;
+		}
+		return 0;
+	}
+
+	// Builds the command a message stands for; false if a field is out of
+	// range. Only order-entry commands can come out of here.
+	static bool toCommand(uint16_t templateId, const uint8_t *b, Command &c)
+	{
+		c = {};
+		switch (templateId)
+		{
+		case NewOrderMsg::TEMPLATE_ID:
+		{
+			using M = NewOrderMsg;
+			uint8_t side = M::get<M::SideCode>(b), type = M::get<M::Type>(b);
+			if (side > 1 || type > static_cast<uint8_t>(OrderType::StopLimit))
+				return false;
+			c.type = CommandType::NewOrder;
+			c.side = static_cast<Side>(side);
+			c.orderType = static_cast<OrderType>(type);
+			c.hidden = (M::get<M::Flags>(b) & 1) != 0;
+			c.qty = M::get<M::Qty>(b);
+			c.minQty = M::get<M::MinQty>(b);
+			c.account = M::get<M::Account>(b);
+			c.id = M::get<M::Id>(b);
+			c.price = M::get<M::Price>(b);
+			c.stopPrice = M::get<M::StopPrice>(b);
+			return true;
+		}
+		case CancelMsg::TEMPLATE_ID:
+			c.type = CommandType::Cancel;
+			c.id = CancelMsg::get<CancelMsg::Id>(b);
+			return true;
+		case ReplaceMsg::TEMPLATE_ID:
+		{
+			using M = ReplaceMsg;
+			c.type = CommandType::Replace;
+			c.qty = M::get<M::Qty>(b);
+			c.id = M::get<M::Id>(b);
+			c.newId = M::get<M::NewId>(b);
+			c.price = M::get<M::Price>(b);
+			return true;
+		}
+		case MassCancelMsg::TEMPLATE_ID:
+		{
+			using M = MassCancelMsg;
+			c.type = CommandType::MassCancel;
+			c.qty = M::get<M::Sides>(b) & 3;
+			c.account = M::get<M::Account>(b);
+			return true;
+		}
+		}
+		return false;
+	}
+
+public:
+	SbeOrderDecoder(Gateway &g, uint32_t sessionId = 0) : gateway(g), session(sessionId) {}
+
+	// Handles every whole message in [p, p + len) and returns the bytes
+	// used; a partial message at the end is left for the next call.
+	size_t decode(const uint8_t *p, size_t len)
+	{
+		size_t used = 0;
+		while (len - used >= SbeHeader::BLOCK_LENGTH)
+		{
+			const uint8_t *h = p + used;
+			uint16_t blockLength = SbeHeader::get<SbeHeader::BlockLength>(h);
+			if (len - used - SbeHeader::BLOCK_LENGTH < blockLength)
+				break;
+			used += SbeHeader::BLOCK_LENGTH + blockLength;
+			++messages;
+			uint16_t templateId = SbeHeader::get<SbeHeader::TemplateId>(h);
+			uint16_t known = knownLength(templateId);
+			if (SbeHeader::get<SbeHeader::SchemaId>(h) != SbeHeader::SCHEMA_ID || !known || blockLength < known)
+			{
+				++malformed;
+				continue;
+			}
+			Command c;
+			if (!toCommand(templateId, h + SbeHeader::BLOCK_LENGTH, c))
+				++malformed;
+			else if (!gateway.submitOrderEntry(session, c))
+				++rejects;
+		}
+		return used;
+	}
+
+	uint64_t messageCount() const { return messages; }
+	// Well-formed messages refused by the gateway (throttled, journal
+	// failed) or the book (rejected order, unknown id)
+	uint64_t rejectCount() const { return rejects; }
+	uint64_t malformedCount() const { return malformed; }
+};
+
+// --- 14. JOURNAL REPLAY ---
+// Order-sensitive 64-bit hash of everything a book emits. Fields are folded
+// in one at a time, so struct padding never reaches the hash and the value
+// is the same on every platform.
+class StreamHash
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+
+public:
+	void add(uint64_t v) { h = (std::rotl(h, 23) ^ v) * 0xff51afd7ed558ccdULL; }
+
+	void add(const TradeReport &t)
+	{
+		add(t.takerId);
+		add(t.makerId);
+		add(t.qty);
+		add(static_cast<uint64_t>(t.price));
+		add(t.timestamp);
+	}
+
+	void add(const OrderEvent &e)
+	{
+		add((static_cast<uint64_t>(e.type) << 16) | (static_cast<uint64_t>(e.side) << 8) | static_cast<uint64_t>(e.reason));
+		add(e.orderId);
+		add(e.refId);
+		add(e.qty);
+		add(static_cast<uint64_t>(e.price));
+		add(e.timestamp);
+	}
+
+	uint64_t value() const { return h; }
+};
+
+// What one command did: its sequence, whether the book accepted it, then
+// its trades and its events in emission order
+struct ReplaySink
+{
+	std::unique_ptr<RingBuffer<65536>> trades = std::make_unique<RingBuffer<65536>>();
+	std::unique_ptr<RingBuffer<65536, OrderEvent>> events = std::make_unique<RingBuffer<65536, OrderEvent>>();
+	StreamHash hash;
+	uint64_t tradeCount = 0, eventCount = 0;
+
+	void record(uint64_t seq, bool accepted)
+	{
+		hash.add(seq);
+		hash.add(accepted);
+		TradeReport t;
+		while (trades->pop(t))
+		{
+			hash.add(t);
+			tradeCount++;
+		}
+		OrderEvent e;
+		while (events->pop(e))
+		{
+			hash.add(e);
+			eventCount++;
+		}
+	}
+};
+
+std::string hashString(uint64_t h)
+{
+	char buf[19];
+	std::snprintf(buf, sizeof(buf), "0x%016llx", static_cast<unsigned long long>(h));
+	return buf;
+}
+
+// Per-order latency in cycle-counter ticks, reported as percentiles
+void printLatency(const char *label, std::vector<uint64_t> &ticks)
+{
+	if (ticks.empty())
+		return;
+	std::sort(ticks.begin(), ticks.end());
+	double nsPerTick = 1e9 / tscFrequency();
+	auto pct = [&](double q)
+	{ return ticks[static_cast<size_t>(q * (ticks.size() - 1))] * nsPerTick; };
+	std::cout << label << " p50/p99/p99.9/max: " << pct(0.5) << "/" << pct(0.99) << "/" << pct(0.999) << "/" << pct(1.0) << " ns" << std::endl;
+}
+
+// Journals a seeded mixed session (75% new orders, 15% cancels, 10%
+// modifies) through a Gateway and prints the hash a replay must reproduce
+int runRecord(const char *path, int n)
+{
+	MemoryManager mm(static_cast<size_t>(n) * 3);
+	ReplaySink sink;
+	OrderBook book(mm, *sink.trades);
+	book.setEventBuffer(sink.events.get());
+	JournalWriter journal;
+	if (!journal.open(path))
+	{
+		std::cerr << "Cannot create journal " << path << std::endl;
+		return 2;
+	}
+	Gateway gateway(book);
+	gateway.setJournal(&journal);
+	OrderGenerator generator(42, 300.0, 50.0);
+	std::mt19937 rng(42);
+
+	for (int i = 0; i < n; ++i)
+	{
+		auto order = generator.generateOrder(true);
+		uint32_t r = rng() % 20;
+		bool ok;
+		if (r < 15)
+			ok = gateway.newOrder(0, order.id, order.side, order.type, order.shares, order.price, order.stopPrice);
+		else if (r < 18)
+			ok = gateway.cancel(0, order.id - 100);
+		else
+			ok = gateway.modify(0, order.id - 50, order.shares + 5, order.price + 1);
+		sink.record(gateway.lastSequence(), ok);
+	}
+	journal.close();
+	if (journal.hasFailed())
+	{
+		std::cerr << "Journal write failed" << std::endl;
+		return 2;
+	}
+	std::cout << "Commands Journaled: " << gateway.lastSequence() << std::endl;
+	std::cout << "Trades/Events: " << sink.tradeCount << "/" << sink.eventCount << std::endl;
+	std::cout << "Event Stream Hash: " << hashString(sink.hash.value()) << std::endl;
+	return 0;
+}
+
+struct ReplayOptions
+{
+	const char *journal = nullptr;
+	const char *snapshot = nullptr; // start from this snapshot, replay only the tail
+	size_t pool = 0;				// order pool size; 0 sizes it from the journal
+	uint64_t every = 0;				// print the running hash every N commands
+	bool hasExpect = false;
+	uint64_t expect = 0;
+};
+
+// Loads the whole journal (write-ahead or compact) first so file I/O stays
+// out of the measurement, then applies it to a fresh book as fast as possible. The running hash
+// covers every command's outcome, trades and events; printing it every N
+// commands lets two runs be diffed to the first divergent stretch.
+int runReplay(const ReplayOptions &opt)
+{
+	JournalReader reader;
+	CompactLogReader<CommandCodec> compact;
+	std::vector<JournalRecord> records;
+	JournalRecord rec;
+	if (reader.open(opt.journal))
+		while (reader.next(rec))
+			records.push_back(rec);
+	else if (compact.open(opt.journal))
+		while (compact.next(rec))
+			records.push_back(rec);
+	else
+	{
+		std::cerr << "Cannot read journal " << opt.journal << std::endl;
+		return 2;
+	}
+
+	MemoryManager mm(opt.pool ? opt.pool : 2 * records.size() + 1024);
+	ReplaySink sink;
+	OrderBook book(mm, *sink.trades);
+	book.setEventBuffer(sink.events.get());
+	uint64_t after = 0;
+	if (opt.snapshot && !book.loadSnapshot(opt.snapshot, after))
+	{
+		std::cerr << "Cannot load snapshot " << opt.snapshot << std::endl;
+		return 2;
+	}
+
+	std::vector<uint64_t> ticks;
+	ticks.reserve(records.size());
+	uint64_t applied = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (const JournalRecord &r : records)
+	{
+		if (r.seq <= after)
+			continue;
+		uint64_t c0 = readTsc();
+		bool ok = book.apply(r.cmd);
+		ticks.push_back(readTsc() - c0);
+		sink.record(r.seq, ok);
+		if (opt.every && ++applied % opt.every == 0)
+			std::cout << "seq " << r.seq << " " << hashString(sink.hash.value()) << "\n";
+	}
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+
+	std::cout << "Commands Replayed: " << ticks.size() << " of " << records.size() << std::endl;
+	std::cout << "Throughput: " << ticks.size() / secs.count() / 1e6 << " Million Commands/s (hashing included)" << std::endl;
+	printLatency("Apply Latency", ticks);
+	std::cout << "Trades/Events: " << sink.tradeCount << "/" << sink.eventCount << std::endl;
+	std::cout << "Orders Resting: " << book.getOrderCount() << ", Stops: " << book.getStopOrderCount() << std::endl;
+	std::cout << "Event Stream Hash: " << hashString(sink.hash.value()) << std::endl;
+	if (!opt.hasExpect)
+		return 0;
+	bool match = sink.hash.value() == opt.expect;
+	std::cout << (match ? "MATCH" : "DIVERGED: expected " + hashString(opt.expect)) << std::endl;
+	return match ? 0 : 1;
+}
+
+// Connects to a primary's replication socket and mirrors its book until the
+// primary ends the stream or dies, then stands ready to take over: it
+// reports the sequence to resume from and can write the book to a snapshot.
+int runStandby(const char *socketPath, size_t pool, const char *snapshot)
+{
+	int fd = connectUnix(socketPath, 5000);
+	if (fd < 0)
+	{
+		std::cerr << "Cannot connect to primary at " << socketPath << std::endl;
+		return 2;
+	}
+	MemoryManager mm(pool);
+	auto trades = std::make_unique<RingBuffer<65536>>();
+	OrderBook book(mm, *trades);
+	Replica replica(book);
+	bool ended = replica.run(fd);
+	::close(fd);
+	if (replica.sawGap())
+	{
+		std::cerr << "Sequence gap after " << replica.lastApplied() << "; standby must be rebuilt" << std::endl;
+		return 1;
+	}
+	std::cout << "Standby: " << (ended ? "primary ended the stream" : "primary lost")
+			  << ", taking over after seq " << replica.lastApplied() << std::endl;
+	if (snapshot && !book.saveSnapshot(snapshot, replica.lastApplied()))
+	{
+		std::cerr << "Cannot write snapshot " << snapshot << std::endl;
+		return 2;
+	}
+	return 0;
+}
+
+// --- 15. BENCHMARK SUITE ---
+double runBenchmark(const char *name, OrderBook &engine,
+				  std::function<void(int)> testFunc,
+				  int testSize, RingBuffer<65536> &tradeBuffer)
+{
+	std::cout << "\n=== " << name << " ===" << std::endl;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	testFunc(testSize);
+	auto end = std::chrono::high_resolution_clock::now();
+
+	std::chrono::duration<double> diff = end - start;
+
+	std::cout << "Throughput: " << (testSize / diff.count()) / 1e6 << " Million TPS" << std::endl;
+	std::cout << "Regular Orders in Book: " << engine.getOrderCount() << std::endl;
+	std::cout << "Stop Orders in Book: " << engine.getStopOrderCount() << std::endl;
+	std::cout << "Trades Pending: " << tradeBuffer.size() << std::endl;
+	return diff.count();
+}
+
+// Rests n non-crossing limit orders spread over 20,000 ticks either side of 30000
+void fillRestingBook(OrderBook &book, int n, uint64_t seed)
+{
+	std::mt19937_64 rng(seed);
+	for (int i = 0; i < n; ++i)
+	{
+		Side side = (i & 1) ? Side::Sell : Side::Buy;
+		int64_t offset = 1 + static_cast<int64_t>(rng() % 20000);
+		book.processOrder(5000000000ull + i, side, OrderType::Limit, 1 + static_cast<uint32_t>(rng() % 500),
+						  side == Side::Buy ? 30000 - offset : 30000 + offset, 0);
+	}
+}
+
+// Streams n records through a writer alone as fast as its ring admits them
+// for the sustained rate, then n/10 more paced at 100k/sec, sampling how long
+// every 64th paced record takes to become durable
+void runJournalBenchmark(const char *name, const JournalConfig &cfg, const std::string &path, int n)
+{
+	std::cout << "\n=== " << name << " ===" << std::endl;
+	JournalWriter journal(cfg);
+	if (!journal.open(path.c_str()))
+	{
+		std::cout << "Journal file could not be created" << std::endl;
+		return;
+	}
+	std::cout << "Backend: " << (journal.backend() == JournalBackend::IoUring ? "io_uring" : "write()")
+			  << (journal.directIo() ? " + O_DIRECT" : "") << std::endl;
+
+	using Clock = std::chrono::steady_clock;
+	Command cmd{};
+	cmd.type = CommandType::NewOrder;
+	cmd.side = Side::Buy;
+	cmd.orderType = OrderType::Limit;
+	cmd.qty = 100;
+	cmd.price = 30000;
+	uint64_t seq = 0;
+	auto waitDurable = [&]
+	{
+		while (journal.durableSeq() < seq && !journal.hasFailed())
+			std::this_thread::yield();
+	};
+
+	auto start = Clock::now();
+	for (int i = 0; i < n; ++i)
+	{
+		cmd.id = ++seq;
+		journal.append(seq, cmd);
+	}
+	waitDurable();
+	std::chrono::duration<double> secs = Clock::now() - start;
+	uint64_t bulkBytes = journal.bytesWritten();
+	uint64_t bulkSyncs = journal.syncCount();
+
+	std::vector<std::pair<uint64_t, Clock::time_point>> samples;
+	std::vector<double> latencyUs;
+	size_t nextSample = 0;
+	auto collect = [&]
+	{
+		uint64_t durableSeq = journal.durableSeq();
+		while (nextSample < samples.size() && samples[nextSample].first <= durableSeq)
+		{
+			std::chrono::duration<double, std::micro> d = Clock::now() - samples[nextSample].second;
+			latencyUs.push_back(d.count());
+			++nextSample;
+		}
+	};
+	auto due = Clock::now();
+	for (int i = 0; i < n / 10; ++i)
+	{
+		due += std::chrono::microseconds(10);
+		while (Clock::now() < due)
+		{
+			collect();
+			std::this_thread::yield();
+		}
+		cmd.id = ++seq;
+		journal.append(seq, cmd);
+		if ((seq & 63) == 0)
+			samples.push_back({seq, Clock::now()});
+	}
+	while (nextSample < samples.size() && !journal.hasFailed())
+	{
+		collect();
+		std::this_thread::yield();
+	}
+	journal.close();
+	std::remove(path.c_str());
+
+	std::sort(latencyUs.begin(), latencyUs.end());
+	auto pct = [&](double q)
+	{ return latencyUs.empty() ? 0.0 : latencyUs[static_cast<size_t>(q * (latencyUs.size() - 1))]; };
+	std::cout << "Sustained Write Rate: " << bulkBytes / secs.count() / 1e6 << " MB/s" << std::endl;
+	std::cout << "Group Commits (fdatasync): " << bulkSyncs << std::endl;
+	std::cout << "Append-to-Durable Latency at 100k/sec p50/p99: " << pct(0.5) << "/" << pct(0.99) << " us" << std::endl;
+	if (journal.hasFailed())
+		std::cout << "Journal write failed" << std::endl;
+}
+
+// --- 16. SELF CHECKS ---
+// Assertion checks of failure paths and feature interactions the
+// benchmarks never reach. `matching_engine check` runs them all, prints
+// every failed expectation and exits non-zero if there was one.
+class SelfCheck
+{
+	const char *current = "";
+	int failures = 0, checks = 0;
+
+public:
+	void expect(bool ok, const char *what)
+	{
+		++checks;
+		if (ok)
+			return;
+		++failures;
+		std::cerr << "FAIL " << current << ": " << what << std::endl;
+	}
+
+	template <typename F>
+	void run(const char *name, F f)
+	{
+		current = name;
+		f();
+	}
+
+	int finish() const
+	{
+		std::cout << checks - failures << "/" << checks << " checks passed" << std::endl;
+		return failures ? 1 : 0;
+	}
+};
+
+// A small book with its trade and event rings, drained on demand. The
+// rings are full size, so checks allocate the fixture on the heap.
+struct CheckBook
+{
+	MemoryManager mm{4096};
+	RingBuffer<65536> trades;
+	RingBuffer<65536, OrderEvent> events;
+	OrderBook book{mm, trades};
+
+	CheckBook() { book.setEventBuffer(&events); }
+
+	std::vector<TradeReport> drainTrades()
+	{
+		std::vector<TradeReport> out;
+		TradeReport t;
+		while (trades.pop(t))
+			out.push_back(t);
+		return out;
+	}
+
+	std::vector<OrderEvent> drainEvents()
+	{
+		std::vector<OrderEvent> out;
+		OrderEvent e;
+		while (events.pop(e))
+			out.push_back(e);
+		return out;
+	}
+};
+
+void checkMassQuoteTriggeringStops(SelfCheck &c)
+{
+	// The bid leg trades, which triggers a buy stop whose market order
+	// fills the ask leg's resting order completely before that leg is
+	// applied; the ask leg must then enter as a new order
+	auto b = std::make_unique<CheckBook>();
+	OrderBook &book = b->book;
+	book.processOrder(1, Side::Sell, OrderType::Limit, 5, 100, 0);
+	book.processOrder(2, Side::Sell, OrderType::Limit, 10, 105, 0); // ask leg
+	book.processOrder(3, Side::Buy, OrderType::Stop, 10, 110, 100); // market up to 110
+	c.expect(book.getStopOrderCount() == 1, "stop rests");
+
+	book.massQuote({4, 5, 100}, {2, 8, 106});
+	auto trades = b->drainTrades();
+	c.expect(trades.size() == 2, "bid leg and triggered stop both trade");
+	c.expect(trades.size() == 2 && trades[1].makerId == 2 && trades[1].qty == 10, "stop fills the old ask leg");
+	c.expect(book.getStopOrderCount() == 0, "stop consumed");
+	const Order *ask = book.findOrder(2);
+	c.expect(ask && ask->side == Side::Sell && ask->shares == 8 && ask->price == 106, "ask leg re-enters as a new order");
+	c.expect(book.getOrderCount() == 1, "only the new ask leg rests");
+}
+
+void checkReplaceCollisions(SelfCheck &c)
+{
+	auto b = std::make_unique<CheckBook>();
+	OrderBook &book = b->book;
+	book.processOrder(1, Side::Buy, OrderType::Limit, 10, 100, 0);
+	book.processOrder(2, Side::Buy, OrderType::Limit, 10, 99, 0);
+	book.processOrder(3, Side::Sell, OrderType::Stop, 10, 90, 95);
+	b->drainEvents();
+
+	for (uint64_t taken : {2, 3})
+	{
+		c.expect(!book.replaceOrder(1, taken, 20, 101), "replace onto a live id fails");
+		auto events = b->drainEvents();
+		c.expect(events.size() == 1 && events[0].type == EventType::Rejected && events[0].reason == RejectReason::DuplicateId &&
+					 events[0].orderId == taken,
+				 "and is rejected as a duplicate id");
+		const Order *o = book.findOrder(1);
+		c.expect(o && o->shares == 10 && o->price == 100, "original order untouched");
+	}
+	c.expect(book.getOrderCount() == 2 && book.getStopOrderCount() == 1, "nothing added or removed");
+	c.expect(book.replaceOrder(1, 4, 20, 101) && book.findOrder(4) && !book.findOrder(1), "a free id still works");
+}
+
+void checkBreakerHaltMidSweep(SelfCheck &c)
+{
+	// A market buy walks up the book; the 5% move trips the breaker after
+	// the second level and the rest of the order must be reported
+	auto b = std::make_unique<CheckBook>();
+	OrderBook &book = b->book;
+	book.setCircuitBreaker({500, 1000});
+	book.processOrder(1, Side::Sell, OrderType::Limit, 10, 100, 0);
+	book.processOrder(2, Side::Sell, OrderType::Limit, 10, 106, 0);
+	book.processOrder(3, Side::Sell, OrderType::Limit, 10, 107, 0);
+	b->drainEvents();
+
+	book.processOrder(4, Side::Buy, OrderType::Market, 30, 200, 0);
+	auto trades = b->drainTrades();
+	auto events = b->drainEvents();
+	c.expect(trades.size() == 2, "sweep stops at the level that trips the breaker");
+	c.expect(book.getTradingState() == TradingState::Auction && book.getHaltCount() == 1, "book halts");
+	bool halted = false, rejected = false;
+	for (const OrderEvent &e : events)
+	{
+		halted |= e.type == EventType::Halted;
+		rejected |= e.type == EventType::Rejected && e.reason == RejectReason::Halted && e.orderId == 4 && e.qty == 10;
+	}
+	c.expect(halted, "halt published");
+	c.expect(rejected, "unfilled 10 shares rejected for the halt");
+	c.expect(!book.findOrder(4) && book.findOrder(3), "nothing of the market order rests");
+}
+
+void checkSnapshotPriceWindow(SelfCheck &c)
+{
+	// A book that never configured its breaker still snapshots a usable
+	// window, and a snapshot whose window capacity is zero is refused
+	auto src = std::make_unique<CheckBook>();
+	src->book.processOrder(1, Side::Buy, OrderType::Limit, 10, 100, 0);
+	char path[] = "/tmp/matching_engine_checkXXXXXX";
+	int fd = ::mkstemp(path);
+	c.expect(fd >= 0 && src->book.saveSnapshot(fd, 7), "snapshot written");
+
+	auto dst = std::make_unique<CheckBook>();
+	uint64_t seq = 0;
+	c.expect(::lseek(fd, 0, SEEK_SET) == 0 && dst->book.loadSnapshot(fd, seq) && seq == 7, "snapshot loads");
+	dst->book.setCircuitBreaker({500, 1000});
+	dst->book.processOrder(2, Side::Sell, OrderType::Limit, 5, 100, 0);
+	c.expect(dst->drainTrades().size() == 1, "loaded book trades with the breaker on");
+
+	// Zero the window capacity, which follows the header, the four trees'
+	// end markers and the two empty peg lists
+	off_t capAt = sizeof(SnapshotHeader) + sizeof(SnapshotLevel) + sizeof(SnapshotOrder) + 4 * sizeof(SnapshotLevel) +
+				  2 * sizeof(uint64_t) + sizeof(uint64_t);
+	uint64_t zero = 0;
+	c.expect(::pwrite(fd, &zero, sizeof zero, capAt) == sizeof zero, "capacity overwritten");
+	auto bad = std::make_unique<CheckBook>();
+	c.expect(::lseek(fd, 0, SEEK_SET) == 0 && !bad->book.loadSnapshot(fd, seq), "zero-capacity window refused");
+	::close(fd);
+	::unlink(path);
+}
+
+void checkRiskAttachSeeds(SelfCheck &c)
+{
+	auto b = std::make_unique<CheckBook>();
+	OrderBook &book = b->book;
+	book.processOrder(1, Side::Buy, OrderType::Limit, 10, 100, 0, {.account = 0});
+	book.processOrder(2, Side::Buy, OrderType::Limit, 5, 99, 0, {.hidden = true, .account = 0});
+	book.processPeggedOrder(3, Side::Sell, PegType::Primary, 4, 0, 1);
+
+	RiskManager rm(2);
+	rm.setLimits(0, 20, 20);
+	rm.setLimits(1, 20, 20);
+	book.setRiskManager(&rm);
+	c.expect(rm.openQty(0, Side::Buy) == 15 && rm.openQty(1, Side::Sell) == 4, "resting orders seeded");
+	c.expect(!book.processOrder(4, Side::Buy, OrderType::Limit, 6, 98, 0, {.account = 0}), "seeded quantity counts");
+
+	c.expect(book.cancelOrder(1), "cancel an order rested before attach");
+	c.expect(book.processOrder(5, Side::Sell, OrderType::Limit, 5, 99, 0, {.account = 1}), "fill an order rested before attach");
+	c.expect(rm.openQty(0, Side::Buy) == 0, "open quantity released without wrapping");
+	c.expect(book.processOrder(6, Side::Buy, OrderType::Limit, 15, 90, 0, {.account = 0}), "later orders still accepted");
+}
+
+void checkRiskRejects(SelfCheck &c)
+{
+	auto b = std::make_unique<CheckBook>();
+	OrderBook &book = b->book;
+	book.processOrder(1, Side::Sell, OrderType::Limit, 10, 101, 0, {.account = 7}); // before risk is attached
+
+	RiskManager rm(2);
+	rm.setLimits(0, 15, 10);
+	book.setRiskManager(&rm);
+	c.expect(book.processOrder(2, Side::Buy, OrderType::Limit, 10, 100, 0, {.account = 0}), "within limits");
+	c.expect(rm.openQty(0, Side::Buy) == 10, "open quantity tracked");
+	b->drainEvents();
+
+	c.expect(!book.processOrder(3, Side::Buy, OrderType::Limit, 10, 99, 0, {.account = 0}), "open plus new exceeds max long");
+	c.expect(!book.processOrder(4, Side::Sell, OrderType::Limit, 5, 102, 0, {.account = 9}), "unknown account");
+	auto events = b->drainEvents();
+	c.expect(events.size() == 2 && events[0].reason == RejectReason::RiskLimit && events[0].orderId == 3 &&
+				 events[1].reason == RejectReason::RiskLimit && events[1].orderId == 4,
+			 "both rejected for risk");
+	c.expect(book.getOrderCount() == 2 && book.getRejectCount() == 2, "nothing rests");
+
+	// Trades against an account the manager does not know leave it alone
+	c.expect(book.processOrder(5, Side::Buy, OrderType::Limit, 4, 101, 0, {.account = 1}), "buys from the unchecked maker");
+	c.expect(b->drainTrades().size() == 1 && rm.position(1) == 4, "taker position updated");
+	c.expect(book.cancelOrder(1), "unchecked maker cancels");
+	c.expect(rm.openQty(0, Side::Buy) == 10 && rm.openQty(1, Side::Buy) == 0, "known accounts unchanged");
+}
+
+void checkThrottle(SelfCheck &c)
+{
+	// One message of credit; a TSC reading behind the last one must not
+	// refill the bucket
+	SessionThrottle throttle(1, 1, 1);
+	c.expect(throttle.admit(0, readTsc()), "burst admitted");
+	c.expect(!throttle.admit(0, 0), "clock behind the bucket refills nothing");
+
+	auto b = std::make_unique<CheckBook>();
+	Gateway gw(b->book, &throttle, &b->events);
+	b->book.processOrder(1, Side::Sell, OrderType::Limit, 10, 100, 0);
+	b->book.processOrder(2, Side::Buy, OrderType::Limit, 5, 100, 0);
+	b->drainEvents();
+	uint64_t now = b->book.getTimestamp();
+	c.expect(now > 0 && !gw.newOrder(0, 3, Side::Buy, OrderType::Limit, 10, 100, 0), "throttled");
+	auto events = b->drainEvents();
+	c.expect(events.size() == 1 && events[0].reason == RejectReason::Throttled && events[0].timestamp == now,
+			 "reject carries the engine clock");
+	c.expect(b->book.getTimestamp() == now && b->book.getRejectCount() == 0, "book state untouched");
+}
+
+void checkJournalFailure(SelfCheck &c)
+{
+	char path[] = "/tmp/matching_engine_checkXXXXXX";
+	int tmp = ::mkstemp(path);
+	JournalWriter journal;
+	c.expect(tmp >= 0 && journal.open(path), "journal opens");
+
+	// Swap /dev/full in under the writer's descriptor, found by inode, so
+	// its next write fails
+	struct stat target, st;
+	int journalFd = -1;
+	for (int fd = 0; fd < 1024 && journalFd < 0; ++fd)
+		if (fd != tmp && ::fstat(tmp, &target) == 0 && ::fstat(fd, &st) == 0 && st.st_dev == target.st_dev &&
+			st.st_ino == target.st_ino)
+			journalFd = fd;
+	int full = ::open("/dev/full", O_WRONLY);
+	c.expect(journalFd >= 0 && full >= 0 && ::dup2(full, journalFd) == journalFd, "writer descriptor replaced");
+
+	auto b = std::make_unique<CheckBook>();
+	Gateway gw(b->book, nullptr, &b->events);
+	gw.setJournal(&journal);
+	c.expect(gw.newOrder(0, 1, Side::Buy, OrderType::Limit, 10, 100, 0), "accepted before the failure");
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+	while (!journal.hasFailed() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::yield();
+	c.expect(journal.hasFailed(), "writer fails");
+	b->drainEvents();
+
+	c.expect(!gw.newOrder(0, 2, Side::Sell, OrderType::Limit, 10, 100, 0), "new order refused");
+	c.expect(!gw.cancel(0, 1), "cancel refused");
+	auto events = b->drainEvents();
+	c.expect(events.size() == 2 && events[0].reason == RejectReason::JournalFailed && events[0].orderId == 2 &&
+				 events[1].reason == RejectReason::JournalFailed && events[1].orderId == 1,
+			 "both rejected for the journal");
+	c.expect(b->drainTrades().empty() && b->book.findOrder(1) && !b->book.findOrder(2), "book untouched");
+	c.expect(gw.lastSequence() == 1, "no sequence numbers spent");
+
+	journal.close();
+	::close(full);
+	::close(tmp);
+	::unlink(path);
+}
+
+void checkConflatorResync(SelfCheck &c)
+{
+	// Two bid levels and one ask, then a gap; the snapshot lists only the
+	// 100 bid, so the 99 bid and the 101 ask must go out as deletes.
+	// Presized for two levels, so the index also grows on the way.
+	DepthConflator conflator(1, 2);
+	auto level = [](DepthMsgType type, Side side, int64_t price, uint64_t qty, uint64_t seq)
+	{ return DepthUpdate{type, side, 0, qty ? 1u : 0u, price, qty, seq, seq}; };
+	conflator.apply(level(DepthMsgType::Level, Side::Buy, 100, 10, 1));
+	conflator.apply(level(DepthMsgType::Level, Side::Buy, 99, 20, 2));
+	conflator.apply(level(DepthMsgType::Level, Side::Sell, 101, 30, 3));
+	std::vector<DepthUpdate> out;
+	auto sink = [&](const DepthUpdate &u)
+	{
+		out.push_back(u);
+		return true;
+	};
+	c.expect(conflator.flush(sink) == 3, "three levels published");
+
+	conflator.apply(level(DepthMsgType::Level, Side::Buy, 98, 5, 5)); // seq 4 lost
+	conflator.apply(DepthUpdate{DepthMsgType::SnapshotBegin, Side::Buy, 0, 5, 0, 0, 6, 6});
+	conflator.apply(level(DepthMsgType::Snapshot, Side::Buy, 100, 15, 7));
+	conflator.apply(DepthUpdate{DepthMsgType::SnapshotEnd, Side::Buy, 0, 0, 0, 0, 8, 8});
+	c.expect(conflator.gaps() == 1 && conflator.resyncs() == 1, "gap seen and resynced");
+
+	out.clear();
+	conflator.flush(sink);
+	auto sent = [&](Side side, int64_t price, uint64_t qty)
+	{ return std::ranges::count_if(out, [&](const DepthUpdate &u)
+								   { return u.side == side && u.price == price && u.qty == qty; }) == 1; };
+	c.expect(out.size() == 3 && sent(Side::Buy, 100, 15), "only the changed levels go out");
+	c.expect(sent(Side::Buy, 99, 0) && sent(Side::Sell, 101, 0), "unlisted levels deleted");
+	c.expect(std::ranges::none_of(out, [](const DepthUpdate &u)
+								  { return u.price == 98; }),
+			 "level that came and went between flushes never sent");
+}
+
+void checkSbeThroughGateway(SelfCheck &c)
+{
+	// Every decoded message, the mass cancel included, is sequenced, and
+	// the mass cancel survives the compact journal encoding
+	auto b = std::make_unique<CheckBook>();
+	Gateway gw(b->book);
+	SbeOrderDecoder decoder(gw, 0);
+	uint8_t wire[256], *p = wire;
+	uint8_t limit = static_cast<uint8_t>(OrderType::Limit);
+	p = encodeSbe<NewOrderMsg>(p, uint64_t{1}, int64_t{100}, int64_t{0}, 10u, 0u, 3u, uint8_t{0}, limit, uint8_t{0});
+	p = encodeSbe<NewOrderMsg>(p, uint64_t{2}, int64_t{105}, int64_t{0}, 10u, 0u, 3u, uint8_t{1}, limit, uint8_t{0});
+	p = encodeSbe<NewOrderMsg>(p, uint64_t{3}, int64_t{99}, int64_t{0}, 10u, 0u, 4u, uint8_t{0}, limit, uint8_t{0});
+	p = encodeSbe<MassCancelMsg>(p, 3u, uint8_t{1});
+	size_t len = static_cast<size_t>(p - wire);
+	c.expect(decoder.decode(wire, len) == len && decoder.rejectCount() == 0, "all messages accepted");
+	c.expect(gw.lastSequence() == 4, "all four sequenced");
+	c.expect(!b->book.findOrder(1) && b->book.findOrder(2) && b->book.findOrder(3), "only account 3's buys cancelled");
+
+	Command mc{};
+	mc.type = CommandType::MassCancel;
+	mc.account = 3;
+	mc.qty = 2;
+	CommandCodec enc, dec;
+	uint8_t buf[CommandCodec::MAX_BYTES];
+	uint8_t *end = enc.encode(buf, {9, mc});
+	JournalRecord r{};
+	c.expect(dec.decode(buf, end, r) == end && r.seq == 9 && r.cmd.type == CommandType::MassCancel && r.cmd.account == 3 &&
+				 r.cmd.qty == 2,
+			 "compact codec round trip");
+	c.expect(b->book.apply(r.cmd) && !b->book.findOrder(2) && b->book.findOrder(3), "replayed mass cancel applies");
+
+	// Order entry never carries auction control, even on the admin session:
+	// an unknown template is malformed, and the entry path refuses the type
+	gw.setAdminSession(0);
+	p = SbeHeader::put(wire, 0, 5, SbeHeader::SCHEMA_ID, SbeHeader::SCHEMA_VERSION);
+	c.expect(decoder.decode(wire, static_cast<size_t>(p - wire)) == SbeHeader::BLOCK_LENGTH && decoder.malformedCount() == 1,
+			 "unknown template malformed");
+	Command halt{};
+	halt.type = CommandType::StartAuction;
+	c.expect(!gw.submitOrderEntry(0, halt), "auction control refused on the entry path");
+	c.expect(b->book.getTradingState() == TradingState::Continuous && gw.lastSequence() == 4, "nothing sequenced");
+}
+
+void checkItchTruncated(SelfCheck &c)
+{
+	// Messages cut short under a length prefix that still covers the
+	// header must be refused without reading past the packet
+	ItchEncoder encoder(1);
+	const OrderFeedEvent events[] = {{OrderFeedType::Add, Side::Buy, 10, 1, 0, 100, 5},
+									 {OrderFeedType::Replace, Side::Buy, 10, 1, 2, 101, 6},
+									 {OrderFeedType::HiddenTrade, Side::Sell, 3, 0, 7, 100, 7}};
+	for (const OrderFeedEvent &e : events)
+	{
+		uint8_t full[64];
+		uint8_t *end = encoder.encode(encoder.beginPacket(full), e);
+		encoder.endPacket();
+		size_t msgLen = static_cast<size_t>(end - full) - ItchEncoder::PACKET_HEADER - 2;
+		size_t n = 0;
+		auto count = [&](uint64_t, const OrderFeedEvent &)
+		{ ++n; };
+		c.expect(ItchDecoder::decodePacket(full, end, count) == end && n == 1, "whole message decodes");
+
+		// Shorten the message to just its header; the heap copy ends there
+		for (size_t len : {size_t{11}, msgLen - 1})
+		{
+			size_t bytes = ItchEncoder::PACKET_HEADER + 2 + len;
+			auto cut = std::make_unique<uint8_t[]>(bytes);
+			std::memcpy(cut.get(), full, bytes);
+			cut[ItchEncoder::PACKET_HEADER] = static_cast<uint8_t>(len >> 8);
+			cut[ItchEncoder::PACKET_HEADER + 1] = static_cast<uint8_t>(len);
+			n = 0;
+			c.expect(!ItchDecoder::decodePacket(cut.get(), cut.get() + bytes, count) && n == 0, "truncated message refused");
+		}
+	}
+}
+
+void checkAuctionControl(SelfCheck &c)
+{
+	// Only the admin session may halt or uncross; it is throttled like
+	// everyone else
+	SessionThrottle throttle(3, 1, 1);
+	auto b = std::make_unique<CheckBook>();
+	Gateway gw(b->book, &throttle, &b->events);
+	c.expect(!gw.startAuction(0), "no admin session configured");
+	gw.setAdminSession(2);
+	c.expect(!gw.startAuction(1), "client session refused");
+	auto events = b->drainEvents();
+	c.expect(events.size() == 2 && events[0].reason == RejectReason::Unauthorized && events[1].reason == RejectReason::Unauthorized,
+			 "rejected as unauthorized");
+	c.expect(b->book.getTradingState() == TradingState::Continuous && gw.lastSequence() == 0, "nothing sequenced");
+
+	c.expect(gw.startAuction(2) && b->book.getTradingState() == TradingState::Auction, "admin halts");
+	c.expect(!gw.endAuction(2) && b->book.getTradingState() == TradingState::Auction, "admin throttled past its burst");
+	events = b->drainEvents();
+	c.expect(!events.empty() && events.back().reason == RejectReason::Throttled, "throttle reject");
+}
+
+void checkQuoteRejects(SelfCheck &c)
+{
+	auto b = std::make_unique<CheckBook>();
+	OrderBook &book = b->book;
+	book.processOrder(1, Side::Buy, OrderType::Limit, 10, 100, 0);
+	book.processOrder(2, Side::Sell, OrderType::Limit, 10, 105, 0);
+	book.processOrder(3, Side::Sell, OrderType::Stop, 10, 90, 95);
+	b->drainEvents();
+
+	auto rejectedWhole = [&](RejectReason reason, const char *what)
+	{
+		auto events = b->drainEvents();
+		c.expect(events.size() == 2 && events[0].type == EventType::Rejected && events[0].reason == reason &&
+					 events[1].type == EventType::Rejected && events[1].reason == reason,
+				 what);
+		const Order *bid = book.findOrder(1), *ask = book.findOrder(2);
+		c.expect(bid && bid->price == 100 && bid->shares == 10 && ask && ask->price == 105 && ask->shares == 10,
+				 "neither leg applied");
+	};
+	c.expect(!book.massQuote({1, 10, 104}, {2, 10, 103}), "crossed quote refused");
+	rejectedWhole(RejectReason::InvalidQuote, "crossed quote reported for both legs");
+	c.expect(!book.massQuote({1, 20, 101}, {1, 20, 106}), "one id for both legs refused");
+	rejectedWhole(RejectReason::InvalidQuote, "shared id reported");
+	c.expect(!book.massQuote({2, 20, 101}, {1, 20, 106}), "legs on the wrong sides refused");
+	rejectedWhole(RejectReason::InvalidQuote, "wrong-side legs reported");
+	c.expect(!book.massQuote({1, 20, 101}, {3, 20, 106}), "new leg onto a stop id refused");
+	rejectedWhole(RejectReason::DuplicateId, "stop id collision reported");
+	c.expect(book.getStopOrderCount() == 1 && book.getOrderCount() == 2, "book unchanged");
+	c.expect(book.massQuote({1, 20, 101}, {2, 20, 106}) && book.findOrder(1)->price == 101 && book.findOrder(2)->price == 106,
+			 "a valid quote still applies");
+}
+
+void checkAnalyticsIntervals(SelfCheck &c)
+{
+	auto refused = [](std::vector<uint64_t> barTicks)
+	{
+		try
+		{
+			TradeAnalytics a(1, std::move(barTicks));
+		}
+		catch (const std::invalid_argument &)
+		{
+			return true;
+		}
+		return false;
+	};
+	c.expect(refused({100, 0}), "zero interval refused");
+	c.expect(refused({1, 10, 100, 1000, 10000}), "more than MAX_INTERVALS refused");
+	c.expect(!refused({1, 10, 100, 1000}), "MAX_INTERVALS accepted");
+
+	TradeAnalytics a(1, {10});
+	a.add(0, TradeReport{1, 2, 5, 100, 25});
+	a.publish();
+	TradeStats s = a.read(0);
+	c.expect(s.volume == 5 && s.current[0].start == 20, "bar cut on the interval");
+}
+
+int runChecks()
+{
+	SelfCheck c;
+	c.run("massQuote triggering stops", [&]
+		  { checkMassQuoteTriggeringStops(c); });
+	c.run("replace onto a live id", [&]
+		  { checkReplaceCollisions(c); });
+	c.run("quote rejects", [&]
+		  { checkQuoteRejects(c); });
+	c.run("breaker halt mid-sweep", [&]
+		  { checkBreakerHaltMidSweep(c); });
+	c.run("snapshot price window", [&]
+		  { checkSnapshotPriceWindow(c); });
+	c.run("risk attach seeds", [&]
+		  { checkRiskAttachSeeds(c); });
+	c.run("risk rejects", [&]
+		  { checkRiskRejects(c); });
+	c.run("session throttle", [&]
+		  { checkThrottle(c); });
+	c.run("journal failure", [&]
+		  { checkJournalFailure(c); });
+	c.run("conflator resync", [&]
+		  { checkConflatorResync(c); });
+	c.run("SBE entry through the gateway", [&]
+		  { checkSbeThroughGateway(c); });
+	c.run("truncated feed messages", [&]
+		  { checkItchTruncated(c); });
+	c.run("auction control", [&]
+		  { checkAuctionControl(c); });
+	c.run("analytics intervals", [&]
+		  { checkAnalyticsIntervals(c); });
+	return c.finish();
+}
+
+int usage()
+{
+	std::cerr << "usage: matching_engine                        run the benchmark suite\n"
+			  << "       matching_engine record <journal> [n]     journal a seeded session of n commands\n"
+			  << "       matching_engine replay <journal> [--snapshot file] [--pool n] [--every n] [--expect hash]\n"
+			  << "       matching_engine compact <journal> <out>  re-encode a journal as a compact log\n"
+			  << "       matching_engine standby <socket> [--pool n] [--snapshot file]\n"
+			  << "       matching_engine check                    run the self checks\n";
+	return 2;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 2 && std::strcmp(argv[1], "check") == 0)
+		return runChecks();
+	if (argc >= 3 && std::strcmp(argv[1], "record") == 0)
+		return runRecord(argv[2], argc >= 4 ? std::atoi(argv[3]) : 1000000);
+	if (argc == 4 && std::strcmp(argv[1], "compact") == 0)
+	{
+		int64_t n = compactJournal(argv[2], argv[3]);
+		if (n < 0)
+		{
+			std::cerr << "Cannot compact " << argv[2] << " into " << argv[3] << std::endl;
+			return 2;
+		}
+		std::cout << "Records: " << n << ", " << std::filesystem::file_size(argv[2]) / 1e6 << " MB -> "
+				  << std::filesystem::file_size(argv[3]) / 1e6 << " MB" << std::endl;
+		return 0;
+	}
+	if (argc >= 3 && std::strcmp(argv[1], "standby") == 0)
+	{
+		size_t pool = 3000000;
+		const char *snapshot = nullptr;
+		if ((argc - 3) % 2 != 0)
+			return usage();
+		for (int i = 3; i + 1 < argc; i += 2)
+		{
+			if (std::strcmp(argv[i], "--pool") == 0)
+				pool = std::strtoull(argv[i + 1], nullptr, 10);
+			else if (std::strcmp(argv[i], "--snapshot") == 0)
+				snapshot = argv[i + 1];
+			else
+				return usage();
+		}
+		return runStandby(argv[2], pool, snapshot);
+	}
+	if (argc >= 3 && std::strcmp(argv[1], "replay") == 0)
+	{
+		ReplayOptions opt;
+		opt.journal = argv[2];
+		if ((argc - 3) % 2 != 0)
+			return usage();
+		for (int i = 3; i + 1 < argc; i += 2)
+		{
+			if (std::strcmp(argv[i], "--snapshot") == 0)
+				opt.snapshot = argv[i + 1];
+			else if (std::strcmp(argv[i], "--pool") == 0)
+				opt.pool = std::strtoull(argv[i + 1], nullptr, 10);
+			else if (std::strcmp(argv[i], "--every") == 0)
+				opt.every = std::strtoull(argv[i + 1], nullptr, 10);
+			else if (std::strcmp(argv[i], "--expect") == 0)
+			{
+				opt.hasExpect = true;
+				opt.expect = std::strtoull(argv[i + 1], nullptr, 16);
+			}
+			else
+				return usage();
+		}
+		return runReplay(opt);
+	}
+	if (argc > 1)
+		return usage();
+
+	const int TEST_SIZE = 1000000;
+	MemoryManager mm(TEST_SIZE * 3);
+	RingBuffer<65536> tradeBuffer;
+
+	std::atomic<bool> running{true};
+	std::atomic<uint64_t> totalTrades{0};
+	std::atomic<ReleaseGate *> releaseGate{nullptr};
+	// Consumer loop passes; a pass that began after releaseGate was cleared
+	// no longer touches the old gate
+	std::atomic<uint64_t> consumerPasses{0};
+
+	// The consumer archives every trade it releases to a compact trade log
+	std::string tradeLogPath = (std::filesystem::temp_directory_path() / "matching_engine_bench.trades").string();
+	TradeLogWriter tradeLog;
+	bool logging = tradeLog.open(tradeLogPath.c_str());
+	StreamHash loggedHash;
+
+	// It also keeps bars at three intervals of the engine clock and a
+	// running VWAP, published once per drained batch
+	TradeAnalytics analytics(1, {1000, 100000, 10000000});
+
+	std::thread consumer([&]()
+						 {
+        TradeReport t;
+        auto release = [&] {
+            totalTrades.fetch_add(1, std::memory_order_relaxed);
+            analytics.add(0, t);
+            if (logging) {
+                tradeLog.append(t);
+                loggedHash.add(t);
+            }
+        };
+        while (running.load(std::memory_order_relaxed)) {
+            // With a release gate installed, only durable executions go out
+            ReleaseGate *gate = releaseGate.load();
+            int n = 0;
+            while (n < 256 && !(gate && tradeBuffer.readPosition() >= gate->releasablePosition()) && tradeBuffer.pop(t)) {
+                release();
+                ++n;
+            }
+            if (n)
+                analytics.publish();
+            else
+                std::this_thread::yield();
+            consumerPasses.fetch_add(1);
+        }
+        while (tradeBuffer.pop(t))
+            release();
+        analytics.publish(); });
+
+	OrderBook engine(mm, tradeBuffer);
+	OrderGenerator generator(42, 300.0, 50.0);
+
+	std::cout << "Starting Fixed Matching Engine..." << std::endl;
+
+	runBenchmark("Test 1: Statistical Orders", engine, [&](int n)
+				 {
+        for (int i = 0; i < 10000; ++i) {
+            auto order = generator.generateOrder(false);
+            engine.processOrder(order.id, order.side, OrderType::Limit, 
+                              order.shares, order.price, 0);
+        }
+
+        for (int i = 0; i < n; ++i) {
+            auto order = generator.generateOrder(true);
+            engine.processOrder(order.id, order.side, order.type,
+                              order.shares, order.price, order.stopPrice);
+            
+            if (i > 100 && i % 7 == 0)
+                engine.cancelOrder(order.id - (rand() % 50 + 10));
+        } }, TEST_SIZE, tradeBuffer);
+
+	std::vector<uint64_t> activeOrders;
+	runBenchmark("Test 2: Order Modification", engine, [&](int n)
+				 {
+        uint64_t baseId = generator.getNextId();
+        
+        for (int i = 0; i < n; ++i) {
+            if (i % 3 == 0) {
+                engine.processOrder(baseId + i, Side::Buy, OrderType::Limit, 10, 300 + (i % 10), 0);
+                activeOrders.push_back(baseId + i);
+            } else if (i % 3 == 1 && !activeOrders.empty()) {
+                engine.modifyOrder(activeOrders[i % activeOrders.size()], 15, 300 + (i % 15));
+            } else if (!activeOrders.empty()) {
+                engine.cancelOrder(activeOrders.back());
+                activeOrders.pop_back();
+            }
+        } }, TEST_SIZE, tradeBuffer);
+
+	runBenchmark("Test 3: Mixed Workload", engine, [&](int n)
+				 {
+        for (int i = 0; i < n; ++i) {
+            auto order = generator.generateOrder(true);
+            
+            double r = static_cast<double>(rand()) / RAND_MAX;
+            if (r < 0.75) {
+                engine.processOrder(order.id, order.side, order.type,
+                                  order.shares, order.price, order.stopPrice);
+            } else if (r < 0.90) {
+                engine.cancelOrder(order.id - 100);
+            } else {
+                engine.modifyOrder(order.id - 50, order.shares + 5, order.price + 1);
+            }
+        } }, TEST_SIZE, tradeBuffer);
+
+	runBenchmark("Test 4: Quantity Amendments", engine, [&](int n)
+				 {
+        const uint64_t baseId = 2000000000ULL;
+        const int resting = 1000;
+        for (int i = 0; i < resting; ++i)
+            engine.processOrder(baseId + i, Side::Buy, OrderType::Limit, 50, 50 + (i % 20), 0);
+
+        // Alternate passes grow (requeue) and shrink (in place) every order
+        for (int i = 0; i < n; ++i) {
+            int slot = i % resting;
+            engine.modifyOrder(baseId + slot, ((i / resting) & 1) ? 40 : 60, 50 + (slot % 20));
+        }
+
+        for (int i = 0; i < resting; ++i)
+            engine.cancelOrder(baseId + i); }, TEST_SIZE, tradeBuffer);
+
+	runBenchmark("Test 5: Two-Sided Quote Updates", engine, [&](int n)
+				 {
+        const uint64_t baseId = 3000000000ULL;
+        const int makers = 500;
+
+        // Bids well below and asks well above the resting book, so updates
+        // exercise both same-price amendments and level moves
+        for (int i = 0; i < n; ++i) {
+            int m = i % makers;
+            int64_t shift = (i / makers) % 4;
+            uint32_t qty = 20 + ((i / makers) % 3) * 10;
+            engine.massQuote({baseId + 2 * m, qty, 40 + (m % 10) + shift / 2},
+                             {baseId + 2 * m + 1, qty, 1000 + (m % 10) + shift / 2});
+        }
+
+        for (int m = 0; m < makers; ++m)
+            engine.massQuote({baseId + 2 * m, 0, 0}, {baseId + 2 * m + 1, 0, 1}); }, TEST_SIZE, tradeBuffer);
+
+	runBenchmark("Test 6: Statistical Orders with Resting Pegs", engine, [&](int n)
+				 {
+        const uint64_t baseId = 4000000000ULL;
+        const int pegged = 10000;
+        const PegType types[] = {PegType::Primary, PegType::Market, PegType::Mid};
+        for (int i = 0; i < pegged; ++i)
+            engine.processPeggedOrder(baseId + i, (i & 1) ? Side::Sell : Side::Buy,
+                                      types[(i / 2) % 3], 20, (i & 1) ? (i / 6) % 3 : -((i / 6) % 3));
+
+        for (int i = 0; i < n; ++i) {
+            auto order = generator.generateOrder(true);
+            engine.processOrder(order.id, order.side, order.type,
+                              order.shares, order.price, order.stopPrice);
+        }
+
+        for (int i = 0; i < pegged; ++i)
+            engine.cancelOrder(baseId + i); }, TEST_SIZE, tradeBuffer);
+
+	runBenchmark("Test 7: Statistical Orders with Price Bands", engine, [&](int n)
+				 {
+        // +/-20% band on the last trade, collared market orders, size caps
+        engine.setPriceBands({2000, true, 100, 100 * 400});
+        for (int i = 0; i < n; ++i) {
+            auto order = generator.generateOrder(true);
+            engine.processOrder(order.id, order.side, order.type,
+                              order.shares, order.price, order.stopPrice);
+        }
+        engine.setPriceBands({});
+        std::cout << "Rejected by Pre-Trade Checks: " << engine.getRejectCount() << std::endl; }, TEST_SIZE, tradeBuffer);
+
+	runBenchmark("Test 8: Statistical Orders with Circuit Breaker", engine, [&](int n)
+				 {
+        // 15% move within 200 clock ticks halts; each auction collects 500
+        // orders before it is uncrossed
+        engine.setCircuitBreaker({1500, 200});
+        int auctionOrders = 0;
+        for (int i = 0; i < n; ++i) {
+            auto order = generator.generateOrder(true);
+            engine.processOrder(order.id, order.side, order.type,
+                              order.shares, order.price, order.stopPrice);
+            if (engine.getTradingState() == TradingState::Auction && ++auctionOrders == 500) {
+                engine.endAuction();
+                auctionOrders = 0;
+            }
+        }
+        engine.endAuction();
+        engine.setCircuitBreaker({});
+        std::cout << "Circuit Breaker Halts: " << engine.getHaltCount() << std::endl; }, TEST_SIZE, tradeBuffer);
+
+	// Same seeded flow into two fresh books, without and with the risk layer
+	const int ACCOUNTS = 10000;
+	auto riskFlow = [&](OrderBook &book, int n)
+	{
+		OrderGenerator flow(7, 300.0, 50.0);
+		for (int i = 0; i < n; ++i) {
+			auto order = flow.generateOrder(true);
+			book.processOrder(order.id, order.side, order.type, order.shares, order.price, order.stopPrice,
+							  {0, false, static_cast<uint32_t>(order.id % ACCOUNTS)});
+		}
+	};
+	double plainSecs, riskSecs;
+	{
+		MemoryManager riskMm(TEST_SIZE);
+		OrderBook plainBook(riskMm, tradeBuffer);
+		plainSecs = runBenchmark("Test 9a: Statistical Orders, No Risk Layer", plainBook, [&](int n)
+								 { riskFlow(plainBook, n); }, TEST_SIZE, tradeBuffer);
+	}
+	{
+		MemoryManager riskMm(TEST_SIZE);
+		RiskManager riskManager(ACCOUNTS);
+		for (uint32_t a = 0; a < ACCOUNTS; ++a)
+			riskManager.setLimits(a, 5000, 5000);
+		OrderBook riskBook(riskMm, tradeBuffer);
+		riskBook.setRiskManager(&riskManager);
+		riskSecs = runBenchmark("Test 9b: Statistical Orders, 10k Risk Accounts", riskBook, [&](int n)
+								{ riskFlow(riskBook, n); }, TEST_SIZE, tradeBuffer);
+		std::cout << "Rejected by Risk Limits: " << riskBook.getRejectCount() << std::endl;
+	}
+	std::cout << "Risk Layer Overhead: " << (riskSecs - plainSecs) * 1e9 / TEST_SIZE << " ns/order" << std::endl;
+
+	{
+		// One runaway session sends half of all traffic; 99 others share the rest.
+		// Every session is limited to 20k msgs/sec with a burst of 100.
+		const uint32_t SESSIONS = 100;
+		SessionThrottle throttle(SESSIONS, 20000, 100);
+		Gateway gateway(engine, &throttle);
+		runBenchmark("Test 10: Throttled Ingress with a Flooding Session", engine, [&](int n)
+					 {
+            for (int i = 0; i < n; ++i) {
+                auto order = generator.generateOrder(true);
+                uint32_t session = (i & 1) ? 0 : 1 + static_cast<uint32_t>(order.id % (SESSIONS - 1));
+                gateway.newOrder(session, order.id, order.side, order.type,
+                                 order.shares, order.price, order.stopPrice);
+            } }, TEST_SIZE, tradeBuffer);
+		std::cout << "Flooding Session Admitted/Rejected: " << throttle.admitted(0) << "/" << throttle.rejected(0) << std::endl;
+		std::cout << "All Sessions Rejected: " << throttle.totalRejected() << std::endl;
+	}
+
+	// Every command sequenced, journaled ahead of matching and group-committed;
+	// the consumer only releases trades whose commands are durable
+	std::string journalPath = (std::filesystem::temp_directory_path() / "matching_engine_bench.journal").string();
+	JournalWriter journal({200, true, 4096});
+	if (journal.open(journalPath.c_str()))
+	{
+		ReleaseGate gate(journal, tradeBuffer);
+		Gateway gateway(engine);
+		gateway.setJournal(&journal, &gate);
+		releaseGate.store(&gate, std::memory_order_release);
+
+		double secs = runBenchmark("Test 11: Journaled Ingress with Group Commit", engine, [&](int n)
+								   {
+            for (int i = 0; i < n; ++i) {
+                auto order = generator.generateOrder(true);
+                gateway.newOrder(0, order.id, order.side, order.type,
+                                 order.shares, order.price, order.stopPrice);
+            } }, TEST_SIZE, tradeBuffer);
+
+		uint64_t lastSeq = gateway.lastSequence();
+		while (journal.durableSeq() < lastSeq && !journal.hasFailed())
+			std::this_thread::yield();
+		// The gate lives on this stack: wait out the consumer's current pass,
+		// which may still hold it, before it goes out of scope
+		releaseGate.store(nullptr);
+		uint64_t pass = consumerPasses.load();
+		while (consumerPasses.load() <= pass)
+			std::this_thread::yield();
+		journal.close();
+
+		std::cout << "Journal Records Durable: " << journal.durableSeq() << std::endl;
+		std::cout << "Group Commits (fdatasync): " << journal.syncCount() << std::endl;
+		std::cout << "Journal Write Rate: " << journal.bytesWritten() / secs / 1e6 << " MB/s" << std::endl;
+
+		std::string compactPath = journalPath + ".compact";
+		if (compactJournal(journalPath.c_str(), compactPath.c_str()) >= 0)
+			std::cout << "Journal Archived Compact: " << std::filesystem::file_size(journalPath) / 1e6 << " MB -> "
+					  << std::filesystem::file_size(compactPath) / 1e6 << " MB" << std::endl;
+		std::remove(compactPath.c_str());
+		std::remove(journalPath.c_str());
+	}
+
+	// The writer alone: one million 72-byte records per backend
+	runJournalBenchmark("Test 12a: Journal Writer, write() + fdatasync", {200, true, 4096}, journalPath, TEST_SIZE);
+	runJournalBenchmark("Test 12b: Journal Writer, io_uring", {200, true, 4096, JournalBackend::IoUring}, journalPath, TEST_SIZE);
+	runJournalBenchmark("Test 12c: Journal Writer, io_uring + O_DIRECT", {200, true, 4096, JournalBackend::IoUring, true}, journalPath, TEST_SIZE);
+
+	{
+		// Two million resting orders, a snapshot, then a journaled tail of
+		// statistical flow; restart loads the snapshot and replays the tail
+		std::cout << "\n=== Test 13: Snapshot and Restart with 2M Resting Orders ===" << std::endl;
+		using Clock = std::chrono::steady_clock;
+		std::string snapshotPath = (std::filesystem::temp_directory_path() / "matching_engine_bench.snapshot").string();
+		const int RESTING = 2000000, TAIL = 100000;
+		auto liveTrades = std::make_unique<RingBuffer<65536>>();
+		auto replayTrades = std::make_unique<RingBuffer<65536>>();
+
+		MemoryManager liveMm(TEST_SIZE * 3);
+		OrderBook live(liveMm, *liveTrades);
+		fillRestingBook(live, RESTING, 11);
+
+		auto t0 = Clock::now();
+		bool saved = live.saveSnapshot(snapshotPath.c_str(), 0);
+		std::chrono::duration<double> saveSecs = Clock::now() - t0;
+
+		JournalWriter tailJournal({200, true, 4096});
+		Gateway liveGateway(live);
+		if (saved && tailJournal.open(journalPath.c_str()))
+		{
+			liveGateway.setJournal(&tailJournal);
+			for (int i = 0; i < TAIL; ++i)
+			{
+				auto order = generator.generateOrder(true);
+				liveGateway.newOrder(0, order.id, order.side, order.type, order.shares, order.price, order.stopPrice);
+			}
+			tailJournal.close();
+
+			MemoryManager restartMm(TEST_SIZE * 3);
+			OrderBook restarted(restartMm, *replayTrades);
+			uint64_t snapshotSeq = 0;
+			t0 = Clock::now();
+			bool loaded = restarted.loadSnapshot(snapshotPath.c_str(), snapshotSeq);
+			std::chrono::duration<double> loadSecs = Clock::now() - t0;
+			t0 = Clock::now();
+			uint64_t replayed = replayJournal(restarted, journalPath.c_str(), snapshotSeq);
+			std::chrono::duration<double> replaySecs = Clock::now() - t0;
+
+			std::cout << "Snapshot Size: " << std::filesystem::file_size(snapshotPath) / 1e6 << " MB" << std::endl;
+			std::cout << "Snapshot Save: " << saveSecs.count() * 1e3 << " ms" << std::endl;
+			std::cout << "Snapshot Load: " << loadSecs.count() * 1e3 << " ms" << (loaded ? "" : " (failed)") << std::endl;
+			std::cout << "Journal Tail Replay: " << replayed - snapshotSeq << " commands in " << replaySecs.count() * 1e3 << " ms" << std::endl;
+			std::cout << "Live/Restarted Orders: " << live.getOrderCount() << "/" << restarted.getOrderCount()
+					  << ", Stops: " << live.getStopOrderCount() << "/" << restarted.getStopOrderCount() << std::endl;
+		}
+		else
+			std::cout << "Snapshot or journal file could not be written" << std::endl;
+		std::remove(snapshotPath.c_str());
+		std::remove(journalPath.c_str());
+	}
+
+	{
+		// Statistical flow against a book resting two million orders from a
+		// 3M-order pool, first undisturbed, then while a forked child
+		// serializes the book
+		std::cout << "\n=== Test 14: Matching Latency during a Fork Snapshot (3M-Order Pool) ===" << std::endl;
+		using Clock = std::chrono::steady_clock;
+		std::string snapshotPath = (std::filesystem::temp_directory_path() / "matching_engine_bench.snapshot").string();
+		const int RESTING = 2000000, FLOW = 200000;
+		auto forkTrades = std::make_unique<RingBuffer<65536>>();
+		MemoryManager forkMm(TEST_SIZE * 3);
+		OrderBook book(forkMm, *forkTrades);
+		fillRestingBook(book, RESTING, 13);
+
+		std::vector<uint64_t> ticks;
+		ticks.reserve(FLOW);
+		auto flow = [&]
+		{
+			ticks.clear();
+			TradeReport t;
+			for (int i = 0; i < FLOW; ++i)
+			{
+				auto order = generator.generateOrder(true);
+				uint64_t c0 = readTsc();
+				book.processOrder(order.id, order.side, order.type, order.shares, order.price, order.stopPrice);
+				ticks.push_back(readTsc() - c0);
+				while (forkTrades->pop(t))
+					;
+			}
+		};
+
+		flow();
+		printLatency("No Snapshot", ticks);
+
+		SnapshotFork snapshot;
+		auto t0 = Clock::now();
+		bool started = snapshot.start(book, snapshotPath.c_str(), 0);
+		std::chrono::duration<double, std::milli> forkMs = Clock::now() - t0;
+		flow();
+		bool overlapped = snapshot.running();
+		bool written = snapshot.wait();
+		std::chrono::duration<double, std::milli> totalMs = Clock::now() - t0;
+		printLatency("During Snapshot", ticks);
+		std::cout << "fork() Pause: " << forkMs.count() << " ms" << (started ? "" : " (fork failed)") << std::endl;
+		std::cout << "Snapshot Complete after: " << totalMs.count() << " ms" << (written ? "" : " (failed)")
+				  << (overlapped ? ", outlasted the flow" : "") << std::endl;
+		std::remove(snapshotPath.c_str());
+	}
+
+	{
+		// The same two million resting orders in pools mapped from a file:
+		// persist, unmap, then reattach the region in place
+		std::cout << "\n=== Test 15: Memory-Mapped Book Persist and Reattach (3M-Order Pool) ===" << std::endl;
+		using Clock = std::chrono::steady_clock;
+		std::string regionPath = (std::filesystem::temp_directory_path() / "matching_engine_bench.book").string();
+		auto regionTrades = std::make_unique<RingBuffer<65536>>();
+		size_t liveOrders = 0;
+		bool persisted = false;
+		std::chrono::duration<double, std::milli> persistMs{};
+		{
+			MemoryManager regionMm;
+			if (regionMm.createRegion(regionPath.c_str(), TEST_SIZE * 3))
+			{
+				OrderBook book(regionMm, *regionTrades);
+				fillRestingBook(book, 2000000, 17);
+				liveOrders = book.getOrderCount();
+				auto t0 = Clock::now();
+				persisted = book.persist(0);
+				persistMs = Clock::now() - t0;
+			}
+		}
+
+		if (persisted)
+		{
+			auto t0 = Clock::now();
+			MemoryManager attachedMm;
+			OrderBook attached(attachedMm, *regionTrades);
+			uint64_t seq = 0;
+			bool ok = attachedMm.attachRegion(regionPath.c_str()) && attached.attach(seq);
+			std::chrono::duration<double, std::milli> attachMs = Clock::now() - t0;
 
-				tradeBuffer.push({taker->id, maker->id, traded, best->price, timestampCounter++});
-				lastExecutedPrice = best->price;
+			std::cout << "Region Size: " << std::filesystem::file_size(regionPath) / 1e6 << " MB" << std::endl;
+			std::cout << "Persist (msync): " << persistMs.count() << " ms" << std::endl;
+			std::cout << "Reattach: " << attachMs.count() << " ms" << (ok ? "" : " (failed)") << std::endl;
+			std::cout << "Live/Reattached Orders: " << liveOrders << "/" << attached.getOrderCount() << std::endl;
+		}
+		else
+			std::cout << "Region file could not be written" << std::endl;
+		std::remove(regionPath.c_str());
+	}
 
-				taker->shares -= traded;
-				maker->shares -= traded;
+	running.store(false, std::memory_order_relaxed);
+	consumer.join();
 
-				if (maker->shares == 0)
-				{
-					best->head = maker->next;
-					if (best->head)
-						best->head->prev = nullptr;
-					else
-						best->tail = nullptr;
-					orderMap.erase(maker->id);
-					mm.recycleOrder(maker);
-					maker = best->head;
-				}
-				else
-					break;
+	if (logging)
+	{
+		// Everything the consumer released, read back in full and then by
+		// random seeks on the timestamp index
+		std::cout << "\n=== Test 16: Compact Trade Log Written by the Consumer ===" << std::endl;
+		using Clock = std::chrono::steady_clock;
+		bool closed = tradeLog.close();
+		uint64_t logged = tradeLog.recordCount();
+		double compactBytes = static_cast<double>(tradeLog.bytesWritten());
+
+		TradeLogReader reader;
+		StreamHash readHash;
+		uint64_t readBack = 0, lastTimestamp = 0, readVolume = 0;
+		int64_t readNotional = 0;
+		double decodeSecs = 0, encodeSecs = 0, seekUs = 0;
+		std::vector<TradeReport> sample;
+		if (closed && reader.open(tradeLogPath.c_str()))
+		{
+			TradeReport t;
+			auto t0 = Clock::now();
+			while (reader.next(t))
+			{
+				readHash.add(t);
+				lastTimestamp = t.timestamp;
+				readVolume += t.qty;
+				readNotional += t.price * static_cast<int64_t>(t.qty);
+				++readBack;
 			}
+			decodeSecs = std::chrono::duration<double>(Clock::now() - t0).count();
 
-			if (!best->head)
+			// The encoder on its own, over the first million logged trades
+			reader.seek(0);
+			while (sample.size() < static_cast<size_t>(TEST_SIZE) && reader.next(t))
+				sample.push_back(t);
+			std::string copyPath = tradeLogPath + ".copy";
+			TradeLogWriter copy;
+			if (copy.open(copyPath.c_str()))
 			{
-				if (side == Side::Buy)
-					sellRoot = removeLimit(sellRoot, best->price);
-				else
-					buyRoot = removeLimit(buyRoot, best->price);
+				t0 = Clock::now();
+				for (const TradeReport &s : sample)
+					copy.append(s);
+				copy.close();
+				encodeSecs = std::chrono::duration<double>(Clock::now() - t0).count();
 			}
+			std::remove(copyPath.c_str());
+
+			const int SEEKS = 1000;
+			std::mt19937_64 rng(5);
+			t0 = Clock::now();
+			for (int i = 0; i < SEEKS && lastTimestamp > 0; ++i)
+				if (reader.seek(rng() % lastTimestamp))
+					reader.next(t);
+			seekUs = std::chrono::duration<double, std::micro>(Clock::now() - t0).count() / SEEKS;
 		}
 
-		// Check stops ONCE after all matching completes
-		if (checkStops && lastExecutedPrice > 0)
-			checkStopOrders(lastExecutedPrice, side, triggeredStops);
+		std::cout << "Trades Logged: " << logged << " in " << reader.blockCount() << " blocks" << std::endl;
+		std::cout << "Raw/Compact Size: " << logged * sizeof(TradeReport) / 1e6 << "/" << compactBytes / 1e6 << " MB ("
+				  << logged * sizeof(TradeReport) / std::max(compactBytes, 1.0) << "x, "
+				  << compactBytes / std::max<uint64_t>(logged, 1) << " bytes/trade)" << std::endl;
+		std::cout << "Encode Cost: " << encodeSecs * 1e9 / std::max<size_t>(sample.size(), 1) << " ns/trade" << std::endl;
+		std::cout << "Decode Rate: " << readBack / std::max(decodeSecs, 1e-9) / 1e6 << " Million Trades/s" << std::endl;
+		std::cout << "Random Seek: " << seekUs << " us" << std::endl;
+		std::cout << "Read Back: " << (readBack == logged && readHash.value() == loggedHash.value() ? "identical" : "MISMATCH")
+				  << std::endl;
+		TradeStats live = analytics.read(0);
+		std::cout << "Consumer Analytics: VWAP " << live.vwap() << " over " << live.volume << " shares, "
+				  << (live.trades == readBack && live.volume == readVolume && live.notional == readNotional ? "matches the log" : "MISMATCH")
+				  << std::endl;
+		std::remove(tradeLogPath.c_str());
+	}
 
-		if (taker->shares > 0 && type == OrderType::Limit)
+	{
+		// A standby process, started from this binary, mirrors a fresh book
+		// fed the mixed workload through a Gateway. At the end both sides
+		// snapshot their books and the files are compared byte for byte.
+		std::cout << "\n=== Test 17: Hot Standby Replication under Full Load ===" << std::endl;
+		using Clock = std::chrono::steady_clock;
+		auto tmp = std::filesystem::temp_directory_path();
+		std::string socketPath = (tmp / "matching_engine_bench.sock").string();
+		std::string primarySnapshot = (tmp / "matching_engine_bench.primary").string();
+		std::string standbySnapshot = (tmp / "matching_engine_bench.standby").string();
+		std::string pool = std::to_string(TEST_SIZE * 3);
+
+		int listenFd = listenUnix(socketPath.c_str());
+		pid_t pid = listenFd >= 0 ? fork() : -1;
+		if (pid == 0)
 		{
-			Limit *L = nullptr;
-			if (side == Side::Buy)
-				buyRoot = insert(buyRoot, price, L);
-			else
-				sellRoot = insert(sellRoot, price, L);
+			execlp(argv[0], argv[0], "standby", socketPath.c_str(), "--pool", pool.c_str(),
+				   "--snapshot", standbySnapshot.c_str(), static_cast<char *>(nullptr));
+			_exit(127);
+		}
+		int fd = pid > 0 ? acceptUnix(listenFd, 5000) : -1;
+		if (listenFd >= 0)
+		{
+			::close(listenFd);
+			::unlink(socketPath.c_str());
+		}
 
-			if (!L)
-				return;
+		ReplicationPublisher publisher;
+		if (publisher.start(fd))
+		{
+			auto primaryTrades = std::make_unique<RingBuffer<65536>>();
+			MemoryManager primaryMm(TEST_SIZE * 3);
+			OrderBook primary(primaryMm, *primaryTrades);
+			Gateway gateway(primary);
+			gateway.setReplica(&publisher);
+			OrderGenerator flow(99, 300.0, 50.0);
+			std::mt19937 rng(99);
+			TradeReport t;
 
-			if (!L->head)
-				L->head = L->tail = taker;
-			else
+			auto t0 = Clock::now();
+			for (int i = 0; i < TEST_SIZE; ++i)
 			{
-				L->tail->next = taker;
-				taker->prev = L->tail;
-				L->tail = taker;
+				auto order = flow.generateOrder(true);
+				uint32_t r = rng() % 20;
+				if (r < 15)
+					gateway.newOrder(0, order.id, order.side, order.type, order.shares, order.price, order.stopPrice);
+				else if (r < 18)
+					gateway.cancel(0, order.id - 100);
+				else
+					gateway.modify(0, order.id - 50, order.shares + 5, order.price + 1);
+				while (primaryTrades->pop(t))
+					;
 			}
-			taker->parentLimit = L;
-			orderMap[id] = taker;
+			std::chrono::duration<double> secs = Clock::now() - t0;
+			publisher.close();
+			int status = 0;
+			waitpid(pid, &status, 0);
+
+			auto readFile = [](const std::string &path)
+			{
+				std::string data;
+				if (FILE *f = std::fopen(path.c_str(), "rb"))
+				{
+					char buf[1 << 16];
+					for (size_t n; (n = std::fread(buf, 1, sizeof(buf), f)) > 0;)
+						data.append(buf, n);
+					std::fclose(f);
+				}
+				return data;
+			};
+			bool standbyOk = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+			bool identical = standbyOk && primary.saveSnapshot(primarySnapshot.c_str(), gateway.lastSequence()) &&
+							 readFile(primarySnapshot) == readFile(standbySnapshot);
+
+			std::cout << "Throughput: " << TEST_SIZE / secs.count() / 1e6 << " Million TPS" << std::endl;
+			std::cout << "Standby Acknowledged: " << publisher.ackedSeq() << " of " << gateway.lastSequence() << " commands ("
+					  << publisher.bytesSent() / 1e6 << " MB shipped)" << std::endl;
+			printLatency("Replication Lag", publisher.lagSamples());
+			std::cout << "Standby Book: " << (identical ? "identical to primary" : "DIFFERS from primary") << std::endl;
 		}
 		else
 		{
-			mm.recycleOrder(taker);
+			std::cout << "Standby process could not be started" << std::endl;
+			if (pid > 0)
+			{
+				::kill(pid, SIGKILL);
+				waitpid(pid, nullptr, 0);
+			}
 		}
+		std::remove(primarySnapshot.c_str());
+		std::remove(standbySnapshot.c_str());
+	}
 
-		// Process triggered stops
-		for (const auto &ts : triggeredStops)
+	{
+		// The same statistical flow into fresh books without and with the
+		// market-by-price feed. A feed thread keeps a full-depth mirror from
+		// the Level messages and checks it against a top-10 snapshot taken
+		// every 10,000 updates.
+		std::cout << "\n=== Test 18: Market-by-Price Feed ===" << std::endl;
+		using Clock = std::chrono::steady_clock;
+		auto flow = [&](OrderBook &book, RingBuffer<65536> &trades)
 		{
-			uint64_t newId = generatedIdCounter++;
-			processOrderInternal(newId, ts.side, ts.convertToType, ts.shares, ts.limitPrice, 0, false);
+			OrderGenerator orders(21, 300.0, 50.0);
+			TradeReport t;
+			auto t0 = Clock::now();
+			for (int i = 0; i < TEST_SIZE; ++i)
+			{
+				auto order = orders.generateOrder(true);
+				book.processOrder(order.id, order.side, order.type, order.shares, order.price, order.stopPrice);
+				while (trades.pop(t))
+					;
+			}
+			return std::chrono::duration<double>(Clock::now() - t0).count();
+		};
+
+		auto trades = std::make_unique<RingBuffer<65536>>();
+		double plainSecs, feedSecs;
+		{
+			MemoryManager plainMm(TEST_SIZE * 3);
+			OrderBook plain(plainMm, *trades);
+			plainSecs = flow(plain, *trades);
 		}
-	}
 
-public:
-	OrderBook(MemoryManager &m, RingBuffer<65536> &rb) : mm(m), tradeBuffer(rb) {}
+		auto depth = std::make_unique<RingBuffer<65536, DepthUpdate>>();
+		MemoryManager feedMm(TEST_SIZE * 3);
+		OrderBook book(feedMm, *trades);
+		book.setDepthFeed(depth.get(), 10, 10000);
+		std::atomic<bool> feeding{true};
+		uint64_t levelUpdates = 0, snapshots = 0, gaps = 0, mismatches = 0;
+		std::thread feed([&]
+						 {
+            std::unordered_map<int64_t, std::pair<uint64_t, uint32_t>> mirror[2];
+            uint64_t seq = 0;
+            DepthUpdate u;
+            while (true) {
+                if (!depth->pop(u)) {
+                    if (!feeding.load(std::memory_order_acquire) && depth->size() == 0)
+                        break;
+                    std::this_thread::yield();
+                    continue;
+                }
+                gaps += u.seq != seq + 1;
+                seq = u.seq;
+                auto &side = mirror[static_cast<int>(u.side)];
+                if (u.type == DepthMsgType::Level) {
+                    ++levelUpdates;
+                    if (u.qty == 0)
+                        side.erase(u.price);
+                    else
+                        side[u.price] = {u.qty, u.orders};
+                } else if (u.type == DepthMsgType::Snapshot) {
+                    auto it = side.find(u.price);
+                    mismatches += it == side.end() || it->second != std::make_pair(u.qty, u.orders);
+                } else if (u.type == DepthMsgType::SnapshotEnd)
+                    ++snapshots;
+            } });
+		feedSecs = flow(book, *trades);
+		book.publishDepthSnapshot();
+		feeding.store(false, std::memory_order_release);
+		feed.join();
 
-	void processOrder(uint64_t id, Side side, OrderType type, uint32_t qty, int64_t price, int64_t stopPrice)
-	{
-		processOrderInternal(id, side, type, qty, price, stopPrice, true);
+		std::cout << "Throughput without/with Feed: " << TEST_SIZE / plainSecs / 1e6 << "/" << TEST_SIZE / feedSecs / 1e6
+				  << " Million TPS" << std::endl;
+		std::cout << "Level Updates: " << levelUpdates << " (" << static_cast<double>(levelUpdates) / TEST_SIZE << " per order, "
+				  << levelUpdates / feedSecs / 1e6 << " Million/s)" << std::endl;
+		std::cout << "Feed Cost on the Engine: " << (feedSecs - plainSecs) * 1e9 / TEST_SIZE << " ns/order" << std::endl;
+		std::cout << "Snapshots Checked: " << snapshots << ", Sequence Gaps: " << gaps << ", Mirror Mismatches: " << mismatches
+				  << std::endl;
 	}
 
-	bool cancelOrder(uint64_t orderId)
+	// Test 19: Market-by-order feed
 	{
-		auto it = orderMap.find(orderId);
-		if (it != orderMap.end())
-		{
-			Order *o = it->second;
-			Limit *L = o->parentLimit;
-
-			if (o->prev)
-				o->prev->next = o->next;
-			else
-				L->head = o->next;
+		std::cout << "\n=== Test 19: Market-by-Order Feed ===" << std::endl;
+		auto trades = std::make_unique<RingBuffer<65536>>();
+		auto events = std::make_unique<RingBuffer<65536, OrderFeedEvent>>();
+		MemoryManager feedMm(TEST_SIZE * 3);
+		OrderBook book(feedMm, *trades);
+		book.setOrderFeed(events.get());
 
-			if (o->next)
-				o->next->prev = o->prev;
-			else
-				L->tail = o->prev;
-
-			if (!L->head)
+		std::string feedPath = (std::filesystem::temp_directory_path() / "matching_engine_bench.itch").string();
+		int fd = open(feedPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		OrderFeedPublisher publisher(*events, 1);
+		if (fd < 0 || !publisher.start(fd))
+		{
+			std::cout << "Could not open " << feedPath << std::endl;
+		}
+		else
+		{
+			OrderGenerator orders(23, 300.0, 50.0);
+			TradeReport t;
+			auto t0 = std::chrono::steady_clock::now();
+			for (int i = 0; i < TEST_SIZE; ++i)
 			{
-				if (o->side == Side::Buy)
-					buyRoot = removeLimit(buyRoot, L->price);
+				auto order = orders.generateOrder(true);
+				if (i % 10 == 9)
+					book.modifyOrder(order.id - 50, order.shares + 5, order.price + 1);
+				else if (i % 10 == 8)
+					book.cancelOrder(order.id - 100);
 				else
-					sellRoot = removeLimit(sellRoot, L->price);
+					book.processOrder(order.id, order.side, order.type, order.shares, order.price, order.stopPrice);
+				while (trades->pop(t))
+					;
+				// One core here: give the publisher the CPU rather than
+				// overflow the ring
+				while (events->size() > 60000)
+					std::this_thread::yield();
 			}
+			publisher.stop();
+			double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+			close(fd);
 
-			orderMap.erase(it);
-			mm.recycleOrder(o);
-			return true;
+			uint64_t n = publisher.eventCount(), bytes = publisher.bytesWritten();
+			std::cout << "Events: " << n << " (" << static_cast<double>(n) / TEST_SIZE << " per command, "
+					  << n / secs / 1e6 << " Million/s end to end)" << std::endl;
+			std::cout << "Feed Size: " << bytes / 1e6 << " MB (" << static_cast<double>(bytes) / std::max<uint64_t>(n, 1)
+					  << " bytes/event)" << std::endl;
+			std::cout << "Encode Cost: " << publisher.encodeNanos() / std::max<uint64_t>(n, 1) << " ns/event" << std::endl;
+			std::cout << "Ring Overflows: " << book.orderFeedOverflows() << (publisher.hasFailed() ? ", write failed" : "")
+					  << std::endl;
 		}
+		std::remove(feedPath.c_str());
+	}
 
-		auto stopIt = stopOrderMap.find(orderId);
-		if (stopIt != stopOrderMap.end())
+	// Test 20: Conflated depth across many books
+	{
+		std::cout << "\n=== Test 20: Conflated Depth for 1,000 Books ===" << std::endl;
+		constexpr int BOOKS = 1000;
+		auto trades = std::make_unique<RingBuffer<65536>>();
+		auto depth = std::make_unique<RingBuffer<65536, DepthUpdate>>();
+		auto conflated = std::make_unique<RingBuffer<65536, DepthUpdate>>();
+		std::vector<std::unique_ptr<MemoryManager>> pools;
+		std::vector<std::unique_ptr<OrderBook>> books;
+		for (int b = 0; b < BOOKS; ++b)
 		{
-			Order *o = stopIt->second;
-			Limit *L = o->parentLimit;
+			pools.push_back(std::make_unique<MemoryManager>(TEST_SIZE * 3 / BOOKS));
+			books.push_back(std::make_unique<OrderBook>(*pools.back(), *trades));
+			books.back()->setDepthFeed(depth.get(), 10, 0, static_cast<uint16_t>(b));
+		}
 
-			if (o->prev)
-				o->prev->next = o->next;
-			else
-				L->head = o->next;
+		// The consumer keeps a full-depth mirror of every book from the
+		// conflated stream alone
+		std::vector<std::unordered_map<int64_t, std::pair<uint64_t, uint32_t>>> mirror(BOOKS * 2);
+		std::vector<uint64_t> lastSeq(BOOKS);
+		uint64_t consumed = 0, gaps = 0;
+		std::atomic<bool> consuming{true};
+		std::thread consumer([&]
+							 {
+            DepthUpdate u;
+            while (true) {
+                if (!conflated->pop(u)) {
+                    if (!consuming.load(std::memory_order_acquire) && conflated->size() == 0)
+                        break;
+                    std::this_thread::yield();
+                    continue;
+                }
+                ++consumed;
+                gaps += u.seq != lastSeq[u.book] + 1;
+                lastSeq[u.book] = u.seq;
+                auto &side = mirror[u.book * 2 + static_cast<int>(u.side)];
+                if (u.qty == 0)
+                    side.erase(u.price);
+                else
+                    side[u.price] = {u.qty, u.orders};
+            } });
 
-			if (o->next)
-				o->next->prev = o->prev;
-			else
-				L->tail = o->prev;
+		DepthConflationStage stage({depth.get()}, *conflated, BOOKS, 1000);
+		stage.start();
+		OrderGenerator orders(29, 300.0, 50.0);
+		TradeReport t;
+		auto t0 = std::chrono::steady_clock::now();
+		for (int i = 0; i < TEST_SIZE; ++i)
+		{
+			auto order = orders.generateOrder(true);
+			books[i % BOOKS]->processOrder(order.id, order.side, order.type, order.shares, order.price, order.stopPrice);
+			while (trades->pop(t))
+				;
+			while (depth->size() > 60000)
+				std::this_thread::yield();
+		}
+		stage.stop();
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		consuming.store(false, std::memory_order_release);
+		consumer.join();
 
-			if (!L->head)
+		// Check every mirror against a full-depth snapshot of its book
+		uint64_t mismatches = 0;
+		for (int b = 0; b < BOOKS; ++b)
+		{
+			books[b]->setDepthFeed(depth.get(), UINT32_MAX, 0, static_cast<uint16_t>(b));
+			books[b]->publishDepthSnapshot();
+			size_t levels = 0;
+			DepthUpdate u;
+			while (depth->pop(u))
 			{
-				if (o->side == Side::Buy)
-					stopBuyRoot = removeLimit(stopBuyRoot, L->price);
-				else
-					stopSellRoot = removeLimit(stopSellRoot, L->price);
+				if (u.type != DepthMsgType::Snapshot)
+					continue;
+				++levels;
+				auto &side = mirror[b * 2 + static_cast<int>(u.side)];
+				auto it = side.find(u.price);
+				mismatches += it == side.end() || it->second != std::make_pair(u.qty, u.orders);
 			}
-
-			stopOrderMap.erase(stopIt);
-			mm.recycleOrder(o);
-			return true;
+			mismatches += mirror[b * 2].size() + mirror[b * 2 + 1].size() != levels;
 		}
 
-		return false;
+		std::cout << "Level Updates In/Out: " << stage.updatesIn() << "/" << stage.updatesOut() << " ("
+				  << static_cast<double>(stage.updatesIn()) / std::max<uint64_t>(stage.updatesOut(), 1) << "x conflation, "
+				  << stage.flushCount() << " flushes)" << std::endl;
+		std::cout << "Engine Throughput: " << TEST_SIZE / secs / 1e6 << " Million TPS" << std::endl;
+		std::cout << "Consumed: " << consumed << ", Sequence Gaps: " << gaps << ", Input Gaps: " << stage.state().gaps()
+				  << ", Books Mismatched: " << mismatches << std::endl;
 	}
 
-	bool modifyOrder(uint64_t orderId, uint32_t newQty, int64_t newPrice)
+	// Test 21: Seqlock top of book
 	{
-		auto it = orderMap.find(orderId);
-		if (it == orderMap.end())
-			return false;
+		std::cout << "\n=== Test 21: Seqlock Top of Book ===" << std::endl;
+		constexpr int BOOKS = 64;
+		auto trades = std::make_unique<RingBuffer<65536>>();
+		auto flow = [&](bool withSlots, std::vector<BboSlot> &slots)
+		{
+			std::vector<std::unique_ptr<MemoryManager>> pools;
+			std::vector<std::unique_ptr<OrderBook>> books;
+			for (int b = 0; b < BOOKS; ++b)
+			{
+				pools.push_back(std::make_unique<MemoryManager>(TEST_SIZE * 3 / BOOKS));
+				books.push_back(std::make_unique<OrderBook>(*pools.back(), *trades));
+				if (withSlots)
+					books.back()->setBboSlot(&slots[b]);
+			}
+			OrderGenerator orders(31, 300.0, 50.0);
+			TradeReport t;
+			auto t0 = std::chrono::steady_clock::now();
+			for (int i = 0; i < TEST_SIZE; ++i)
+			{
+				auto order = orders.generateOrder(true);
+				books[i % BOOKS]->processOrder(order.id, order.side, order.type, order.shares, order.price, order.stopPrice);
+				while (trades->pop(t))
+					;
+			}
+			return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		};
+
+		std::vector<BboSlot> slots(BOOKS);
+		double plainSecs = flow(false, slots);
+		double slotSecs = flow(true, slots);
 
-		Order *o = it->second;
+		// A strategy thread polls every book's slot while the engine runs; a
+		// torn read would show up as a crossed or half-written quote
+		std::atomic<bool> reading{true};
+		uint64_t reads = 0, crossed = 0;
+		std::thread reader([&]
+						   {
+            while (reading.load(std::memory_order_acquire))
+                for (const BboSlot &slot : slots) {
+                    BboSnapshot q = slot.read();
+                    ++reads;
+                    crossed += q.bidQty && q.askQty && q.bidPrice >= q.askPrice;
+                    crossed += (q.bidQty == 0) != (q.bidPrice == 0) || (q.askQty == 0) != (q.askPrice == 0);
+                } });
+		uint64_t publishes = 0;
+		for (const BboSlot &slot : slots)
+			publishes -= slot.read().seq;
+		flow(true, slots);
+		reading.store(false, std::memory_order_release);
+		reader.join();
+		for (const BboSlot &slot : slots)
+			publishes += slot.read().seq;
 
-		if (newPrice == o->price)
+		std::cout << "Throughput without/with Slots: " << TEST_SIZE / plainSecs / 1e6 << "/" << TEST_SIZE / slotSecs / 1e6
+				  << " Million TPS (" << (slotSecs - plainSecs) * 1e9 / TEST_SIZE << " ns/order)" << std::endl;
+		std::cout << "Slot Writes: " << publishes << " (" << static_cast<double>(publishes) / TEST_SIZE << " per order)"
+				  << std::endl;
+		std::cout << "Reader: " << reads << " reads alongside the engine, Inconsistent Quotes: " << crossed << std::endl;
+	}
+
+	// Test 22: Immutable depth images for query threads
+	{
+		std::cout << "\n=== Test 22: Depth Images for Query Threads ===" << std::endl;
+		auto trades = std::make_unique<RingBuffer<65536>>();
+		auto images = std::make_unique<DepthImages>();
+		auto flow = [&](OrderBook &book)
 		{
-			o->shares = newQty;
-			return true;
-		}
+			OrderGenerator orders(37, 300.0, 50.0);
+			TradeReport t;
+			auto t0 = std::chrono::steady_clock::now();
+			for (int i = 0; i < TEST_SIZE; ++i)
+			{
+				auto order = orders.generateOrder(true);
+				book.processOrder(order.id, order.side, order.type, order.shares, order.price, order.stopPrice);
+				while (trades->pop(t))
+					;
+			}
+			return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		};
+		auto timed = [&](bool withImages)
+		{
+			MemoryManager pool(TEST_SIZE * 3);
+			OrderBook book(pool, *trades);
+			if (withImages)
+				book.setDepthImages(images.get(), 256);
+			return flow(book);
+		};
+		double plainSecs = timed(false);
+		double imageSecs = timed(true);
 
-		Limit *oldLimit = o->parentLimit;
-		Side side = o->side;
+		MemoryManager pool(TEST_SIZE * 3);
+		OrderBook book(pool, *trades);
+		book.setDepthImages(images.get(), 256);
 
-		if (o->prev)
-			o->prev->next = o->next;
-		else
-			oldLimit->head = o->next;
+		// Surveillance threads walk whole images while the engine runs; an
+		// image changing under a reader would show up as unsorted or crossed
+		// levels or a version going backwards
+		constexpr int READERS = 2;
+		std::atomic<bool> reading{true};
+		std::atomic<uint64_t> walks{0}, levelsRead{0}, broken{0};
+		std::vector<std::thread> readers;
+		for (int r = 0; r < READERS; ++r)
+			readers.emplace_back([&]
+								 {
+                int slot = images->attachReader();
+                uint64_t lastVersion = 0, n = 0, levels = 0, bad = 0;
+                while (reading.load(std::memory_order_acquire)) {
+                    const DepthImage &img = images->acquire(slot);
+                    bad += img.version < lastVersion;
+                    lastVersion = img.version;
+                    for (size_t i = 1; i < img.bids.size(); ++i)
+                        bad += img.bids[i].price >= img.bids[i - 1].price;
+                    for (size_t i = 1; i < img.asks.size(); ++i)
+                        bad += img.asks[i].price <= img.asks[i - 1].price;
+                    bad += !img.bids.empty() && !img.asks.empty() && img.bids[0].price >= img.asks[0].price;
+                    levels += img.bids.size() + img.asks.size();
+                    images->release(slot);
+                    ++n;
+                }
+                images->detachReader(slot);
+                walks += n;
+                levelsRead += levels;
+                broken += bad; });
+		flow(book);
+		reading.store(false, std::memory_order_release);
+		for (std::thread &t : readers)
+			t.join();
 
-		if (o->next)
-			o->next->prev = o->prev;
-		else
-			oldLimit->tail = o->prev;
+		// With no reader left the final image must match the book exactly
+		book.publishDepthImage();
+		int slot = images->attachReader();
+		const DepthImage &img = images->acquire(slot);
+		auto depth = std::make_unique<RingBuffer<65536, DepthUpdate>>();
+		book.setDepthFeed(depth.get(), UINT32_MAX);
+		book.publishDepthSnapshot();
+		size_t bid = 0, ask = 0;
+		uint64_t mismatches = 0;
+		DepthUpdate u;
+		while (depth->pop(u))
+		{
+			if (u.type != DepthMsgType::Snapshot)
+				continue;
+			const auto &levels = u.side == Side::Buy ? img.bids : img.asks;
+			size_t &i = u.side == Side::Buy ? bid : ask;
+			mismatches += i >= levels.size() || levels[i].price != u.price || levels[i].qty != u.qty || levels[i].orders != u.orders;
+			++i;
+		}
+		mismatches += bid != img.bids.size() || ask != img.asks.size();
+		uint64_t version = img.version;
+		size_t bids = img.bids.size(), asks = img.asks.size();
+		images->release(slot);
+		images->detachReader(slot);
+
+		std::cout << "Throughput without/with Images: " << TEST_SIZE / plainSecs / 1e6 << "/" << TEST_SIZE / imageSecs / 1e6
+				  << " Million TPS (" << (imageSecs - plainSecs) * 1e9 / TEST_SIZE << " ns/order)" << std::endl;
+		std::cout << "Images Published: " << version << ", Final Depth: " << bids << "/" << asks
+				  << " levels, Mismatches: " << mismatches << std::endl;
+		std::cout << "Readers: " << walks.load() << " walks over " << levelsRead.load() << " levels, Inconsistent Images: "
+				  << broken.load() << std::endl;
+	}
 
-		if (!oldLimit->head)
+	// Test 23: Trade analytics across many symbols
+	{
+		std::cout << "\n=== Test 23: Consumer Trade Analytics for 64 Symbols ===" << std::endl;
+		constexpr int SYMBOLS = 64;
+		std::vector<std::unique_ptr<RingBuffer<65536>>> rings;
+		std::vector<std::unique_ptr<MemoryManager>> pools;
+		std::vector<std::unique_ptr<OrderBook>> books;
+		for (int b = 0; b < SYMBOLS; ++b)
 		{
-			if (side == Side::Buy)
-				buyRoot = removeLimit(buyRoot, oldLimit->price);
-			else
-				sellRoot = removeLimit(sellRoot, oldLimit->price);
+			rings.push_back(std::make_unique<RingBuffer<65536>>());
+			pools.push_back(std::make_unique<MemoryManager>(TEST_SIZE * 3 / SYMBOLS));
+			books.push_back(std::make_unique<OrderBook>(*pools.back(), *rings.back()));
 		}
+		TradeAnalytics stats(SYMBOLS, {100, 1000, 10000});
 
-		o->price = newPrice;
-		o->shares = newQty;
-		o->prev = o->next = nullptr;
+		// The consumer drains every book's ring in batches and keeps the
+		// trades so the results can be recomputed from scratch afterwards
+		std::vector<std::vector<TradeReport>> kept(SYMBOLS);
+		std::atomic<bool> consuming{true};
+		double foldSecs = 0;
+		uint64_t batches = 0;
+		std::thread consumer([&]
+							 {
+            std::vector<TradeReport> batch(SYMBOLS * 256);
+            int counts[SYMBOLS];
+            while (true) {
+                bool stopping = !consuming.load(std::memory_order_acquire);
+                uint64_t n = 0;
+                for (int b = 0; b < SYMBOLS; ++b) {
+                    TradeReport *in = &batch[b * 256];
+                    int k = 0;
+                    while (k < 256 && rings[b]->pop(in[k]))
+                        ++k;
+                    kept[b].insert(kept[b].end(), in, in + k);
+                    counts[b] = k;
+                    n += k;
+                }
+                if (n) {
+                    auto t0 = std::chrono::steady_clock::now();
+                    for (int b = 0; b < SYMBOLS; ++b)
+                        for (int i = 0; i < counts[b]; ++i)
+                            stats.add(b, batch[b * 256 + i]);
+                    stats.publish();
+                    foldSecs += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+                    ++batches;
+                } else if (stopping)
+                    break;
+                else
+                    std::this_thread::yield();
+            } });
 
-		Limit *newLimit = nullptr;
-		if (side == Side::Buy)
-			buyRoot = insert(buyRoot, newPrice, newLimit);
-		else
-			sellRoot = insert(sellRoot, newPrice, newLimit);
+		// A dashboard thread polls every symbol; a torn snapshot would show
+		// up as a bar outside its own range or bigger than the running total
+		std::atomic<bool> reading{true};
+		uint64_t reads = 0, broken = 0;
+		std::thread reader([&]
+						   {
+            while (reading.load(std::memory_order_acquire))
+                for (int b = 0; b < SYMBOLS; ++b) {
+                    TradeStats s = stats.read(b);
+                    ++reads;
+                    for (size_t i = 0; i < stats.intervalCount(); ++i) {
+                        const Bar &bar = s.current[i];
+                        broken += bar.trades && (bar.low > bar.high || bar.open < bar.low || bar.open > bar.high ||
+                                                 bar.close < bar.low || bar.close > bar.high || bar.volume > s.volume ||
+                                                 bar.start % stats.interval(i) != 0);
+                    }
+                } });
 
-		if (!newLimit)
-			return false;
+		OrderGenerator orders(41, 300.0, 50.0);
+		auto t0 = std::chrono::steady_clock::now();
+		for (int i = 0; i < TEST_SIZE; ++i)
+		{
+			auto order = orders.generateOrder(true);
+			books[i % SYMBOLS]->processOrder(order.id, order.side, order.type, order.shares, order.price, order.stopPrice);
+			while (rings[i % SYMBOLS]->size() > 60000)
+				std::this_thread::yield();
+		}
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		consuming.store(false, std::memory_order_release);
+		consumer.join();
+		reading.store(false, std::memory_order_release);
+		reader.join();
 
-		if (!newLimit->head)
-			newLimit->head = newLimit->tail = o;
-		else
+		// Recompute every symbol's totals and newest bars from its trades
+		uint64_t trades = 0, mismatches = 0;
+		for (int b = 0; b < SYMBOLS; ++b)
 		{
-			newLimit->tail->next = o;
-			o->prev = newLimit->tail;
-			newLimit->tail = o;
+			TradeStats s = stats.read(b);
+			uint64_t volume = 0;
+			int64_t notional = 0;
+			for (const TradeReport &t : kept[b])
+			{
+				volume += t.qty;
+				notional += t.price * static_cast<int64_t>(t.qty);
+			}
+			trades += kept[b].size();
+			mismatches += s.trades != kept[b].size() || s.volume != volume || s.notional != notional;
+			for (size_t i = 0; i < stats.intervalCount() && !kept[b].empty(); ++i)
+			{
+				uint64_t iv = stats.interval(i), start = kept[b].back().timestamp / iv * iv;
+				Bar bar{start, 0, INT64_MIN, INT64_MAX, 0, 0, 0, 0};
+				for (auto it = kept[b].rbegin(); it != kept[b].rend() && it->timestamp >= start; ++it)
+				{
+					bar.open = it->price;
+					bar.close = bar.trades ? bar.close : it->price;
+					bar.high = std::max(bar.high, it->price);
+					bar.low = std::min(bar.low, it->price);
+					bar.volume += it->qty;
+					bar.notional += it->price * static_cast<int64_t>(it->qty);
+					bar.trades++;
+				}
+				const Bar &got = s.current[i];
+				mismatches += got.start != bar.start || got.open != bar.open || got.high != bar.high || got.low != bar.low ||
+							  got.close != bar.close || got.volume != bar.volume || got.notional != bar.notional ||
+							  got.trades != bar.trades;
+			}
 		}
-		o->parentLimit = newLimit;
 
-		return true;
+		TradeStats first = stats.read(0);
+		std::cout << "Engine Throughput: " << TEST_SIZE / secs / 1e6 << " Million TPS" << std::endl;
+		std::cout << "Trades: " << trades << " in " << batches << " batches, Analytics Cost: "
+				  << foldSecs * 1e9 / std::max<uint64_t>(trades, 1) << " ns/trade (" << stats.publishes() << " publishes)"
+				  << std::endl;
+		std::cout << "Symbol 0: VWAP " << first.vwap() << ", Last 1k-Tick Bar O/H/L/C " << first.completed[1].open << "/"
+				  << first.completed[1].high << "/" << first.completed[1].low << "/" << first.completed[1].close << ", Volume "
+				  << first.completed[1].volume << std::endl;
+		std::cout << "Reader: " << reads << " snapshots alongside the engine, Inconsistent: " << broken
+				  << ", Recomputed Mismatches: " << mismatches << std::endl;
 	}
 
-	size_t getOrderCount() const { return orderMap.size(); }
-	size_t getStopOrderCount() const { return stopOrderMap.size(); }
-};
+	// Test 24: Book signals published with the BBO
+	{
+		std::cout << "\n=== Test 24: Imbalance, Microprice and Depth-Weighted Mid ===" << std::endl;
+		auto trades = std::make_unique<RingBuffer<65536>>();
+		auto feed = std::make_unique<RingBuffer<65536, DepthUpdate>>();
+		uint64_t checked = 0, mismatches = 0;
+		BboSnapshot sample;
+		auto flow = [&](uint32_t depth, bool check)
+		{
+			MemoryManager pool(TEST_SIZE * 3);
+			OrderBook book(pool, *trades);
+			BboSlot slot;
+			book.setBboSlot(&slot, depth);
+			OrderGenerator orders(43, 300.0, 50.0);
+			TradeReport t;
+			auto t0 = std::chrono::steady_clock::now();
+			for (int i = 0; i < TEST_SIZE; ++i)
+			{
+				auto order = orders.generateOrder(true);
+				book.processOrder(order.id, order.side, order.type, order.shares, order.price, order.stopPrice);
+				while (trades->pop(t))
+					;
+				if (!check || i % 97)
+					continue;
 
-// --- 6. BENCHMARK SUITE ---
-void runBenchmark(const char *name, OrderBook &engine,
-				  std::function<void(int)> testFunc,
-				  int testSize, RingBuffer<65536> &tradeBuffer)
-{
-	std::cout << "\n=== " << name << " ===" << std::endl;
+				// Recompute the aggregates from a depth snapshot of the book
+				book.setDepthFeed(feed.get(), depth);
+				book.publishDepthSnapshot();
+				book.setDepthFeed(nullptr);
+				uint64_t qty[2] = {}, top[2] = {};
+				int64_t notional[2] = {};
+				DepthUpdate u;
+				while (feed->pop(u))
+					if (u.type == DepthMsgType::Snapshot)
+					{
+						int s = static_cast<int>(u.side);
+						top[s] = top[s] ? top[s] : u.qty;
+						qty[s] += u.qty;
+						notional[s] += u.price * static_cast<int64_t>(u.qty);
+					}
+				BboSnapshot q = slot.read();
+				++checked;
+				mismatches += q.bidDepth != qty[0] || q.askDepth != qty[1] || q.bidNotional != notional[0] ||
+							  q.askNotional != notional[1] || q.bidQty != top[0] || q.askQty != top[1];
+				if (q.twoSided())
+					sample = q;
+			}
+			return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		};
+		double bboSecs = flow(0, false);
+		double depthSecs = flow(5, false);
+		flow(5, true);
 
-	auto start = std::chrono::high_resolution_clock::now();
-	testFunc(testSize);
-	auto end = std::chrono::high_resolution_clock::now();
+		std::cout << "Throughput BBO only/with 5-Level Depth: " << TEST_SIZE / bboSecs / 1e6 << "/"
+				  << TEST_SIZE / depthSecs / 1e6 << " Million TPS (" << (depthSecs - bboSecs) * 1e9 / TEST_SIZE
+				  << " ns/order)" << std::endl;
+		std::cout << "Sample: " << sample.bidQty << " @ " << sample.bidPrice << " / " << sample.askQty << " @ "
+				  << sample.askPrice << ", Imbalance " << sample.imbalance() << ", Microprice " << sample.microprice()
+				  << ", Depth Imbalance " << sample.depthImbalance() << ", Depth-Weighted Mid " << sample.depthWeightedMid()
+				  << std::endl;
+		std::cout << "Checked Against Snapshots: " << checked << ", Mismatches: " << mismatches << std::endl;
+	}
 
-	std::chrono::duration<double> diff = end - start;
+	// Test 25: Passive book builders fed by the market-by-order feed
+	{
+		std::cout << "\n=== Test 25: Passive Book Builder with Gap Recovery ===" << std::endl;
+		auto trades = std::make_unique<RingBuffer<65536>>();
+		auto events = std::make_unique<RingBuffer<65536, OrderFeedEvent>>();
+		MemoryManager engineMm(TEST_SIZE * 3), mirrorMm(TEST_SIZE * 3), lossyMm(TEST_SIZE * 3);
+		OrderBook source(engineMm, *trades), mirror(mirrorMm, *trades), lossy(lossyMm, *trades);
+		source.setOrderFeed(events.get());
 
-	std::cout << "Throughput: " << (testSize / diff.count()) / 1e6 << " Million TPS" << std::endl;
-	std::cout << "Regular Orders in Book: " << engine.getOrderCount() << std::endl;
-	std::cout << "Stop Orders in Book: " << engine.getStopOrderCount() << std::endl;
-	std::cout << "Trades Pending: " << tradeBuffer.size() << std::endl;
-}
+		// Each command's events go out as one feed packet. The mirror
+		// decodes every packet and serves snapshots; the lossy builder drops
+		// one packet in 100,000 and resyncs from the next snapshot
+		BookBuilder full(mirror), partial(lossy);
+		ItchEncoder encoder(1);
+		auto tmp = std::filesystem::temp_directory_path();
+		std::string snapPath = (tmp / "matching_engine_bench.feedsnap").string();
+		bool haveSnapshot = false;
+		std::mt19937_64 loss(13);
+		uint64_t dropped = 0, failedResyncs = 0, decodeErrors = 0;
+		double applySecs = 0;
 
-int main()
-{
-	const int TEST_SIZE = 1000000;
-	MemoryManager mm(TEST_SIZE * 3);
-	RingBuffer<65536> tradeBuffer;
+		OrderGenerator orders(47, 300.0, 50.0);
+		TradeReport t;
+		OrderFeedEvent e;
+		std::vector<uint8_t> packet(1 << 16);
+		auto send = [&](uint8_t *end)
+		{
+			encoder.endPacket();
+			if (encoder.packetMessages() == 0)
+				return;
+			uint64_t before = encoder.lastSequence() - encoder.packetMessages();
+			auto t0 = std::chrono::steady_clock::now();
+			decodeErrors += !ItchDecoder::decodePacket(packet.data(), end, [&](uint64_t seq, const OrderFeedEvent &m)
+													   { full.apply(seq, m); });
+			applySecs += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+			if (loss() % 100000 == 0)
+				++dropped;
+			else
+				ItchDecoder::decodePacket(packet.data(), end, [&](uint64_t seq, const OrderFeedEvent &m)
+										  { partial.apply(seq, m); });
+			if (before / 50000 != encoder.lastSequence() / 50000)
+			{
+				haveSnapshot = mirror.saveSnapshot(snapPath.c_str(), full.lastApplied());
+				if (partial.isStale() && haveSnapshot)
+					failedResyncs += !partial.resync(snapPath.c_str());
+			}
+		};
+		for (int i = 0; i < TEST_SIZE; ++i)
+		{
+			auto order = orders.generateOrder(true);
+			if (i % 10 == 9)
+				source.modifyOrder(order.id - 50, order.shares + 5, order.price + 1);
+			else if (i % 10 == 8)
+				source.cancelOrder(order.id - 100);
+			else
+				source.processOrder(order.id, order.side, order.type, order.shares, order.price, order.stopPrice);
+			while (trades->pop(t))
+				;
+			do
+			{
+				uint8_t *p = encoder.beginPacket(packet.data());
+				while (p + 2 * ItchEncoder::MAX_MESSAGE <= packet.data() + packet.size() && encoder.packetHasRoom() &&
+					   events->pop(e))
+					p = encoder.encode(p, e);
+				send(p);
+			} while (events->size() > 0);
+		}
+		while (trades->pop(t))
+			;
+		send(encoder.finish(encoder.beginPacket(packet.data())));
+		// A packet lost after the last periodic snapshot needs one more
+		if (partial.isStale() && mirror.saveSnapshot(snapPath.c_str(), full.lastApplied()))
+			failedResyncs += !partial.resync(snapPath.c_str());
 
-	std::atomic<bool> running{true};
-	std::atomic<uint64_t> totalTrades{0};
+		// The lossy builder must end up byte for byte where the mirror is,
+		// and the mirror's displayed depth where the engine's is
+		std::string mirrorPath = (tmp / "matching_engine_bench.mirror").string();
+		std::string lossyPath = (tmp / "matching_engine_bench.lossy").string();
+		auto slurp = [](const std::string &path)
+		{
+			std::string bytes;
+			if (FILE *f = std::fopen(path.c_str(), "rb"))
+			{
+				char buf[1 << 16];
+				size_t n;
+				while ((n = std::fread(buf, 1, sizeof buf, f)) > 0)
+					bytes.append(buf, n);
+				std::fclose(f);
+			}
+			return bytes;
+		};
+		bool same = !partial.isStale() && mirror.saveSnapshot(mirrorPath.c_str(), full.lastApplied()) &&
+					lossy.saveSnapshot(lossyPath.c_str(), partial.lastApplied()) && slurp(mirrorPath) == slurp(lossyPath);
 
-	std::thread consumer([&]()
-						 {
-        TradeReport t;
-        while (running.load(std::memory_order_relaxed)) {
-            if (tradeBuffer.pop(t))
-                totalTrades.fetch_add(1, std::memory_order_relaxed);
-            else
-                std::this_thread::yield();
-        }
-        while (tradeBuffer.pop(t))
-            totalTrades.fetch_add(1, std::memory_order_relaxed); });
+		auto depthOf = [&](OrderBook &book)
+		{
+			auto ring = std::make_unique<RingBuffer<65536, DepthUpdate>>();
+			book.setDepthFeed(ring.get(), UINT32_MAX);
+			book.publishDepthSnapshot();
+			book.setDepthFeed(nullptr);
+			std::vector<std::tuple<Side, int64_t, uint64_t, uint32_t>> levels;
+			DepthUpdate u;
+			while (ring->pop(u))
+				if (u.type == DepthMsgType::Snapshot)
+					levels.push_back({u.side, u.price, u.qty, u.orders});
+			return levels;
+		};
+		auto sourceDepth = depthOf(source);
+		bool depthMatches = sourceDepth == depthOf(mirror);
 
-	OrderBook engine(mm, tradeBuffer);
-	OrderGenerator generator(42, 300.0, 50.0);
+		uint64_t messages = encoder.lastSequence();
+		std::cout << "Messages Decoded and Applied: " << full.lastApplied() << " (" << messages / std::max(applySecs, 1e-9) / 1e6
+				  << " Million/s, " << applySecs * 1e9 / std::max<uint64_t>(messages, 1) << " ns/message)" << std::endl;
+		std::cout << "Mirror: " << mirror.getOrderCount() << " orders on " << sourceDepth.size() << " levels, "
+				  << (depthMatches && mirror.getOrderCount() == source.getOrderCount() ? "matches the engine" : "MISMATCH")
+				  << ", Errors: " << full.errors() + decodeErrors << std::endl;
+		std::cout << "Lossy Builder: " << dropped << " packets dropped, " << partial.gaps() << " gaps, " << partial.resyncs()
+				  << " resyncs (" << failedResyncs << " short), " << (same ? "identical to the mirror" : "DIVERGED")
+				  << std::endl;
+		std::remove(snapPath.c_str());
+		std::remove(mirrorPath.c_str());
+		std::remove(lossyPath.c_str());
+	}
 
-	std::cout << "Starting Fixed Matching Engine..." << std::endl;
+	// Test 26: Binary order entry decoded into a gateway
+	{
+		std::cout << "\n=== Test 26: SBE-Style Order Entry Decoder ===" << std::endl;
+		auto trades = std::make_unique<RingBuffer<65536>>();
 
-	runBenchmark("Test 1: Statistical Orders", engine, [&](int n)
-				 {
-        for (int i = 0; i < 10000; ++i) {
-            auto order = generator.generateOrder(false);
-            engine.processOrder(order.id, order.side, OrderType::Limit, 
-                              order.shares, order.price, 0);
-        }
+		// One flow, run as direct calls or encoded as messages: new orders
+		// for eight accounts, cancels, replaces and a mass cancel every
+		// 10,000 messages, plus an unknown template now and then
+		auto flow = [&](auto &&onNew, auto &&onCancel, auto &&onReplace, auto &&onMassCancel, auto &&onUnknown)
+		{
+			OrderGenerator orders(53, 300.0, 50.0);
+			for (int i = 0; i < TEST_SIZE; ++i)
+			{
+				auto order = orders.generateOrder(true);
+				if (i % 10000 == 9999)
+					onMassCancel(static_cast<uint32_t>(i / 10000 % 8), static_cast<uint8_t>(1 + i / 10000 % 3));
+				else if (i % 100000 == 50000)
+					onUnknown();
+				else if (i % 10 == 9)
+					onReplace(order.id - 50, order.id + 5000000000ull, order.shares + 5, order.price + 1);
+				else if (i % 10 == 8)
+					onCancel(order.id - 100);
+				else
+					onNew(order.id, order.side, order.type, order.shares, order.price, order.stopPrice, static_cast<uint32_t>(i % 8));
+			}
+		};
 
-        for (int i = 0; i < n; ++i) {
-            auto order = generator.generateOrder(true);
-            engine.processOrder(order.id, order.side, order.type,
-                              order.shares, order.price, order.stopPrice);
-            
-            if (i > 100 && i % 7 == 0)
-                engine.cancelOrder(order.id - (rand() % 50 + 10));
-        } }, TEST_SIZE, tradeBuffer);
+		std::vector<uint8_t> wire;
+		wire.reserve(static_cast<size_t>(TEST_SIZE) * (SbeHeader::BLOCK_LENGTH + NewOrderMsg::BLOCK_LENGTH));
+		auto room = [&](size_t n)
+		{
+			size_t at = wire.size();
+			wire.resize(at + n);
+			return wire.data() + at;
+		};
+		flow([&](uint64_t id, Side side, OrderType type, uint32_t qty, int64_t price, int64_t stop, uint32_t account)
+			 { encodeSbe<NewOrderMsg>(room(SbeHeader::BLOCK_LENGTH + NewOrderMsg::BLOCK_LENGTH), id, price, stop, qty, 0u, account,
+									  static_cast<uint8_t>(side), static_cast<uint8_t>(type), uint8_t{0}); },
+			 [&](uint64_t id)
+			 { encodeSbe<CancelMsg>(room(SbeHeader::BLOCK_LENGTH + CancelMsg::BLOCK_LENGTH), id); },
+			 [&](uint64_t id, uint64_t newId, uint32_t qty, int64_t price)
+			 { encodeSbe<ReplaceMsg>(room(SbeHeader::BLOCK_LENGTH + ReplaceMsg::BLOCK_LENGTH), id, newId, price, qty); },
+			 [&](uint32_t account, uint8_t sides)
+			 { encodeSbe<MassCancelMsg>(room(SbeHeader::BLOCK_LENGTH + MassCancelMsg::BLOCK_LENGTH), account, sides); },
+			 [&]
+			 { SbeHeader::put(room(SbeHeader::BLOCK_LENGTH + 5), 5, 99, SbeHeader::SCHEMA_ID, SbeHeader::SCHEMA_VERSION); });
 
-	std::vector<uint64_t> activeOrders;
-	runBenchmark("Test 2: Order Modification", engine, [&](int n)
-				 {
-        uint64_t baseId = generator.getNextId();
-        
-        for (int i = 0; i < n; ++i) {
-            if (i % 3 == 0) {
-                engine.processOrder(baseId + i, Side::Buy, OrderType::Limit, 10, 300 + (i % 10), 0);
-                activeOrders.push_back(baseId + i);
-            } else if (i % 3 == 1 && !activeOrders.empty()) {
-                engine.modifyOrder(activeOrders[i % activeOrders.size()], 15, 300 + (i % 15));
-            } else if (!activeOrders.empty()) {
-                engine.cancelOrder(activeOrders.back());
-                activeOrders.pop_back();
-            }
-        } }, TEST_SIZE, tradeBuffer);
+		TradeReport t;
+		MemoryManager directMm(TEST_SIZE * 3), decodedMm(TEST_SIZE * 3);
+		OrderBook direct(directMm, *trades), decoded(decodedMm, *trades);
+		auto t0 = std::chrono::steady_clock::now();
+		flow([&](uint64_t id, Side side, OrderType type, uint32_t qty, int64_t price, int64_t stop, uint32_t account)
+			 {
+                 direct.processOrder(id, side, type, qty, price, stop, {0, false, account});
+                 while (trades->pop(t))
+                     ; },
+			 [&](uint64_t id)
+			 { direct.cancelOrder(id); },
+			 [&](uint64_t id, uint64_t newId, uint32_t qty, int64_t price)
+			 {
+                 direct.replaceOrder(id, newId, qty, price);
+                 while (trades->pop(t))
+                     ; },
+			 [&](uint32_t account, uint8_t sides)
+			 { direct.massCancel(account, sides & 1, sides & 2); },
+			 [] {});
+		double directSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		// Less the cost of generating the flow itself
+		t0 = std::chrono::steady_clock::now();
+		flow([](uint64_t, Side, OrderType, uint32_t, int64_t, int64_t, uint32_t) {}, [](uint64_t) {},
+			 [](uint64_t, uint64_t, uint32_t, int64_t) {}, [](uint32_t, uint8_t) {}, [] {});
+		directSecs -= std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
 
-	runBenchmark("Test 3: Mixed Workload", engine, [&](int n)
-				 {
-        for (int i = 0; i < n; ++i) {
-            auto order = generator.generateOrder(true);
-            
-            double r = static_cast<double>(rand()) / RAND_MAX;
-            if (r < 0.75) {
-                engine.processOrder(order.id, order.side, order.type,
-                                  order.shares, order.price, order.stopPrice);
-            } else if (r < 0.90) {
-                engine.cancelOrder(order.id - 100);
-            } else {
-                engine.modifyOrder(order.id - 50, order.shares + 5, order.price + 1);
-            }
-        } }, TEST_SIZE, tradeBuffer);
+		// The wire arrives in 1,500-byte reads that cut messages anywhere;
+		// the unconsumed tail moves to the front of the receive buffer.
+		// Decoded messages are sequenced by a gateway in front of the book.
+		Gateway gateway(decoded);
+		SbeOrderDecoder decoder(gateway);
+		uint8_t rx[4096];
+		size_t held = 0, sent = 0;
+		t0 = std::chrono::steady_clock::now();
+		while (sent < wire.size() || held)
+		{
+			size_t n = std::min<size_t>(1500, wire.size() - sent);
+			std::memcpy(rx + held, wire.data() + sent, n);
+			sent += n;
+			size_t have = held + n, used = 0;
+			// A 64-byte window holds one message, so the trade ring is
+			// drained after each one as in the direct run
+			while (used < have)
+			{
+				size_t step = decoder.decode(rx + used, std::min<size_t>(have - used, 64));
+				if (step == 0)
+					break;
+				used += step;
+				while (trades->pop(t))
+					;
+			}
+			held = have - used;
+			std::memmove(rx, rx + used, held);
+			if (n == 0)
+				break;
+		}
+		double decodedSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
 
-	running.store(false, std::memory_order_relaxed);
-	consumer.join();
+		auto tmp = std::filesystem::temp_directory_path();
+		std::string directPath = (tmp / "matching_engine_bench.direct").string();
+		std::string decodedPath = (tmp / "matching_engine_bench.decoded").string();
+		// Orders in queue order must match; the header's padding may not
+		bool same = direct.getStopOrderCount() == decoded.getStopOrderCount() &&
+					direct.getRejectCount() == decoded.getRejectCount();
+		if (direct.saveSnapshot(directPath.c_str(), 0) && decoded.saveSnapshot(decodedPath.c_str(), 0))
+		{
+			std::ifstream a(directPath, std::ios::binary), b(decodedPath, std::ios::binary);
+			a.seekg(sizeof(SnapshotHeader));
+			b.seekg(sizeof(SnapshotHeader));
+			same = same && std::equal(std::istreambuf_iterator<char>(a), {}, std::istreambuf_iterator<char>(b), {});
+		}
+		else
+			same = false;
+		std::remove(directPath.c_str());
+		std::remove(decodedPath.c_str());
+
+		uint64_t msgs = decoder.messageCount();
+		std::cout << "Messages: " << msgs << " (" << static_cast<double>(wire.size()) / std::max<uint64_t>(msgs, 1)
+				  << " bytes each), Rejected: " << decoder.rejectCount() << ", Malformed: " << decoder.malformedCount()
+				  << ", Left Over: " << held << " bytes, Sequenced: " << gateway.lastSequence() << std::endl;
+		std::cout << "Throughput Direct/Decoded: " << TEST_SIZE / directSecs / 1e6 << "/" << msgs / decodedSecs / 1e6
+				  << " Million msgs/s (" << (decodedSecs - directSecs) * 1e9 / std::max<uint64_t>(msgs, 1) << " ns/message)"
+				  << std::endl;
+		std::cout << "Books: " << direct.getOrderCount() << "/" << decoded.getOrderCount() << " orders, "
+				  << (same ? "identical" : "MISMATCH") << std::endl;
+	}
 
 	std::cout << "\n=== FINAL RESULTS ===" << std::endl;
 	std::cout << "Total Trades Executed: " << totalTrades.load() << std::endl;